@@ -0,0 +1,223 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+#include <system_error>
+
+using namespace std;
+using namespace llvm;
+
+/**
+ * Synthetic NVVM IR kernels, each shaped to stress one path of the
+ * analyses as size grows:
+ *
+ *   callchain  size functions deep, each call site a context for inContexts
+ *   phis       a PHI joining size blocks, each behind its own branch, for
+ *              applyDominatingCondition
+ *   affine     two sums of size affine terms which cancel but for the last,
+ *              for cancelDiffs
+ *   unrolled   size iterations of a strided loop, fully unrolled, each an
+ *              access for requestsPerWarp
+ */
+enum Shape {
+  CallChain,
+  Phis,
+  Affine,
+  Unrolled
+};
+
+static cl::opt<Shape> KernelShape("shape", cl::Required,
+    cl::desc("Kind of kernel to generate"),
+    cl::values(clEnumValN(CallChain, "callchain", "Deep chain of device function calls"),
+               clEnumValN(Phis, "phis", "Many-way PHI behind a chain of branches"),
+               clEnumValN(Affine, "affine", "Large affine sums which cancel"),
+               clEnumValN(Unrolled, "unrolled", "Fully unrolled strided loop")));
+
+static cl::opt<unsigned> Size("size", cl::init(16),
+    cl::desc("How large to make the stressed construct"));
+
+static cl::opt<string> OutputFilename("o", cl::init("-"),
+    cl::desc("Output file"), cl::value_desc("filename"));
+
+static const char *const Prologue =
+  "target datalayout = \"e-i64:64-v16:16-v32:32-n16:32:64\"\n"
+  "target triple = \"nvptx64-nvidia-cuda\"\n"
+  "\n"
+  "declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()\n"
+  "declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()\n"
+  "declare i32 @llvm.nvvm.read.ptx.sreg.ntid.x()\n"
+  "\n";
+
+static const char *const KernelArgs =
+  "float addrspace(1)* %a, i32 addrspace(1)* %u, i32 %n";
+
+/**
+ * The kernel's entry block up to its global thread index, %gid
+ */
+static void emitKernelEntry(raw_ostream& out) {
+  out << "define void @kernel(" << KernelArgs << ") {\n"
+      << "entry:\n"
+      << "  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()\n"
+      << "  %bid = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()\n"
+      << "  %bdim = call i32 @llvm.nvvm.read.ptx.sreg.ntid.x()\n"
+      << "  %base = mul i32 %bid, %bdim\n"
+      << "  %gid = add i32 %base, %tid\n";
+}
+
+static void emitKernelEnd(raw_ostream& out) {
+  out << "  ret void\n"
+      << "}\n"
+      << "\n"
+      << "!nvvm.annotations = !{!0}\n"
+      << "!0 = !{void (" << "float addrspace(1)*, i32 addrspace(1)*, i32"
+      << ")* @kernel, !\"kernel\", i32 1}\n";
+}
+
+/**
+ * Store to a[idx], idx an i32 named by name
+ */
+static void emitStore(raw_ostream& out, const string& name, const string& idx) {
+  out << "  %" << name << ".x = sext i32 " << idx << " to i64\n"
+      << "  %" << name << ".p = getelementptr float, float addrspace(1)* %a, i64 %"
+      << name << ".x\n"
+      << "  store float 1.0, float addrspace(1)* %" << name << ".p\n";
+}
+
+static void genCallChain(raw_ostream& out, unsigned depth) {
+  // Each level scales the index and passes it down; the last one accesses
+  for(unsigned d=depth; d-- > 0; ) {
+    out << "define internal void @level" << d << "(float addrspace(1)* %a, i32 %i) {\n"
+        << "entry:\n"
+        << "  %s = mul i32 %i, " << (d % 3 + 1) << "\n"
+        << "  %j = add i32 %s, " << d << "\n";
+    if(d + 1 < depth) {
+      out << "  call void @level" << (d + 1) << "(float addrspace(1)* %a, i32 %j)\n";
+    } else {
+      out << "  %x = sext i32 %j to i64\n"
+          << "  %p = getelementptr float, float addrspace(1)* %a, i64 %x\n"
+          << "  store float 1.0, float addrspace(1)* %p\n";
+    }
+    out << "  ret void\n"
+        << "}\n\n";
+  }
+
+  emitKernelEntry(out);
+  // Several call sites, so each level is reached in several contexts
+  out << "  %t2 = mul i32 %tid, 2\n"
+      << "  %t33 = mul i32 %tid, 33\n"
+      << "  %tn = add i32 %tid, %n\n"
+      << "  call void @level0(float addrspace(1)* %a, i32 %tid)\n"
+      << "  call void @level0(float addrspace(1)* %a, i32 %t2)\n"
+      << "  call void @level0(float addrspace(1)* %a, i32 %t33)\n"
+      << "  call void @level0(float addrspace(1)* %a, i32 %tn)\n";
+  emitKernelEnd(out);
+}
+
+static void genPhis(raw_ostream& out, unsigned ways) {
+  emitKernelEntry(out);
+  out << "  %sel = urem i32 %tid, " << ways << "\n"
+      << "  br label %test0\n";
+  for(unsigned w=0; w<ways; w++) {
+    out << "test" << w << ":\n"
+        << "  %c" << w << " = icmp eq i32 %sel, " << w << "\n"
+        << "  br i1 %c" << w << ", label %case" << w << ", label %"
+        << (w + 1 < ways ? "test" + to_string(w + 1) : string("default")) << "\n"
+        << "case" << w << ":\n"
+        << "  %m" << w << " = mul i32 %tid, " << (w % 5 + 1) << "\n"
+        << "  %v" << w << " = add i32 %m" << w << ", " << (w * 32) << "\n"
+        << "  br label %merge\n";
+  }
+  out << "default:\n"
+      << "  br label %merge\n"
+      << "merge:\n"
+      << "  %idx = phi i32 ";
+  for(unsigned w=0; w<ways; w++)
+    out << "[ %v" << w << ", %case" << w << " ], ";
+  out << "[ %gid, %default ]\n";
+  emitStore(out, "merged", "%idx");
+  // Branching on the PHI needs the conditions which decide it
+  out << "  %lt = icmp slt i32 %idx, 64\n"
+      << "  br i1 %lt, label %small, label %done\n"
+      << "small:\n";
+  emitStore(out, "small", "%gid");
+  out << "  br label %done\n"
+      << "done:\n";
+  emitKernelEnd(out);
+}
+
+static void genAffine(raw_ostream& out, unsigned terms) {
+  emitKernelEntry(out);
+  // Two sums over the same terms, built from separate values, so only
+  // cancellation shows that their difference is the final term
+  for(unsigned sum=0; sum<2; sum++) {
+    unsigned count = sum == 0 ? terms : terms - 1;
+    string prev = "%gid";
+    for(unsigned t=0; t<count; t++) {
+      string name = "s" + to_string(sum) + "." + to_string(t);
+      out << "  %" << name << ".up = getelementptr i32, i32 addrspace(1)* %u, i64 " << t << "\n"
+          << "  %" << name << ".uv = load i32, i32 addrspace(1)* %" << name << ".up\n"
+          << "  %" << name << ".tm = mul i32 %tid, " << (t % 7 + 1) << "\n"
+          << "  %" << name << ".nm = mul i32 %n, " << (t + 1) << "\n"
+          << "  %" << name << ".a = add i32 %" << name << ".tm, %" << name << ".uv\n"
+          << "  %" << name << ".b = add i32 %" << name << ".a, %" << name << ".nm\n"
+          << "  %" << name << " = add i32 " << prev << ", %" << name << ".b\n";
+      prev = "%" + name;
+    }
+  }
+  out << "  %diff = sub i32 %s0." << (terms - 1) << ", %s1." << (terms - 2) << "\n";
+  emitStore(out, "diff", "%diff");
+  emitKernelEnd(out);
+}
+
+static void genUnrolled(raw_ostream& out, unsigned iterations) {
+  emitKernelEntry(out);
+  static const unsigned strides[] = { 1, 2, 1, 33, 1, 4 };
+  for(unsigned i=0; i<iterations; i++) {
+    string name = "it" + to_string(i);
+    out << "  %" << name << ".s = mul i32 %gid, " << strides[i % 6] << "\n"
+        << "  %" << name << ".o = mul i32 %n, " << i << "\n"
+        << "  %" << name << ".i = add i32 %" << name << ".s, %" << name << ".o\n"
+        << "  %" << name << ".x = sext i32 %" << name << ".i to i64\n"
+        << "  %" << name << ".p = getelementptr float, float addrspace(1)* %a, i64 %"
+        << name << ".x\n"
+        << "  %" << name << ".v = load float, float addrspace(1)* %" << name << ".p\n"
+        << "  %" << name << ".w = fadd float %" << name << ".v, 1.0\n"
+        << "  store float %" << name << ".w, float addrspace(1)* %" << name << ".p\n";
+  }
+  emitKernelEnd(out);
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Synthetic NVVM kernel generator\n");
+
+  if(Size < 2) {
+    errs() << "gpucheck-gen: -size must be at least 2\n";
+    return 1;
+  }
+
+  error_code EC;
+  raw_fd_ostream out(OutputFilename, EC, sys::fs::F_Text);
+  if(EC) {
+    errs() << "gpucheck-gen: " << OutputFilename << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  out << Prologue;
+  switch(KernelShape) {
+    case CallChain:
+      genCallChain(out, Size);
+      break;
+    case Phis:
+      genPhis(out, Size);
+      break;
+    case Affine:
+      genAffine(out, Size);
+      break;
+    case Unrolled:
+      genUnrolled(out, Size);
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "BugEmitter.h"
+#include "MemCoalesceAnalysis.h"
+#include "BranchDivergeAnalysis.h"
+#include "Utilities.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+using namespace gpucheck;
+
+static cl::list<string> InputFilenames(cl::Positional, cl::OneOrMore,
+    cl::desc("<input bitcode or IR files>"));
+
+static cl::opt<unsigned> Repeat("repeat", cl::init(3),
+    cl::desc("Runs per input; the fastest time of each stage is reported"));
+
+static cl::opt<string> OutputFilename("o", cl::init("-"),
+    cl::desc("Output file for the JSON report"), cl::value_desc("filename"));
+
+/**
+ * Each stage of the pipeline, in the order it runs. The analyses are
+ * requested explicitly before the passes which use them, and the offset
+ * analyses are built for every function up front, so their time isn't
+ * charged to the first pass. Offset expressions are still built as the
+ * passes query them, so that time is the passes' own.
+ */
+static const char *const Stages[] = {
+  "parse",
+  "threaddep",
+  "gpuaddr",
+  "offset-prop",
+  "coalesce",
+  "bdiverge"
+};
+static const unsigned NumStages = sizeof(Stages) / sizeof(Stages[0]);
+
+struct InputTimes {
+  double seconds[NumStages];
+  size_t warningBytes;
+  // Counters from one run, by name
+  vector<pair<string, unsigned>> statistics;
+  bool failed;
+};
+
+/**
+ * Time each stage over one fresh copy of the input
+ */
+static bool runOnce(const string& filename, double seconds[], size_t& warningBytes) {
+  typedef chrono::steady_clock Clock;
+  unsigned stage = 0;
+  Clock::time_point start = Clock::now();
+  auto lap = [&] {
+    Clock::time_point now = Clock::now();
+    seconds[stage++] = chrono::duration<double>(now - start).count();
+    start = now;
+  };
+
+  LLVMContext context;
+  SMDiagnostic err;
+  unique_ptr<Module> M = parseIRFile(filename, err, context);
+  if(!M) {
+    err.print("gpucheck-bench", errs());
+    return false;
+  }
+  lap();
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  registerGpuCheckAnalyses(MAM);
+  start = Clock::now();
+
+  string warnings;
+  raw_string_ostream out(warnings);
+  setWarningStream(&out);
+
+  MAM.getResult<ThreadDependenceAnalysis>(*M);
+  lap();
+  MAM.getResult<AddrSpaceAnalysisNPM>(*M);
+  lap();
+  MAM.getResult<OffsetPropagationAnalysis>(*M)->prepareAnalyses();
+  lap();
+  MemCoalescePass().run(*M, MAM);
+  lap();
+  BranchDivergePass().run(*M, MAM);
+  lap();
+
+  setWarningStream(nullptr);
+  warningBytes = out.str().size();
+  return true;
+}
+
+/**
+ * The value of every counter so far. Counters of different passes may
+ * share a name, in which case they are added together.
+ */
+static StringMap<unsigned> countStatistics() {
+  StringMap<unsigned> counts;
+  const vector<pair<StringRef, unsigned>> stats = GetStatistics();
+  for(auto stat=stats.begin(),e=stats.end(); stat!=e; ++stat)
+    counts[stat->first] += stat->second;
+  return counts;
+}
+
+int main(int argc, char **argv) {
+  llvm_shutdown_obj shutdown;
+  cl::ParseCommandLineOptions(argc, argv, "Benchmark of the GPU analysis passes\n");
+  // Collect the counters without printing them at exit
+  EnableStatistics(false);
+
+  unsigned runs = Repeat ? Repeat : 1;
+  vector<InputTimes> results(InputFilenames.size());
+  for(unsigned i=0; i<InputFilenames.size(); i++) {
+    InputTimes& result = results[i];
+    result.failed = false;
+    // Counters only ever grow, so an input's are the difference it made
+    StringMap<unsigned> before = countStatistics();
+    for(unsigned r=0; r<runs; r++) {
+      double seconds[NumStages];
+      if(!runOnce(InputFilenames[i], seconds, result.warningBytes)) {
+        result.failed = true;
+        break;
+      }
+      for(unsigned s=0; s<NumStages; s++) {
+        if(r == 0 || seconds[s] < result.seconds[s])
+          result.seconds[s] = seconds[s];
+      }
+    }
+
+    // Every run does the same work, so report one run's worth
+    StringMap<unsigned> after = countStatistics();
+    for(auto stat=after.begin(),e=after.end(); stat!=e; ++stat) {
+      unsigned delta = (stat->second - before.lookup(stat->first())) / runs;
+      if(delta)
+        result.statistics.push_back(make_pair(stat->first().str(), delta));
+    }
+    std::sort(result.statistics.begin(), result.statistics.end());
+  }
+
+  error_code EC;
+  raw_fd_ostream out(OutputFilename, EC, sys::fs::F_Text);
+  if(EC) {
+    errs() << "gpucheck-bench: " << OutputFilename << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  bool failed = false;
+  out << "{\n\t\"repeat\": " << runs << ",\n";
+  out << "\t\"inputs\": [\n";
+  for(unsigned i=0; i<results.size(); i++) {
+    out << "\t\t{\"file\": ";
+    printJSONString(out, InputFilenames[i]);
+    out << ", ";
+    if(results[i].failed) {
+      out << "\"failed\": true}";
+      failed = true;
+    } else {
+      out << "\"warning_bytes\": " << results[i].warningBytes << ", \"seconds\": {";
+      double total = 0;
+      for(unsigned s=0; s<NumStages; s++) {
+        out << "\"" << Stages[s] << "\": " << format("%.6f", results[i].seconds[s]) << ", ";
+        total += results[i].seconds[s];
+      }
+      out << "\"total\": " << format("%.6f", total) << "}, \"statistics\": {";
+      const vector<pair<string, unsigned>>& stats = results[i].statistics;
+      for(auto stat=stats.begin(),e=stats.end(); stat!=e; ++stat) {
+        printJSONString(out, stat->first);
+        out << ": " << stat->second << (stat + 1 != e ? ", " : "");
+      }
+      out << "}}";
+    }
+    out << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "\t]\n}\n";
+  return failed ? 1 : 0;
+}
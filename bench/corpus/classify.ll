@@ -0,0 +1,96 @@
+; Per-thread classification into one of eight bins, each bin computing its
+; output slot differently, merged through one PHI and then branched on
+;
+;   __global__ void classify(const int *keys, float *out, int n) {
+;     int gid = blockIdx.x * blockDim.x + threadIdx.x;
+;     int k = keys[gid] & 7, slot;
+;     if (k == 0) slot = gid;
+;     else if (k == 1) slot = gid * 2;
+;     else if (k == 2) slot = gid + n;
+;     else if (k == 3) slot = threadIdx.x * 33;
+;     else if (k == 4) slot = gid * 4 + 1;
+;     else if (k == 5) slot = n - gid;
+;     else if (k == 6) slot = gid + 32;
+;     else slot = gid * 8;
+;     out[slot] = 1.0f;
+;     if (slot < n) out[gid] = 0.0f;
+;   }
+target datalayout = "e-i64:64-v16:16-v32:32-n16:32:64"
+target triple = "nvptx64-nvidia-cuda"
+
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ntid.x()
+
+define void @classify(i32 addrspace(1)* %keys, float addrspace(1)* %out, i32 %n) {
+entry:
+  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+  %bid = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+  %bdim = call i32 @llvm.nvvm.read.ptx.sreg.ntid.x()
+  %base = mul i32 %bid, %bdim
+  %gid = add i32 %base, %tid
+  %gidx = sext i32 %gid to i64
+  %pk = getelementptr i32, i32 addrspace(1)* %keys, i64 %gidx
+  %key = load i32, i32 addrspace(1)* %pk
+  %k = and i32 %key, 7
+  %c0 = icmp eq i32 %k, 0
+  br i1 %c0, label %bin0, label %test1
+test1:
+  %c1 = icmp eq i32 %k, 1
+  br i1 %c1, label %bin1, label %test2
+test2:
+  %c2 = icmp eq i32 %k, 2
+  br i1 %c2, label %bin2, label %test3
+test3:
+  %c3 = icmp eq i32 %k, 3
+  br i1 %c3, label %bin3, label %test4
+test4:
+  %c4 = icmp eq i32 %k, 4
+  br i1 %c4, label %bin4, label %test5
+test5:
+  %c5 = icmp eq i32 %k, 5
+  br i1 %c5, label %bin5, label %test6
+test6:
+  %c6 = icmp eq i32 %k, 6
+  br i1 %c6, label %bin6, label %bin7
+bin0:
+  br label %merge
+bin1:
+  %s1 = shl i32 %gid, 1
+  br label %merge
+bin2:
+  %s2 = add i32 %gid, %n
+  br label %merge
+bin3:
+  %s3 = mul i32 %tid, 33
+  br label %merge
+bin4:
+  %s4a = shl i32 %gid, 2
+  %s4 = or i32 %s4a, 1
+  br label %merge
+bin5:
+  %s5 = sub i32 %n, %gid
+  br label %merge
+bin6:
+  %s6 = add i32 %gid, 32
+  br label %merge
+bin7:
+  %s7 = shl i32 %gid, 3
+  br label %merge
+merge:
+  %slot = phi i32 [ %gid, %bin0 ], [ %s1, %bin1 ], [ %s2, %bin2 ], [ %s3, %bin3 ], [ %s4, %bin4 ], [ %s5, %bin5 ], [ %s6, %bin6 ], [ %s7, %bin7 ]
+  %slotx = sext i32 %slot to i64
+  %ps = getelementptr float, float addrspace(1)* %out, i64 %slotx
+  store float 1.0, float addrspace(1)* %ps
+  %inside = icmp slt i32 %slot, %n
+  br i1 %inside, label %clear, label %exit
+clear:
+  %pg = getelementptr float, float addrspace(1)* %out, i64 %gidx
+  store float 0.0, float addrspace(1)* %pg
+  br label %exit
+exit:
+  ret void
+}
+
+!nvvm.annotations = !{!0}
+!0 = !{void (i32 addrspace(1)*, float addrspace(1)*, i32)* @classify, !"kernel", i32 1}
@@ -0,0 +1,104 @@
+; Block-wide sum through shared memory, with the load and the final
+; accumulation behind layers of device functions as after partial inlining
+;
+;   __device__ float fetch(const float *in, int i) { return in[i]; }
+;   __device__ float fetchStrided(const float *in, int i, int s) { return fetch(in, i * s); }
+;   __device__ float fetchPair(const float *in, int i, int s) {
+;     return fetchStrided(in, 2 * i, s) + fetchStrided(in, 2 * i + 1, s);
+;   }
+;
+;   __global__ void reduce(const float *in, float *out, int stride) {
+;     __shared__ float partial[256];
+;     int tid = threadIdx.x;
+;     partial[tid] = fetchPair(in, blockIdx.x * blockDim.x + tid, stride);
+;     __syncthreads();
+;     for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+;       if (tid < s) partial[tid] += partial[tid + s];
+;       __syncthreads();
+;     }
+;     if (tid == 0) out[blockIdx.x] = partial[0];
+;   }
+target datalayout = "e-i64:64-v16:16-v32:32-n16:32:64"
+target triple = "nvptx64-nvidia-cuda"
+
+@partial = internal addrspace(3) global [256 x float] undef, align 4
+
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ntid.x()
+declare void @llvm.nvvm.barrier0()
+
+define internal float @fetch(float addrspace(1)* %in, i32 %i) {
+entry:
+  %ix = sext i32 %i to i64
+  %p = getelementptr float, float addrspace(1)* %in, i64 %ix
+  %v = load float, float addrspace(1)* %p
+  ret float %v
+}
+
+define internal float @fetchStrided(float addrspace(1)* %in, i32 %i, i32 %s) {
+entry:
+  %is = mul i32 %i, %s
+  %v = call float @fetch(float addrspace(1)* %in, i32 %is)
+  ret float %v
+}
+
+define internal float @fetchPair(float addrspace(1)* %in, i32 %i, i32 %s) {
+entry:
+  %i2 = shl i32 %i, 1
+  %a = call float @fetchStrided(float addrspace(1)* %in, i32 %i2, i32 %s)
+  %i21 = or i32 %i2, 1
+  %b = call float @fetchStrided(float addrspace(1)* %in, i32 %i21, i32 %s)
+  %v = fadd float %a, %b
+  ret float %v
+}
+
+define void @reduce(float addrspace(1)* %in, float addrspace(1)* %out, i32 %stride) {
+entry:
+  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+  %bid = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+  %bdim = call i32 @llvm.nvvm.read.ptx.sreg.ntid.x()
+  %base = mul i32 %bid, %bdim
+  %gid = add i32 %base, %tid
+  %v = call float @fetchPair(float addrspace(1)* %in, i32 %gid, i32 %stride)
+  %tidx = sext i32 %tid to i64
+  %pt = getelementptr [256 x float], [256 x float] addrspace(3)* @partial, i64 0, i64 %tidx
+  store float %v, float addrspace(3)* %pt
+  call void @llvm.nvvm.barrier0()
+  %s0 = lshr i32 %bdim, 1
+  %any = icmp sgt i32 %s0, 0
+  br i1 %any, label %loop, label %final
+loop:
+  %s = phi i32 [ %s0, %entry ], [ %snext, %latch ]
+  %active = icmp slt i32 %tid, %s
+  br i1 %active, label %add, label %latch
+add:
+  %o = add i32 %tid, %s
+  %ox = sext i32 %o to i64
+  %po = getelementptr [256 x float], [256 x float] addrspace(3)* @partial, i64 0, i64 %ox
+  %vo = load float, float addrspace(3)* %po
+  %vt = load float, float addrspace(3)* %pt
+  %sum = fadd float %vt, %vo
+  store float %sum, float addrspace(3)* %pt
+  br label %latch
+latch:
+  call void @llvm.nvvm.barrier0()
+  %snext = lshr i32 %s, 1
+  %more = icmp sgt i32 %snext, 0
+  br i1 %more, label %loop, label %final
+final:
+  %first = icmp eq i32 %tid, 0
+  br i1 %first, label %write, label %exit
+write:
+  %p0 = getelementptr [256 x float], [256 x float] addrspace(3)* @partial, i64 0, i64 0
+  %total = load float, float addrspace(3)* %p0
+  %bidx = sext i32 %bid to i64
+  %pout = getelementptr float, float addrspace(1)* %out, i64 %bidx
+  store float %total, float addrspace(1)* %pout
+  br label %exit
+exit:
+  ret void
+}
+
+!nvvm.annotations = !{!0}
+!0 = !{void (float addrspace(1)*, float addrspace(1)*, i32)* @reduce, !"kernel", i32 1}
@@ -0,0 +1,36 @@
+; Scatter through a negated loaded index, whose thread-dependent term picks
+; up a negative coefficient and must not cancel between lanes
+;
+;   __global__ void scatter(const int *idx, float *out) {
+;     int p = idx[threadIdx.x];
+;     int twice = p - p * -1;
+;     out[twice] = 1.0f;
+;     if (twice > 0) out[twice] = 2.0f;
+;   }
+target datalayout = "e-i64:64-v16:16-v32:32-n16:32:64"
+target triple = "nvptx64-nvidia-cuda"
+
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+
+define void @scatter(i32 addrspace(1)* %idx, float addrspace(1)* %out) {
+entry:
+  %tid = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+  %ti = sext i32 %tid to i64
+  %ip = getelementptr i32, i32 addrspace(1)* %idx, i64 %ti
+  %p = load i32, i32 addrspace(1)* %ip
+  %neg = mul i32 %p, -1
+  %twice = sub i32 %p, %neg
+  %ix = sext i32 %twice to i64
+  %op = getelementptr float, float addrspace(1)* %out, i64 %ix
+  store float 1.0, float addrspace(1)* %op
+  %c = icmp sgt i32 %twice, 0
+  br i1 %c, label %then, label %done
+then:
+  store float 2.0, float addrspace(1)* %op
+  br label %done
+done:
+  ret void
+}
+
+!nvvm.annotations = !{!0}
+!0 = !{void (i32 addrspace(1)*, float addrspace(1)*)* @scatter, !"kernel", i32 1}
@@ -0,0 +1,150 @@
+; 5-point Jacobi stencil over a 2D grid, unrolled four rows per thread,
+; with a guard against the grid edges
+;
+;   __global__ void jacobi(const float *in, float *out, int w, int h) {
+;     int x = blockIdx.x * blockDim.x + threadIdx.x;
+;     int y0 = (blockIdx.y * blockDim.y + threadIdx.y) * 4;
+;     if (x < 1 || x >= w - 1) return;
+;     #pragma unroll
+;     for (int r = 0; r < 4; r++) {
+;       int i = (y0 + r) * w + x;
+;       out[i] = 0.2f * (in[i] + in[i-1] + in[i+1] + in[i-w] + in[i+w]);
+;     }
+;   }
+target datalayout = "e-i64:64-v16:16-v32:32-n16:32:64"
+target triple = "nvptx64-nvidia-cuda"
+
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.y()
+declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.y()
+declare i32 @llvm.nvvm.read.ptx.sreg.ntid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ntid.y()
+
+define void @jacobi(float addrspace(1)* %in, float addrspace(1)* %out, i32 %w, i32 %h) {
+entry:
+  %tx = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+  %ty = call i32 @llvm.nvvm.read.ptx.sreg.tid.y()
+  %bx = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+  %by = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.y()
+  %dx = call i32 @llvm.nvvm.read.ptx.sreg.ntid.x()
+  %dy = call i32 @llvm.nvvm.read.ptx.sreg.ntid.y()
+  %bxd = mul i32 %bx, %dx
+  %x = add i32 %bxd, %tx
+  %byd = mul i32 %by, %dy
+  %yb = add i32 %byd, %ty
+  %y0 = shl i32 %yb, 2
+  %lo = icmp slt i32 %x, 1
+  br i1 %lo, label %exit, label %checkhi
+checkhi:
+  %wm1 = add i32 %w, -1
+  %hi = icmp sge i32 %x, %wm1
+  br i1 %hi, label %exit, label %body
+body:
+  %r0.y = add i32 %y0, 0
+  %r0.row = mul i32 %r0.y, %w
+  %r0.i = add i32 %r0.row, %x
+  %r0.ix = sext i32 %r0.i to i64
+  %r0.pc = getelementptr float, float addrspace(1)* %in, i64 %r0.ix
+  %r0.c = load float, float addrspace(1)* %r0.pc
+  %r0.pl = getelementptr float, float addrspace(1)* %r0.pc, i64 -1
+  %r0.l = load float, float addrspace(1)* %r0.pl
+  %r0.pr = getelementptr float, float addrspace(1)* %r0.pc, i64 1
+  %r0.r = load float, float addrspace(1)* %r0.pr
+  %r0.iu = sub i32 %r0.i, %w
+  %r0.iux = sext i32 %r0.iu to i64
+  %r0.pu = getelementptr float, float addrspace(1)* %in, i64 %r0.iux
+  %r0.u = load float, float addrspace(1)* %r0.pu
+  %r0.id = add i32 %r0.i, %w
+  %r0.idx = sext i32 %r0.id to i64
+  %r0.pd = getelementptr float, float addrspace(1)* %in, i64 %r0.idx
+  %r0.d = load float, float addrspace(1)* %r0.pd
+  %r0.s1 = fadd float %r0.c, %r0.l
+  %r0.s2 = fadd float %r0.s1, %r0.r
+  %r0.s3 = fadd float %r0.s2, %r0.u
+  %r0.s4 = fadd float %r0.s3, %r0.d
+  %r0.v = fmul float %r0.s4, 0x3FC99999A0000000
+  %r0.po = getelementptr float, float addrspace(1)* %out, i64 %r0.ix
+  store float %r0.v, float addrspace(1)* %r0.po
+  %r1.y = add i32 %y0, 1
+  %r1.row = mul i32 %r1.y, %w
+  %r1.i = add i32 %r1.row, %x
+  %r1.ix = sext i32 %r1.i to i64
+  %r1.pc = getelementptr float, float addrspace(1)* %in, i64 %r1.ix
+  %r1.c = load float, float addrspace(1)* %r1.pc
+  %r1.pl = getelementptr float, float addrspace(1)* %r1.pc, i64 -1
+  %r1.l = load float, float addrspace(1)* %r1.pl
+  %r1.pr = getelementptr float, float addrspace(1)* %r1.pc, i64 1
+  %r1.r = load float, float addrspace(1)* %r1.pr
+  %r1.iu = sub i32 %r1.i, %w
+  %r1.iux = sext i32 %r1.iu to i64
+  %r1.pu = getelementptr float, float addrspace(1)* %in, i64 %r1.iux
+  %r1.u = load float, float addrspace(1)* %r1.pu
+  %r1.id = add i32 %r1.i, %w
+  %r1.idx = sext i32 %r1.id to i64
+  %r1.pd = getelementptr float, float addrspace(1)* %in, i64 %r1.idx
+  %r1.d = load float, float addrspace(1)* %r1.pd
+  %r1.s1 = fadd float %r1.c, %r1.l
+  %r1.s2 = fadd float %r1.s1, %r1.r
+  %r1.s3 = fadd float %r1.s2, %r1.u
+  %r1.s4 = fadd float %r1.s3, %r1.d
+  %r1.v = fmul float %r1.s4, 0x3FC99999A0000000
+  %r1.po = getelementptr float, float addrspace(1)* %out, i64 %r1.ix
+  store float %r1.v, float addrspace(1)* %r1.po
+  %r2.y = add i32 %y0, 2
+  %r2.row = mul i32 %r2.y, %w
+  %r2.i = add i32 %r2.row, %x
+  %r2.ix = sext i32 %r2.i to i64
+  %r2.pc = getelementptr float, float addrspace(1)* %in, i64 %r2.ix
+  %r2.c = load float, float addrspace(1)* %r2.pc
+  %r2.pl = getelementptr float, float addrspace(1)* %r2.pc, i64 -1
+  %r2.l = load float, float addrspace(1)* %r2.pl
+  %r2.pr = getelementptr float, float addrspace(1)* %r2.pc, i64 1
+  %r2.r = load float, float addrspace(1)* %r2.pr
+  %r2.iu = sub i32 %r2.i, %w
+  %r2.iux = sext i32 %r2.iu to i64
+  %r2.pu = getelementptr float, float addrspace(1)* %in, i64 %r2.iux
+  %r2.u = load float, float addrspace(1)* %r2.pu
+  %r2.id = add i32 %r2.i, %w
+  %r2.idx = sext i32 %r2.id to i64
+  %r2.pd = getelementptr float, float addrspace(1)* %in, i64 %r2.idx
+  %r2.d = load float, float addrspace(1)* %r2.pd
+  %r2.s1 = fadd float %r2.c, %r2.l
+  %r2.s2 = fadd float %r2.s1, %r2.r
+  %r2.s3 = fadd float %r2.s2, %r2.u
+  %r2.s4 = fadd float %r2.s3, %r2.d
+  %r2.v = fmul float %r2.s4, 0x3FC99999A0000000
+  %r2.po = getelementptr float, float addrspace(1)* %out, i64 %r2.ix
+  store float %r2.v, float addrspace(1)* %r2.po
+  %r3.y = add i32 %y0, 3
+  %r3.row = mul i32 %r3.y, %w
+  %r3.i = add i32 %r3.row, %x
+  %r3.ix = sext i32 %r3.i to i64
+  %r3.pc = getelementptr float, float addrspace(1)* %in, i64 %r3.ix
+  %r3.c = load float, float addrspace(1)* %r3.pc
+  %r3.pl = getelementptr float, float addrspace(1)* %r3.pc, i64 -1
+  %r3.l = load float, float addrspace(1)* %r3.pl
+  %r3.pr = getelementptr float, float addrspace(1)* %r3.pc, i64 1
+  %r3.r = load float, float addrspace(1)* %r3.pr
+  %r3.iu = sub i32 %r3.i, %w
+  %r3.iux = sext i32 %r3.iu to i64
+  %r3.pu = getelementptr float, float addrspace(1)* %in, i64 %r3.iux
+  %r3.u = load float, float addrspace(1)* %r3.pu
+  %r3.id = add i32 %r3.i, %w
+  %r3.idx = sext i32 %r3.id to i64
+  %r3.pd = getelementptr float, float addrspace(1)* %in, i64 %r3.idx
+  %r3.d = load float, float addrspace(1)* %r3.pd
+  %r3.s1 = fadd float %r3.c, %r3.l
+  %r3.s2 = fadd float %r3.s1, %r3.r
+  %r3.s3 = fadd float %r3.s2, %r3.u
+  %r3.s4 = fadd float %r3.s3, %r3.d
+  %r3.v = fmul float %r3.s4, 0x3FC99999A0000000
+  %r3.po = getelementptr float, float addrspace(1)* %out, i64 %r3.ix
+  store float %r3.v, float addrspace(1)* %r3.po
+  br label %exit
+exit:
+  ret void
+}
+
+!nvvm.annotations = !{!0}
+!0 = !{void (float addrspace(1)*, float addrspace(1)*, i32, i32)* @jacobi, !"kernel", i32 1}
@@ -0,0 +1,84 @@
+; Matrix transpose, naive and through a shared-memory tile
+;
+;   __global__ void transposeNaive(float *out, const float *in, int n) {
+;     int x = blockIdx.x * 32 + threadIdx.x, y = blockIdx.y * 32 + threadIdx.y;
+;     out[x * n + y] = in[y * n + x];
+;   }
+;
+;   __global__ void transposeTiled(float *out, const float *in, int n) {
+;     __shared__ float tile[32][33];
+;     int x = blockIdx.x * 32 + threadIdx.x, y = blockIdx.y * 32 + threadIdx.y;
+;     tile[threadIdx.y][threadIdx.x] = in[y * n + x];
+;     __syncthreads();
+;     x = blockIdx.y * 32 + threadIdx.x; y = blockIdx.x * 32 + threadIdx.y;
+;     out[y * n + x] = tile[threadIdx.x][threadIdx.y];
+;   }
+target datalayout = "e-i64:64-v16:16-v32:32-n16:32:64"
+target triple = "nvptx64-nvidia-cuda"
+
+@tile = internal addrspace(3) global [32 x [33 x float]] undef, align 4
+
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.tid.y()
+declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+declare i32 @llvm.nvvm.read.ptx.sreg.ctaid.y()
+declare void @llvm.nvvm.barrier0()
+
+define void @transposeNaive(float addrspace(1)* %out, float addrspace(1)* %in, i32 %n) {
+entry:
+  %tx = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+  %ty = call i32 @llvm.nvvm.read.ptx.sreg.tid.y()
+  %bx = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+  %by = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.y()
+  %bx32 = shl i32 %bx, 5
+  %x = add i32 %bx32, %tx
+  %by32 = shl i32 %by, 5
+  %y = add i32 %by32, %ty
+  %yn = mul i32 %y, %n
+  %src = add i32 %yn, %x
+  %srcx = sext i32 %src to i64
+  %ps = getelementptr float, float addrspace(1)* %in, i64 %srcx
+  %v = load float, float addrspace(1)* %ps
+  %xn = mul i32 %x, %n
+  %dst = add i32 %xn, %y
+  %dstx = sext i32 %dst to i64
+  %pd = getelementptr float, float addrspace(1)* %out, i64 %dstx
+  store float %v, float addrspace(1)* %pd
+  ret void
+}
+
+define void @transposeTiled(float addrspace(1)* %out, float addrspace(1)* %in, i32 %n) {
+entry:
+  %tx = call i32 @llvm.nvvm.read.ptx.sreg.tid.x()
+  %ty = call i32 @llvm.nvvm.read.ptx.sreg.tid.y()
+  %bx = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.x()
+  %by = call i32 @llvm.nvvm.read.ptx.sreg.ctaid.y()
+  %bx32 = shl i32 %bx, 5
+  %x = add i32 %bx32, %tx
+  %by32 = shl i32 %by, 5
+  %y = add i32 %by32, %ty
+  %yn = mul i32 %y, %n
+  %src = add i32 %yn, %x
+  %srcx = sext i32 %src to i64
+  %ps = getelementptr float, float addrspace(1)* %in, i64 %srcx
+  %v = load float, float addrspace(1)* %ps
+  %txx = sext i32 %tx to i64
+  %tyx = sext i32 %ty to i64
+  %pt = getelementptr [32 x [33 x float]], [32 x [33 x float]] addrspace(3)* @tile, i64 0, i64 %tyx, i64 %txx
+  store float %v, float addrspace(3)* %pt
+  call void @llvm.nvvm.barrier0()
+  %x2 = add i32 %by32, %tx
+  %y2 = add i32 %bx32, %ty
+  %pt2 = getelementptr [32 x [33 x float]], [32 x [33 x float]] addrspace(3)* @tile, i64 0, i64 %txx, i64 %tyx
+  %t = load float, float addrspace(3)* %pt2
+  %y2n = mul i32 %y2, %n
+  %dst = add i32 %y2n, %x2
+  %dstx = sext i32 %dst to i64
+  %pd = getelementptr float, float addrspace(1)* %out, i64 %dstx
+  store float %t, float addrspace(1)* %pd
+  ret void
+}
+
+!nvvm.annotations = !{!0, !1}
+!0 = !{void (float addrspace(1)*, float addrspace(1)*, i32)* @transposeNaive, !"kernel", i32 1}
+!1 = !{void (float addrspace(1)*, float addrspace(1)*, i32)* @transposeTiled, !"kernel", i32 1}
@@ -4,6 +4,10 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -20,6 +24,8 @@ using namespace gpucheck;
 
 #define DEBUG_TYPE "gpuaddr"
 
+STATISTIC(NumNonGlobalPointers, "Number of pointers inferred to address only shared or local memory");
+
 namespace {
   // NVPTX-defined namespaces
   enum AddrSpace {
@@ -32,11 +38,78 @@ namespace {
   };
 }
 
+namespace {
+  // The address spaces a pointer may point into, as a set
+  enum SpaceSet {
+    InGlobal = 1 << 0,
+    InShared = 1 << 1,
+    InConstant = 1 << 2,
+    InLocal = 1 << 3,
+    InUnknown = 1 << 4
+  };
+}
+
+/**
+ * The set a pointer's type alone decides, or 0 for a generic pointer
+ */
+static unsigned getTypeSpaces(Type *ty) {
+  switch(ty->getPointerAddressSpace()) {
+    case AddrSpace::Generic: return 0;
+    case AddrSpace::Global: return InGlobal;
+    case AddrSpace::Shared: return InShared;
+    case AddrSpace::Constant: return InConstant;
+    case AddrSpace::Local: return InLocal;
+    default: return InUnknown;
+  }
+}
+
+/**
+ * The set of a pointer which is known without looking at its operands, or
+ * 0 if they decide it
+ */
+static unsigned getLeafSpaces(const Value *v) {
+  if(unsigned typed = getTypeSpaces(v->getType()))
+    return typed;
+  if(isa<AllocaInst>(v))
+    return InLocal;
+  // Generic globals are placed in global memory
+  if(isa<GlobalVariable>(v))
+    return InGlobal;
+  return 0;
+}
+
+/**
+ * The set of a constant pointer, which depends only on other constants
+ */
+static unsigned getConstantSpaces(const llvm::Constant *C) {
+  if(!C->getType()->isPointerTy())
+    return InUnknown;
+  if(unsigned leaf = getLeafSpaces(C))
+    return leaf;
+  // Points nowhere, so adds nothing where it joins other pointers
+  if(isa<ConstantPointerNull>(C) || isa<UndefValue>(C))
+    return 0;
+  if(auto CE=dyn_cast<ConstantExpr>(C)) {
+    switch(CE->getOpcode()) {
+      case Instruction::AddrSpaceCast:
+      case Instruction::BitCast:
+      case Instruction::GetElementPtr:
+        return getConstantSpaces(CE->getOperand(0));
+      case Instruction::Select:
+        return getConstantSpaces(CE->getOperand(1)) | getConstantSpaces(CE->getOperand(2));
+      default:
+        break;
+    }
+  }
+  return InUnknown;
+}
+
 void AddrSpaceAnalysis::getAnalysisUsage(AnalysisUsage& AU) const {
   AU.setPreservesAll();
 }
 
 bool AddrSpaceAnalysis::runOnModule(Module &M) {
+  inferSpaces(M);
   DEBUG(
   for(auto F=M.begin(),e=M.end();F!=e; ++F) {
     for(auto B=F->begin(),e=F->end();B!=e; ++B) {
@@ -48,48 +121,183 @@ bool AddrSpaceAnalysis::runOnModule(Module &M) {
       }
     }
   });
-  // Lazy Analysis
   return false;
 }
 
-bool AddrSpaceAnalysis::mayBeGlobal(Value *v) {
-  // Attempt to dig down to the base
-  if(auto L=dyn_cast<LoadInst>(v)) {
-    return mayBeGlobal(L->getPointerOperand());
+unsigned AddrSpaceAnalysis::lookup(const Value *v) {
+  auto found = spaces.find(v);
+  if(found != spaces.end())
+    return found->second;
+  // Instructions and arguments not yet reached start empty, and grow
+  if(isa<Instruction>(v) || isa<Argument>(v))
+    return 0;
+  if(auto C=dyn_cast<llvm::Constant>(v))
+    return getConstantSpaces(C);
+  return InUnknown;
+}
+
+unsigned AddrSpaceAnalysis::transfer(const Value *v) {
+  if(!v->getType()->isPointerTy())
+    return InUnknown;
+  if(unsigned leaf = getLeafSpaces(v))
+    return leaf;
+
+  if(auto PN=dyn_cast<PHINode>(v)) {
+    unsigned set = 0;
+    for(unsigned i=0; i<PN->getNumIncomingValues(); i++)
+      set |= lookup(PN->getIncomingValue(i));
+    return set;
   }
-  if(auto S=dyn_cast<StoreInst>(v)) {
-    return mayBeGlobal(S->getPointerOperand());
+  if(auto SI=dyn_cast<SelectInst>(v))
+    return lookup(SI->getTrueValue()) | lookup(SI->getFalseValue());
+  if(auto CI=dyn_cast<CallInst>(v)) {
+    // Whatever the callee may return
+    const Function *F = getCalleeThroughCasts(CI);
+    if(!F || F->isDeclaration())
+      return InUnknown;
+    unsigned set = 0;
+    for(auto B=F->begin(),e=F->end(); B!=e; ++B) {
+      if(auto R=dyn_cast<ReturnInst>(B->getTerminator())) {
+        if(R->getReturnValue())
+          set |= lookup(R->getReturnValue());
+      }
+    }
+    return set;
   }
-  if(auto OP=dyn_cast<Operator>(v)) {
-    if(OP->getOpcode() == Instruction::AddrSpaceCast)
-      return mayBeGlobal(OP->getOperand(0));
+  if(auto A=dyn_cast<Argument>(v)) {
+    const Function *F = A->getParent();
+    // Generic kernel parameters are set up by the host in global memory
+    if(isKernelFunction(*F))
+      return InGlobal;
+    auto found = callers.find(F);
+    if(found == callers.end() || found->second.empty() || addressTaken.count(F))
+      return InUnknown;
+    unsigned set = 0;
+    for(auto c=found->second.begin(),e=found->second.end(); c!=e; ++c) {
+      if(A->getArgNo() >= (*c)->getNumArgOperands())
+        return InUnknown;
+      set |= lookup((*c)->getArgOperand(A->getArgNo()));
+    }
+    return set;
   }
-  if(auto GEP=dyn_cast<GetElementPtrInst>(v)) {
-    return mayBeGlobal(GEP->getPointerOperand());
+  if(auto OP=dyn_cast<Operator>(v)) {
+    switch(OP->getOpcode()) {
+      case Instruction::AddrSpaceCast:
+      case Instruction::BitCast:
+      case Instruction::GetElementPtr:
+        return lookup(OP->getOperand(0));
+      default:
+        break;
+    }
   }
 
+  // Loaded from memory, or made from an integer
+  return InUnknown;
+}
 
-  // Simple stack allocation (local)
-  if(auto AI=dyn_cast<AllocaInst>(v)) {
-    if(auto pty=dyn_cast<PointerType>(AI->getType())) {
-      if(!pty->getElementType()->isPointerTy())
-        return false;
+void AddrSpaceAnalysis::inferSpaces(Module &M) {
+  spaces.clear();
+  callers.clear();
+  addressTaken.clear();
+  for(auto F=M.begin(),e=M.end(); F!=e; ++F) {
+    for(auto U=F->user_begin(),ue=F->user_end(); U!=ue; ++U) {
+      auto CI = dyn_cast<CallInst>(*U);
+      if(CI && getCalleeThroughCasts(CI) == &*F)
+        callers[&*F].push_back(CI);
+      else
+        addressTaken.insert(&*F);
     }
   }
 
-  // Address space encoded on the type
-  if(v->getType()->isPointerTy()) {
-    unsigned addr = v->getType()->getPointerAddressSpace();
-    if(addr == AddrSpace::Global || addr == AddrSpace::Constant) {
-      return true;
-    }
-    if(addr == AddrSpace::Shared) {
-      return false;
+  // Every pointer starts with no spaces, and grows to a fixed point as the
+  // spaces of what it is built from grow
+  vector<const Value *> worklist;
+  DenseSet<const Value *> queued;
+  auto enqueue = [&worklist, &queued](const Value *v) {
+    if(v->getType()->isPointerTy() && queued.insert(v).second)
+      worklist.push_back(v);
+  };
+  for(auto F=M.begin(),e=M.end(); F!=e; ++F) {
+    if(F->isDeclaration())
+      continue;
+    for(auto A=F->arg_begin(),ae=F->arg_end(); A!=ae; ++A)
+      enqueue(&*A);
+    for(auto I=inst_begin(&*F),ie=inst_end(&*F); I!=ie; ++I)
+      enqueue(&*I);
+  }
+
+  while(!worklist.empty()) {
+    const Value *v = worklist.back();
+    worklist.pop_back();
+    queued.erase(v);
+
+    unsigned old = lookup(v);
+    unsigned set = old | transfer(v);
+    if(set == old && spaces.count(v))
+      continue;
+    spaces[v] = set;
+
+    // Revisit everything built from v
+    for(auto U=v->user_begin(),e=v->user_end(); U!=e; ++U) {
+      if(auto R=dyn_cast<ReturnInst>(*U)) {
+        auto found = callers.find(R->getFunction());
+        if(found != callers.end()) {
+          for(auto c=found->second.begin(),ce=found->second.end(); c!=ce; ++c)
+            enqueue(*c);
+        }
+        continue;
+      }
+      if(auto CI=dyn_cast<CallInst>(*U)) {
+        const Function *F = getCalleeThroughCasts(CI);
+        if(F && !F->isDeclaration()) {
+          for(unsigned i=0; i<CI->getNumArgOperands() && i<F->arg_size(); i++) {
+            if(CI->getArgOperand(i) == v)
+              enqueue(&*(F->arg_begin() + i));
+          }
+        }
+      }
+      if(isa<Instruction>(*U))
+        enqueue(*U);
     }
   }
 
+  for(auto s=spaces.begin(),e=spaces.end(); s!=e; ++s) {
+    if(isa<Instruction>(s->first) && !(s->second & (InGlobal | InConstant | InUnknown)) && s->second)
+      ++NumNonGlobalPointers;
+  }
+}
+
+bool AddrSpaceAnalysis::mayBeGlobal(Value *v) const {
+  // Accesses are decided by the pointer they access through
+  if(auto L=dyn_cast<LoadInst>(v))
+    v = L->getPointerOperand();
+  else if(auto S=dyn_cast<StoreInst>(v))
+    v = S->getPointerOperand();
+  if(!v->getType()->isPointerTy())
+    return true;
+
+  // Constants aren't kept, and values added since the module was analyzed
+  // only have their type to go on
+  unsigned set;
+  auto found = spaces.find(v);
+  if(found != spaces.end())
+    set = found->second;
+  else if(auto C=dyn_cast<llvm::Constant>(v))
+    set = getConstantSpaces(C);
+  else
+    set = getLeafSpaces(v);
   // If we can't tell, assume it may
-  return true;
+  if(set == 0)
+    return true;
+  return (set & (InGlobal | InConstant | InUnknown)) != 0;
+}
+
+AnalysisKey AddrSpaceAnalysisNPM::Key;
+
+AddrSpaceAnalysisNPM::Result AddrSpaceAnalysisNPM::run(Module &M, ModuleAnalysisManager &AM) {
+  Result ASA(new AddrSpaceAnalysis());
+  ASA->runOnModule(M);
+  return ASA;
 }
 
 char AddrSpaceAnalysis::ID = 0;
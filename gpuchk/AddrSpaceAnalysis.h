@@ -3,6 +3,13 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+
+#include <memory>
+#include <vector>
 
 #ifndef ADDRSPACE_H
 #define ADDRSPACE_H
@@ -12,13 +19,50 @@ using namespace llvm;
 
 namespace gpucheck {
 
+  /**
+   * Infers which address spaces each pointer in the module may point into.
+   * Pointers typed with an address space, allocas, module globals and
+   * generic kernel parameters are known outright. The rest take the union
+   * of what they are built from, through casts, GEPs, PHIs and selects,
+   * and from function to function through call arguments and returns,
+   * iterated to a fixed point over the whole module when it is run.
+   *
+   * Only the lookups below follow, so one result may be shared between
+   * kernel threads.
+   */
   class AddrSpaceAnalysis : public ModulePass {
   public:
     static char ID;
     AddrSpaceAnalysis() : ModulePass(ID) {}
     bool runOnModule(Module &M);
     void getAnalysisUsage(AnalysisUsage &AU) const;
-    bool mayBeGlobal(Value *v);
+    /**
+     * Whether v, or the pointer a load or store v accesses through, may
+     * point into global or constant memory. False once it is known to be
+     * shared or local memory alone.
+     */
+    bool mayBeGlobal(Value *v) const;
+
+  private:
+    void inferSpaces(Module &M);
+    unsigned transfer(const Value *v);
+    unsigned lookup(const Value *v);
+
+    DenseMap<const Value *, unsigned> spaces;
+    // Direct call sites of each function; others may be called from anywhere
+    DenseMap<const Function *, std::vector<const CallInst *>> callers;
+    DenseSet<const Function *> addressTaken;
+  };
+
+  /**
+   * AddrSpaceAnalysis for the new pass manager
+   */
+  class AddrSpaceAnalysisNPM : public AnalysisInfoMixin<AddrSpaceAnalysisNPM> {
+    friend AnalysisInfoMixin<AddrSpaceAnalysisNPM>;
+    static AnalysisKey Key;
+  public:
+    typedef unique_ptr<AddrSpaceAnalysis> Result;
+    Result run(Module &M, ModuleAnalysisManager &AM);
   };
 }
 #endif
@@ -0,0 +1,250 @@
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AnalysisCache.h"
+#include "BugEmitter.h"
+#include "Utilities.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+using namespace gpucheck;
+
+#define DEBUG_TYPE "analysis-cache"
+
+STATISTIC(CacheHits, "Number of functions whose warnings were replayed from the analysis cache");
+STATISTIC(CacheMisses, "Number of functions analyzed because the analysis cache missed");
+
+static cl::opt<string> CacheDirectory("analysis-cache", cl::init(""),
+    cl::desc("Directory to keep warnings of unchanged functions in"),
+    cl::value_desc("directory"));
+
+// Bump when the hashed contents or the stored format change
+static const char *const CacheVersion = "gpucheck-cache-1";
+
+static string hexDigest(StringRef data) {
+  MD5 hash;
+  hash.update(data);
+  MD5::MD5Result result;
+  hash.final(result);
+  SmallString<32> str;
+  MD5::stringifyResult(result, str);
+  return str.str().str();
+}
+
+/**
+ * Metadata is numbered across the module, so the same function prints
+ * different numbers whenever another one changes. Drop the numbers; the
+ * debug locations the warnings depend on are hashed separately.
+ */
+static void appendScrubbed(string& out, StringRef ir) {
+  for(size_t i=0; i<ir.size(); i++) {
+    out += ir[i];
+    if(ir[i] == '!') {
+      while(i+1 < ir.size() && isdigit((unsigned char)ir[i+1]))
+        i++;
+    }
+  }
+}
+
+/**
+ * Print an annotation's operands. Printing the node itself would name
+ * it by address.
+ */
+static void printAnnotation(raw_ostream& out, const MDNode *node) {
+  for(unsigned i=0, e=node->getNumOperands(); i!=e; i++) {
+    const Metadata *op = node->getOperand(i);
+    if(auto V=dyn_cast_or_null<ValueAsMetadata>(op))
+      V->getValue()->printAsOperand(out, true);
+    else if(auto S=dyn_cast_or_null<MDString>(op))
+      out << '"' << S->getString() << '"';
+    else
+      out << (op ? "?" : "null");
+    out << ", ";
+  }
+  out << "\n";
+}
+
+static const Function *findRoot(DenseMap<const Function *, const Function *>& parent,
+    const Function *F) {
+  while(parent[F] != F) {
+    parent[F] = parent[parent[F]];
+    F = parent[F];
+  }
+  return F;
+}
+
+static void join(DenseMap<const Function *, const Function *>& parent,
+    const Function *l, const Function *r) {
+  l = findRoot(parent, l);
+  r = findRoot(parent, r);
+  if(l != r)
+    parent[l] = r;
+}
+
+AnalysisCache::AnalysisCache(Module &M, StringRef pass, StringRef options)
+    : directory(CacheDirectory) {
+  if(!enabled())
+    return;
+
+  // Settings and module-wide IR shared by every key
+  raw_string_ostream out(prefix);
+  // Warnings are stored as written, so each format has its own entries
+  out << CacheVersion << '\0' << pass << '\0' << options << '\0' << getWarningOptions() << '\0';
+  string globals;
+  raw_string_ostream globalsOut(globals);
+  for(auto g=M.global_begin(),e=M.global_end(); g!=e; ++g)
+    globalsOut << *g << "\n";
+  out.flush();
+  appendScrubbed(prefix, globalsOut.str());
+  // Annotations of a function, such as marking it a kernel, belong to its
+  // component, so changing them doesn't invalidate the rest of the module
+  if(NamedMDNode *NMD = M.getNamedMetadata("nvvm.annotations")) {
+    for(unsigned i=0, e=NMD->getNumOperands(); i!=e; i++) {
+      MDNode *node = NMD->getOperand(i);
+      const Function *annotated = nullptr;
+      if(node->getNumOperands() > 0) {
+        if(auto V=dyn_cast_or_null<ValueAsMetadata>(node->getOperand(0)))
+          annotated = dyn_cast<Function>(V->getValue()->stripPointerCasts());
+      }
+      if(annotated) {
+        raw_string_ostream annotation(annotations[annotated]);
+        printAnnotation(annotation, node);
+      } else {
+        printAnnotation(out, node);
+      }
+    }
+  }
+  out << '\0';
+  out.flush();
+
+  // Group functions connected through calls. An indirect call may reach
+  // any function whose address is taken.
+  DenseMap<const Function *, const Function *> parent;
+  vector<const Function *> indirectCallers, addressTaken;
+  for(auto f=M.begin(),e=M.end(); f!=e; ++f)
+    parent[&*f] = &*f;
+  for(auto f=M.begin(),e=M.end(); f!=e; ++f) {
+    if(f->hasAddressTaken())
+      addressTaken.push_back(&*f);
+    for(auto b=f->begin(),be=f->end(); b!=be; ++b) {
+      for(auto i=b->begin(),ie=b->end(); i!=ie; ++i) {
+        auto CI = dyn_cast<CallInst>(i);
+        if(!CI || isa<IntrinsicInst>(CI))
+          continue;
+        if(const Function *callee = getCalleeThroughCasts(CI))
+          join(parent, &*f, callee);
+        else if(indirectCallers.empty() || indirectCallers.back() != &*f)
+          indirectCallers.push_back(&*f);
+      }
+    }
+  }
+  for(auto c=indirectCallers.begin(),ce=indirectCallers.end(); c!=ce; ++c) {
+    for(auto a=addressTaken.begin(),ae=addressTaken.end(); a!=ae; ++a)
+      join(parent, *c, *a);
+  }
+  for(auto f=M.begin(),e=M.end(); f!=e; ++f) {
+    const Function *root = findRoot(parent, &*f);
+    component[&*f] = root;
+    members[root].push_back(&*f);
+  }
+}
+
+string AnalysisCache::hashComponent(const Function *root) {
+  // Sorted, so the hash doesn't depend on where functions sit in the module
+  vector<const Function *> funcs = members[root];
+  std::sort(funcs.begin(), funcs.end(), [](const Function *l, const Function *r) {
+    return l->getName() < r->getName();
+  });
+
+  string contents;
+  for(auto f=funcs.begin(),e=funcs.end(); f!=e; ++f) {
+    string ir;
+    raw_string_ostream irOut(ir);
+    (*f)->print(irOut);
+    appendScrubbed(contents, irOut.str());
+
+    raw_string_ostream locs(contents);
+    locs << annotations.lookup(*f);
+    for(auto b=(*f)->begin(),be=(*f)->end(); b!=be; ++b) {
+      for(auto i=b->begin(),ie=b->end(); i!=ie; ++i) {
+        if(DILocation *Loc = i->getDebugLoc())
+          locs << Loc->getDirectory() << "/" << Loc->getFilename() << ":"
+               << Loc->getLine() << ":" << Loc->getColumn() << "\n";
+      }
+    }
+    locs << '\0';
+    locs.flush();
+  }
+  return hexDigest(contents);
+}
+
+string AnalysisCache::getKey(const Function &F) {
+  auto key = keys.find(&F);
+  if(key != keys.end())
+    return key->second;
+
+  const Function *root = component.lookup(&F);
+  auto found = componentHashes.find(root);
+  if(found == componentHashes.end())
+    found = componentHashes.insert(make_pair(root, hashComponent(root))).first;
+  string digest = hexDigest(prefix + F.getName().str() + '\0' + found->second);
+  keys[&F] = digest;
+  return digest;
+}
+
+bool AnalysisCache::lookup(const Function &F, string& warnings) {
+  if(!enabled())
+    return false;
+  SmallString<128> path(directory);
+  sys::path::append(path, getKey(F));
+  auto buffer = MemoryBuffer::getFile(path);
+  if(!buffer) {
+    ++CacheMisses;
+    return false;
+  }
+  ++CacheHits;
+  warnings = (*buffer)->getBuffer().str();
+  return true;
+}
+
+void AnalysisCache::store(const Function &F, const string& warnings) {
+  if(!enabled())
+    return;
+  if(sys::fs::create_directories(directory))
+    return;
+
+  // Write under a unique name first, so that other processes sharing the
+  // cache never read a partial entry
+  SmallString<128> path(directory);
+  sys::path::append(path, getKey(F));
+  SmallString<128> temp;
+  int fd;
+  if(sys::fs::createUniqueFile(Twine(path) + "-%%%%%%.tmp", fd, temp))
+    return;
+  {
+    raw_fd_ostream out(fd, true);
+    out << warnings;
+    out.close();
+    if(out.has_error()) {
+      out.clear_error();
+      sys::fs::remove(temp);
+      return;
+    }
+  }
+  if(sys::fs::rename(temp, path))
+    sys::fs::remove(temp);
+}
+
+#undef DEBUG_TYPE
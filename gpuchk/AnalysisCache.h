@@ -0,0 +1,53 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <vector>
+
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+
+namespace gpucheck {
+
+  /**
+   * Warnings a pass emitted for each function, kept on disk under the
+   * directory given by -analysis-cache, so an unchanged function's warnings
+   * can be replayed instead of analyzed again. Without the option every
+   * lookup misses and nothing is stored.
+   *
+   * Entries are addressed by a hash of the pass, its options, and the IR of
+   * every function the result may depend on. Offsets and thread dependence
+   * flow through both callees and calling contexts, so that is everything
+   * connected to the function through calls, along with the module's global
+   * variables and kernel annotations. Debug locations are hashed by their
+   * contents, since that is what the warnings print.
+   */
+  class AnalysisCache {
+    public:
+      /**
+       * options should name every setting of pass which changes its warnings
+       */
+      AnalysisCache(llvm::Module &M, llvm::StringRef pass, llvm::StringRef options);
+
+      bool enabled() const { return !directory.empty(); }
+      bool lookup(const llvm::Function &F, std::string& warnings);
+      void store(const llvm::Function &F, const std::string& warnings);
+
+    private:
+      std::string getKey(const llvm::Function &F);
+      std::string hashComponent(const llvm::Function *root);
+
+      std::string directory;
+      std::string prefix;
+      // Functions connected through calls share one representative
+      llvm::DenseMap<const llvm::Function *, const llvm::Function *> component;
+      llvm::DenseMap<const llvm::Function *, std::vector<const llvm::Function *>> members;
+      llvm::DenseMap<const llvm::Function *, std::string> annotations;
+      llvm::DenseMap<const llvm::Function *, std::string> componentHashes;
+      llvm::DenseMap<const llvm::Function *, std::string> keys;
+  };
+}
+
+#endif
@@ -10,6 +10,9 @@
 #include "BranchDivergeAnalysis.h"
 #include "BugEmitter.h"
 #include "OffsetOps.h"
+#include "LaneProgram.h"
+#include "KernelScheduler.h"
+#include "Profiler.h"
 #include "Utilities.h"
 
 using namespace std;
@@ -22,14 +25,38 @@ using namespace gpucheck;
 
 
 bool BranchDivergeAnalysis::runOnModule(Module &M) {
-  TD = &getAnalysis<ThreadDependence>();
-  OP = &getAnalysis<OffsetPropagation>();
-  // Run over each kernel function
+  return runOnModule(M, &getAnalysis<ThreadDependence>(), &getAnalysis<OffsetPropagation>());
+}
+
+bool BranchDivergeAnalysis::runOnModule(Module &M, ThreadDependence *TD, OffsetPropagation *OP) {
+  this->TD = TD;
+  this->OP = OP;
+  // Every branch is an independent query, so gather them from each kernel
+  // function in order and answer them as one batch
+  vector<Function *> funcs;
   for(auto f=M.begin(), e=M.end(); f!=e; ++f) {
     if(!f->isDeclaration()) {
-      runOnKernel(*f);
+      funcs.push_back(&*f);
     }
   }
+  AnalysisCache cache(M, "bdiverge", "threshold=" + to_string(DIVERGE_THRESH) + " " +
+      getBudgetOptions());
+  {
+    // With -aggregate-warnings, branches on one line are reported together
+    WarningAggregator aggregate;
+    analyzeFunctions(funcs, *OP, cache, [](Function &F, vector<Instruction *>& branches) {
+      for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+        if(auto B=dyn_cast_or_null<BranchInst>(b->getTerminator()))
+          branches.push_back(B);
+      }
+    }, [this](Instruction *i, OffsetPropagation &shard) {
+      BranchDivergeAnalysis worker;
+      worker.TD = this->TD;
+      worker.OP = &shard;
+      worker.testBranch(cast<BranchInst>(i));
+    });
+  }
+  reportProfile(M, "bdiverge");
   return false;
 }
 
@@ -37,80 +64,204 @@ bool BranchDivergeAnalysis::runOnKernel(Function &F) {
   for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
 
     for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
-      if(auto B=dyn_cast<BranchInst>(i)) {
-        if(B->isConditional() && TD->isDependent(B)) {
-          // We've found a potentially divergent branch!
-          // TODO: Determine if branch is high-cost
-          float divergence = getDivergence(B);
-          if(divergence > DIVERGE_THRESH) {
-            emitWarning("Divergent Branch Detected", B, SEV_MED);
-            DEBUG(
-              errs() << "Found Divergent Branch!! diverge=(" << divergence << ")\n";
-              //B->dump();
-              errs() << "\n\n";
-            );
-          } else {
-            DEBUG(
-              errs() << "Nondivergent branch, diverge=(" << divergence << ")\n";
-              //B->dump();
-              errs() << "\n\n";
-            );
-          }
-        }
-      }
+      if(auto B=dyn_cast<BranchInst>(i))
+        testBranch(B);
     }
   }
   return false;
 }
 
-float BranchDivergeAnalysis::getDivergence(BranchInst *BI) {
+void BranchDivergeAnalysis::testBranch(BranchInst *B) {
+  if(B->isConditional() && TD->isDependent(B)) {
+    QueryProfile profile("bdiverge", B);
+    // We've found a potentially divergent branch!
+    // TODO: Determine if branch is high-cost
+    QueryResult divergence = getDivergence(B);
+    profileResult(divergence);
+    DEBUG(errs() << "Answered by the " << getTierName(divergence.tier) << " tier"
+        << (divergence.conservative ? ", conservatively" : "") << "\n");
+    if(divergence.value > DIVERGE_THRESH) {
+      emitWarning("Divergent Branch Detected" + divergence.caveat(), B, SEV_MED,
+          WARN_DIVERGENT, divergence);
+      DEBUG(
+        errs() << "Found Divergent Branch!! diverge=(" << divergence.value << ")\n";
+        //B->dump();
+        errs() << "\n\n";
+      );
+    } else {
+      DEBUG(
+        errs() << "Nondivergent branch, diverge=(" << divergence.value << ")\n";
+        //B->dump();
+        errs() << "\n\n";
+      );
+    }
+  }
+}
+
+int BranchDivergeAnalysis::affineDivergentWarps(const OffsetValPtr& cond) {
+  auto cmp = dyn_cast<BinOpOffsetVal>(&*cond);
+  if(!cmp || !cmp->isCompare())
+    return -1;
+
+  // Both sides must be fully known for every thread
+  AffineOffset lhs, rhs;
+  if(!getAffineOffset(cmp->lhs, *TD, lhs) || !lhs.hasConstBase)
+    return -1;
+  if(!getAffineOffset(cmp->rhs, *TD, rhs) || !rhs.hasConstBase)
+    return -1;
+
+  int divergent = 0;
+  for(int warp=0; warp<8; warp++) {
+    APInt first;
+    for(int i=0; i<32; i++) {
+      int64_t l = lhs.at(warp*32+i, 0, 0, 0, 0, 0);
+      int64_t r = rhs.at(warp*32+i, 0, 0, 0, 0, 0);
+      // Outside 32 bits, the operands' real width may change the outcome
+      if(l != (int32_t)l || r != (int32_t)r)
+        return -1;
+
+      APInt taken;
+      if(!foldConstantOp(APInt(64, l, true), cmp->op, APInt(64, r, true), taken))
+        return -1;
+      if(i == 0) {
+        first = taken;
+      } else if(taken != first) {
+        divergent++;
+        break; // We found divergence, we're done with the warp
+      }
+    }
+  }
+  return divergent;
+}
+
+QueryResult BranchDivergeAnalysis::getDivergence(BranchInst *BI) {
   assert(BI->isConditional());
+  // All the thread dependence lattice knows is that the condition varies
+  // across threads, so at worst every warp diverges
+  QueryResult worst(1.0f, TierLattice, true);
+  if(getMaxAnalysisTier() == TierLattice)
+    return worst;
+  QueryBudget budget;
 
   // Get the symbolic offset for the branch pointer
-  OffsetValPtr cond_offset = OP->getOrCreateVal(BI->getCondition());
+  OffsetValPtr cond_offset;
+  {
+    PhaseTimer timer(PhaseConstruct);
+    cond_offset = OP->getOrCreateVal(BI->getCondition());
+  }
+  profileExpression(PhaseConstruct, cond_offset);
 
   DEBUG(errs() << "Analyzing possibly divergent branch condition:\n    " << *BI->getCondition() << "\n");
 
-  vector<OffsetValPtr> all_paths = OP->inContexts(cond_offset);
+  vector<OffsetValPtr> all_paths;
+  {
+    PhaseTimer timer(PhaseContexts);
+    all_paths = OP->inContexts(cond_offset);
+  }
   DEBUG(errs() << "Context-sensitive analysis generated " << all_paths.size() << " contexts\n");
 
   float maxDivergence = 0.0f;
+  AnalysisTier tier = TierSymbolic;
+  bool conservative = false;
   for(auto path=all_paths.begin(),e=all_paths.end(); path != e; ++path) {
     // Apply some (arbitrary) grid boundaries
-    OffsetValPtr gridCtx = OP->inGridContext(*path, 256, 32, 32, 1, 1, 1);
+    OffsetValPtr gridCtx;
+    {
+      PhaseTimer timer(PhaseContexts);
+      gridCtx = OP->inGridContext(*path, 256, 32, 32, 1, 1, 1);
+    }
+    profileExpression(PhaseContexts, gridCtx);
     // Perform as much simplification as we can early
-    OffsetValPtr simp = simplifyOffsetVal(sumOfProducts(gridCtx));
-
-    // Calculate the difference between threads 0 and 1
-    OffsetValPtr threadDiff = cancelDiffs(make_shared<BinOpOffsetVal>(
-        OP->inThreadContext(simp,1,0,0,0,0,0),
-        Sub,
-        OP->inThreadContext(simp,0,0,0,0,0,0)), *TD);
-
-    if(!threadDiff->isConst()) {
-      DEBUG(errs() << "Cannot generate constant for branch. Expression follows.\n");
-      DEBUG(cerr << *threadDiff <<"\n");
-      auto rnge = threadDiff->constRange();
-      DEBUG(errs() << "Range: " << rnge.first << " to " << rnge.second << "\n");
-      return 1.0; // Branch cannot be analyzed in at least 1 context
+    OffsetValPtr simp;
+    {
+      PhaseTimer timer(PhaseSimplify);
+      simp = simplifyOffsetVal(sumOfProducts(gridCtx));
+    }
+    profileExpression(PhaseSimplify, simp);
+    if(budget.exhausted()) {
+      DEBUG(errs() << "Out of budget simplifying branch\n");
+      return worst;
     }
 
-    int divergent = 0;
-    for(int warp=0; warp<8; warp++) {
-      OffsetValPtr warpBase = OP->inThreadContext(simp, warp*32, 0, 0, 0, 0, 0);
-      for(int i=1; i<32; i++) {
-        OffsetValPtr threadBase = OP->inThreadContext(simp, warp*32+i, 0, 0, 0, 0, 0);
-        OffsetValPtr threadDiff = cancelDiffs(make_shared<BinOpOffsetVal>(warpBase, Sub, threadBase), *TD);
-        if(!threadDiff->isConst() || threadDiff->constVal() != 0) {
-          divergent++;
-          break; // We found divergence, we're done with the warp
+    // Everything from here on evaluates the condition across the lanes
+    PhaseTimer lanes(PhaseLanes);
+    int divergent = affineDivergentWarps(simp);
+    LaneProgram program;
+    if(divergent < 0 && program.compile(simp)) {
+      // Concrete conditions for every lane, without building any expressions
+      int64_t taken[LaneProgram::Lanes];
+      divergent = 0;
+      for(int warp=0; warp<8; warp++) {
+        if(!program.run(warp*32, 0, 0, 0, 0, 0, taken)) {
+          divergent = -1;
+          break;
+        }
+        for(unsigned i=1; i<LaneProgram::Lanes; i++) {
+          if(taken[i] != taken[0]) {
+            divergent++;
+            break;
+          }
         }
       }
     }
+    if(budget.exhausted()) {
+      DEBUG(errs() << "Out of budget solving branch\n");
+      return worst;
+    }
+
+    if(divergent < 0 && getMaxAnalysisTier() < TierEnumerate)
+      return worst;
+    if(divergent < 0) {
+      tier = TierEnumerate;
+      // Calculate the difference between threads 0 and 1
+      OffsetValPtr threadDiff = cancelDiffs(BinOpOffsetVal::get(
+          OP->inThreadContext(simp,1,0,0,0,0,0),
+          Sub,
+          OP->inThreadContext(simp,0,0,0,0,0,0)), *TD);
+
+      if(budget.exhausted()) {
+        DEBUG(errs() << "Out of budget enumerating branch\n");
+        return worst;
+      }
+      if(!threadDiff->isConst()) {
+        DEBUG(errs() << "Cannot generate constant for branch. Expression follows.\n");
+        DEBUG(cerr << *threadDiff <<"\n");
+        auto rnge = threadDiff->constRange();
+        DEBUG(errs() << "Range: " << rnge.first << " to " << rnge.second << "\n");
+        // Branch cannot be analyzed in at least 1 context
+        return QueryResult(1.0f, TierEnumerate, true);
+      }
+
+      divergent = 0;
+      for(int warp=0; warp<8 && !budget.exhausted(); warp++) {
+        OffsetValPtr warpBase = OP->inThreadContext(simp, warp*32, 0, 0, 0, 0, 0);
+        for(int i=1; i<32; i++) {
+          OffsetValPtr threadBase = OP->inThreadContext(simp, warp*32+i, 0, 0, 0, 0, 0);
+          OffsetValPtr threadDiff = cancelDiffs(BinOpOffsetVal::get(warpBase, Sub, threadBase), *TD);
+          if(!threadDiff->isConst() || threadDiff->constVal() != 0) {
+            // A lane we cannot compare is assumed to diverge
+            conservative |= !threadDiff->isConst();
+            divergent++;
+            break; // We found divergence, we're done with the warp
+          }
+        }
+      }
+      if(budget.exhausted()) {
+        DEBUG(errs() << "Out of budget enumerating branch\n");
+        return worst;
+      }
+    }
     if(divergent/8.0f > maxDivergence)
       maxDivergence = divergent/8.0f;
   }
-  return maxDivergence;
+  return QueryResult(maxDivergence, tier, conservative);
+}
+
+PreservedAnalyses BranchDivergePass::run(Module &M, ModuleAnalysisManager &AM) {
+  BranchDivergeAnalysis BDA;
+  BDA.runOnModule(M, AM.getResult<ThreadDependenceAnalysis>(M).get(),
+      AM.getResult<OffsetPropagationAnalysis>(M).get());
+  return PreservedAnalyses::all();
 }
 
 char BranchDivergeAnalysis::ID = 0;
@@ -3,9 +3,11 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/PassManager.h"
 
 #include "ThreadDepAnalysis.h"
 #include "OffsetPropagation.h"
+#include "QueryBudget.h"
 
 #ifndef BRANCH_DIVERGE_H
 #define BRANCH_DIVERGE_H
@@ -22,14 +24,31 @@ namespace gpucheck {
         AU.setPreservesAll();
       }
       bool runOnModule(Module &M);
+      bool runOnModule(Module &M, ThreadDependence *TD, OffsetPropagation *OP);
       bool runOnKernel(Function &F);
-      float getDivergence(BranchInst *BI);
+      void testBranch(BranchInst *B);
+      QueryResult getDivergence(BranchInst *BI);
     private:
+      /**
+       * Count the divergent warps of a comparison between offsets affine in
+       * the thread indices, evaluated directly per lane. Returns -1 if the
+       * condition does not have this form.
+       */
+      int affineDivergentWarps(const OffsetValPtr& cond);
+
       ThreadDependence *TD;
       OffsetPropagation *OP;
 
   };
 
+  /**
+   * BranchDivergeAnalysis for the new pass manager
+   */
+  class BranchDivergePass : public PassInfoMixin<BranchDivergePass> {
+    public:
+      PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+  };
+
 }
 
 #endif
@@ -2,20 +2,50 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "BugEmitter.h"
+#include "SourceCache.h"
+#include "Utilities.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <fstream>
+#include <system_error>
+#include <vector>
 #include <cxxabi.h>
 
-#define MACHINE_READABLE
-
 using namespace llvm;
 using namespace std;
+using namespace gpucheck;
+
+static cl::opt<WarningFormat> OutputFormat("warning-format", cl::init(FormatLocations),
+    cl::desc("How warnings are written"),
+    cl::values(clEnumValN(FormatLocations, "locations", "file:line of each warning with a debug location"),
+               clEnumValN(FormatText, "text", "Each warning with its function and source line"),
+               clEnumValN(FormatJSONLines, "jsonl", "One JSON object per line for each warning"),
+               clEnumValN(FormatSARIF, "sarif", "A SARIF 2.1.0 log")));
+
+static cl::opt<string> OutputFilename("warning-output", cl::init(""),
+    cl::desc("Write warnings to this file instead of stderr"),
+    cl::value_desc("filename"));
+
+static cl::opt<bool> AggregateWarnings("aggregate-warnings", cl::init(false),
+    cl::desc("Report each source location once per kind of warning, costliest first"));
+
+static const char *const RuleIds[] = {
+  "uncoalesced-access",
+  "divergent-branch"
+};
 
 inline string demangle(string name) {
   int status = -1;
@@ -23,32 +53,264 @@ inline string demangle(string name) {
         return (status == 0) ? res.get() : string(name);
 }
 
-bool printline(string filename, int lineNumber) {
-  ifstream infile(filename);
-  string line;
-  int linenum = 0;
+namespace {
+  /**
+   * Turns records written one per line into a SARIF log, each an element
+   * of its results array. The log is closed when the stream is destroyed.
+   */
+  class SarifStream : public raw_ostream {
+    public:
+      SarifStream(raw_ostream& out) : out(out), written(0), lineStart(true), first(true) {
+        out << "{\"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\", "
+            << "\"version\": \"2.1.0\", \"runs\": [{\"tool\": {\"driver\": "
+            << "{\"name\": \"gpucheck\", \"rules\": ["
+            << "{\"id\": \"" << RuleIds[WARN_UNCOALESCED] << "\", "
+            << "\"shortDescription\": {\"text\": \"Uncoalesced memory access\"}}, "
+            << "{\"id\": \"" << RuleIds[WARN_DIVERGENT] << "\", "
+            << "\"shortDescription\": {\"text\": \"Divergent branch\"}}]}}, "
+            << "\"results\": [";
+      }
+
+      ~SarifStream() override {
+        flush();
+        out << "\n]}]}\n";
+        out.flush();
+      }
+
+    private:
+      raw_ostream& out;
+      uint64_t written;
+      bool lineStart;
+      bool first;
+
+      void write_impl(const char *ptr, size_t size) override {
+        written += size;
+        StringRef data(ptr, size);
+        while(!data.empty()) {
+          size_t nl = data.find('\n');
+          StringRef line = data.substr(0, nl);
+          if(!line.empty()) {
+            if(lineStart)
+              out << (first ? "\n" : ",\n");
+            first = false;
+            lineStart = false;
+            out << line;
+          }
+          if(nl == StringRef::npos)
+            break;
+          lineStart = true;
+          data = data.substr(nl + 1);
+        }
+      }
+
+      uint64_t current_pos() const override { return written; }
+  };
+}
+
+static thread_local raw_ostream *warningStream = nullptr;
+
+static raw_ostream *openDefaultStream(unique_ptr<raw_fd_ostream>& file, unique_ptr<SarifStream>& sarif) {
+  // Drivers check first, but opt has nowhere else to
+  string problem = getWarningOptionsError();
+  if(!problem.empty())
+    report_fatal_error(Twine(problem), false);
 
-  // Load to the appropriate line
-  while(linenum < lineNumber && getline(infile, line)) {
-    linenum++;
+  raw_ostream *stream = &errs();
+  if(!OutputFilename.empty()) {
+    error_code EC;
+    file.reset(new raw_fd_ostream(OutputFilename, EC, sys::fs::F_Text));
+    if(EC) {
+      errs() << "gpucheck: " << OutputFilename << ": " << EC.message() << "\n";
+      file.reset();
+      // The log can't fall back to stderr either
+      if(OutputFormat == FormatSARIF)
+        report_fatal_error("no file to write the SARIF log to", false);
+    } else {
+      stream = file.get();
+    }
   }
-  if(linenum != lineNumber)
+  if(OutputFormat == FormatSARIF) {
+    sarif.reset(new SarifStream(*stream));
+    stream = sarif.get();
+  }
+  return stream;
+}
+
+static raw_ostream& getDefaultStream() {
+  // Destroyed in reverse, so the SARIF log is closed before its file
+  static unique_ptr<raw_fd_ostream> file;
+  static unique_ptr<SarifStream> sarif;
+  static raw_ostream *stream = openDefaultStream(file, sarif);
+  return *stream;
+}
+
+WarningFormat gpucheck::getWarningFormat() {
+  return OutputFormat;
+}
+
+const char *gpucheck::getWarningFormatName() {
+  switch(OutputFormat) {
+    case FormatLocations: return "locations";
+    case FormatText: return "text";
+    case FormatJSONLines: return "jsonl";
+    case FormatSARIF: return "sarif";
+  }
+  return "unknown";
+}
+
+string gpucheck::getWarningOptions() {
+  return string("format=") + getWarningFormatName() + (AggregateWarnings ? " aggregate" : "");
+}
+
+bool gpucheck::isStructuredOutput() {
+  return OutputFormat == FormatJSONLines || OutputFormat == FormatSARIF;
+}
+
+string gpucheck::getWarningOptionsError() {
+  if(OutputFormat == FormatSARIF && OutputFilename.empty())
+    return "-warning-format=sarif needs -warning-output, since stderr also carries errors";
+  return "";
+}
+
+void gpucheck::setWarningStream(raw_ostream *os) {
+  warningStream = os;
+}
+
+raw_ostream& gpucheck::getWarningStream() {
+  return warningStream ? *warningStream : getDefaultStream();
+}
+
+namespace {
+  /**
+   * Everything written about one warning, so it can be held and merged
+   * with others before it is written
+   */
+  struct Finding {
+    string message;
+    Severity sev;
+    WarningKind kind;
+    QueryResult result;
+    string function;
+    bool located;
+    string file;
+    string directory;
+    unsigned line;
+    unsigned column;
+    // The instruction as printed, for warnings without a location
+    string instruction;
+    unsigned count;
+
+    Finding() : sev(SEV_UNKNOWN), kind(WARN_UNCOALESCED), result(0.0f, TierLattice, false),
+      located(false), line(0), column(0), count(1) {}
+  };
+}
+
+bool printline(raw_ostream& out, string filename, int lineNumber) {
+  StringRef line;
+  // Line 0 marks code with no source line of its own
+  if(lineNumber != 0 && !gpucheck::getSourceLine(filename, lineNumber, line))
     return false;
 
-  errs()<< "    " << line << "\n";
+  out << "    " << line << "\n";
   return true;
 }
 
-void gpucheck::emitWarning(string warning, Instruction* i, Severity sev) {
-  DILocation *Loc = i->getDebugLoc();
-#ifdef MACHINE_READABLE
-  if(!Loc)
+static const char *getSeverityName(Severity sev) {
+  switch(sev) {
+    case SEV_MIN: return "min";
+    case SEV_MED: return "medium";
+    case SEV_MAX: return "max";
+    default: return "unknown";
+  }
+}
+
+static const char *getSarifLevel(Severity sev) {
+  switch(sev) {
+    case SEV_MIN: return "note";
+    case SEV_MAX: return "error";
+    default: return "warning";
+  }
+}
+
+static StringRef trimmed(StringRef text) {
+  return text.ltrim(' ');
+}
+
+/**
+ * The result a warning was drawn from, as JSON keys and values
+ */
+static void printResult(raw_ostream& out, const Finding& f) {
+  out << (f.kind == WARN_UNCOALESCED ? "\"requests_per_warp\": " : "\"divergence\": ")
+      << format("%g", f.result.value) << ", \"tier\": \"" << getTierName(f.result.tier)
+      << "\", \"conservative\": " << (f.result.conservative ? "true" : "false")
+      << ", \"count\": " << f.count;
+}
+
+static void printJSONRecord(raw_ostream& out, const Finding& f) {
+  out << "{\"severity\": \"" << getSeverityName(f.sev) << "\", \"kind\": \"" << RuleIds[f.kind]
+      << "\", \"message\": ";
+  printJSONString(out, f.message);
+  out << ", ";
+  printResult(out, f);
+  out << ", \"function\": ";
+  printJSONString(out, f.function);
+  if(f.located) {
+    out << ", \"file\": ";
+    printJSONString(out, f.file);
+    out << ", \"directory\": ";
+    printJSONString(out, f.directory);
+    out << ", \"line\": " << f.line << ", \"column\": " << f.column;
+  } else {
+    out << ", \"instruction\": ";
+    printJSONString(out, trimmed(f.instruction));
+  }
+  out << "}\n";
+}
+
+static void printSarifResult(raw_ostream& out, const Finding& f) {
+  out << "{\"ruleId\": \"" << RuleIds[f.kind] << "\", \"level\": \"" << getSarifLevel(f.sev)
+      << "\", \"message\": {\"text\": ";
+  printJSONString(out, f.message);
+  out << "}, \"locations\": [{";
+  if(f.located) {
+    out << "\"physicalLocation\": {\"artifactLocation\": {\"uri\": ";
+    printJSONString(out, f.file);
+    out << "}, \"region\": {\"startLine\": " << f.line;
+    // SARIF columns start at 1, so 0 means none was recorded
+    if(f.column)
+      out << ", \"startColumn\": " << f.column;
+    out << "}}, ";
+  }
+  out << "\"logicalLocations\": [{\"kind\": \"function\", \"name\": ";
+  printJSONString(out, f.function);
+  out << "}]}], \"occurrenceCount\": " << f.count << ", \"properties\": {\"severity\": \""
+      << getSeverityName(f.sev) << "\", ";
+  printResult(out, f);
+  if(!f.located) {
+    out << ", \"instruction\": ";
+    printJSONString(out, trimmed(f.instruction));
+  }
+  out << "}}\n";
+}
+
+static void printFinding(raw_ostream& out, const Finding& f) {
+  if(OutputFormat == FormatLocations) {
+    if(!f.located)
+      return;
+    out << f.file << ":" << f.line << "\n";
     return;
-  errs() << Loc->getFilename() << ":" << Loc->getLine() << "\n";
-#else
-  string funcName = demangle(i->getParent()->getParent()->getName().str());
+  }
+  if(OutputFormat == FormatJSONLines) {
+    printJSONRecord(out, f);
+    return;
+  }
+  if(OutputFormat == FormatSARIF) {
+    printSarifResult(out, f);
+    return;
+  }
+
   string sevStr;
-  switch(sev) {
+  switch(f.sev) {
     case SEV_UNKNOWN:
       sevStr = "(Unk) ";
       break;
@@ -62,17 +324,184 @@ void gpucheck::emitWarning(string warning, Instruction* i, Severity sev) {
       sevStr = "(min) ";
       break;
   }
-  if(!Loc) {
-    errs() << sevStr << "Warning: " << warning << "\n";
-    errs() << "in " << funcName << ":\n";
-    i->dump();
-    errs() << "\n";
+  out << sevStr << "Warning: " << f.message;
+  if(f.count > 1)
+    out << " (" << f.count << " occurrences)";
+  out << "\n";
+  if(!f.located) {
+    out << "in " << f.function << ":\n";
+    out << f.instruction << "\n";
+    out << "\n";
   } else {
-    errs() << sevStr << "Warning: " << warning << "\n";
-    errs() << Loc->getFilename() << ":" << Loc->getLine() << " in " << funcName << ":\n";
-    printline((Loc->getDirectory()+"/"+Loc->getFilename()).str(), Loc->getLine());
-    errs() << "\n";
+    out << f.file << ":" << f.line << " in " << f.function << ":\n";
+    printline(out, f.directory + "/" + f.file, f.line);
+    out << "\n";
+
+  }
+}
+
+/**
+ * Findings held for aggregation are written one per line, as their fields
+ * separated by tabs, so they buffer and cache like any other output
+ */
+static void appendField(raw_ostream& out, StringRef field) {
+  for(auto c=field.begin(),e=field.end(); c!=e; ++c) {
+    switch(*c) {
+      case '\\': out << "\\\\"; break;
+      case '\t': out << "\\t"; break;
+      case '\n': out << "\\n"; break;
+      default: out << *c;
+    }
+  }
+  out << '\t';
+}
+
+static string unescapeField(StringRef field) {
+  string res;
+  for(size_t c=0; c<field.size(); c++) {
+    if(field[c] == '\\' && c + 1 < field.size()) {
+      c++;
+      res += field[c] == 't' ? '\t' : field[c] == 'n' ? '\n' : field[c];
+    } else {
+      res += field[c];
+    }
+  }
+  return res;
+}
+
+static void printHeldFinding(raw_ostream& out, const Finding& f) {
+  out << "gpucheck-finding\t";
+  appendField(out, f.message);
+  out << f.sev << '\t' << f.kind << '\t' << format("%.9g", f.result.value) << '\t'
+      << f.result.tier << '\t' << f.result.conservative << '\t';
+  appendField(out, f.function);
+  out << f.located << '\t';
+  appendField(out, f.file);
+  appendField(out, f.directory);
+  out << f.line << '\t' << f.column << '\t';
+  appendField(out, f.instruction);
+  out << "\n";
+}
+
+static bool parseHeldFinding(StringRef line, Finding& f) {
+  SmallVector<StringRef, 16> fields;
+  line.split(fields, '\t');
+  unsigned sev, kind, tier, conservative, located;
+  if(fields.size() < 14 || fields[0] != "gpucheck-finding" ||
+      fields[2].getAsInteger(10, sev) || fields[3].getAsInteger(10, kind) ||
+      fields[5].getAsInteger(10, tier) || fields[6].getAsInteger(10, conservative) ||
+      fields[8].getAsInteger(10, located) || fields[11].getAsInteger(10, f.line) ||
+      fields[12].getAsInteger(10, f.column))
+    return false;
+  f.message = unescapeField(fields[1]);
+  f.sev = (Severity)sev;
+  f.kind = (WarningKind)kind;
+  f.result = QueryResult(strtof(fields[4].str().c_str(), nullptr), (AnalysisTier)tier, conservative);
+  f.function = unescapeField(fields[7]);
+  f.located = located;
+  f.file = unescapeField(fields[9]);
+  f.directory = unescapeField(fields[10]);
+  f.instruction = unescapeField(fields[13]);
+  return true;
+}
+
+WarningAggregator::WarningAggregator() : active(AggregateWarnings), outer(nullptr) {
+  if(!active)
+    return;
+  outer = warningStream;
+  held.reset(new raw_string_ostream(buffer));
+  warningStream = held.get();
+}
 
+/**
+ * Estimated cost of a group: each occurrence costs the requests per warp
+ * beyond the one a coalesced access needs, or for a branch, the warps
+ * which diverge out of the eight analyzed
+ */
+static float getCost(const Finding& f) {
+  float each = f.kind == WARN_UNCOALESCED ? f.result.value - 1.0f : f.result.value * 8.0f;
+  return f.count * (each > 0.0f ? each : 0.0f);
+}
+
+WarningAggregator::~WarningAggregator() {
+  if(!active)
+    return;
+  held->flush();
+  warningStream = outer;
+  raw_ostream& out = getWarningStream();
+
+  // Group in order of first occurrence, so ties keep the analysis order
+  vector<Finding> groups;
+  StringMap<unsigned> index;
+  SmallVector<StringRef, 64> lines;
+  StringRef(buffer).split(lines, '\n', -1, false);
+  for(auto l=lines.begin(),e=lines.end(); l!=e; ++l) {
+    Finding f;
+    if(!parseHeldFinding(*l, f)) {
+      // Not a finding, so pass it through as it was written
+      out << *l << "\n";
+      continue;
+    }
+    string key;
+    raw_string_ostream keyOut(key);
+    keyOut << f.kind << '\t';
+    if(f.located)
+      keyOut << f.directory << '\t' << f.file << '\t' << f.line;
+    else
+      keyOut << f.function << '\t' << f.instruction;
+    keyOut.flush();
+
+    auto found = index.find(key);
+    if(found == index.end()) {
+      index[key] = groups.size();
+      groups.push_back(f);
+      continue;
+    }
+    Finding& group = groups[found->second];
+    group.count++;
+    if(f.sev > group.sev)
+      group.sev = f.sev;
+    // The costliest occurrence speaks for the group
+    if(f.result.value > group.result.value) {
+      group.message = f.message;
+      group.result = f.result;
+      group.function = f.function;
+    }
   }
-#endif
+
+  stable_sort(groups.begin(), groups.end(), [](const Finding& l, const Finding& r) {
+    return getCost(l) > getCost(r);
+  });
+  for(auto g=groups.begin(),e=groups.end(); g!=e; ++g)
+    printFinding(out, *g);
+}
+
+static Finding makeFinding(string warning, Instruction* i, Severity sev, WarningKind kind,
+    const QueryResult& result) {
+  Finding f;
+  f.message = warning;
+  f.sev = sev;
+  f.kind = kind;
+  f.result = result;
+  f.function = demangle(i->getParent()->getParent()->getName().str());
+  if(DILocation *Loc = i->getDebugLoc()) {
+    f.located = true;
+    f.file = Loc->getFilename();
+    f.directory = Loc->getDirectory();
+    f.line = Loc->getLine();
+    f.column = Loc->getColumn();
+  } else {
+    raw_string_ostream out(f.instruction);
+    out << *i;
+  }
+  return f;
+}
+
+void gpucheck::emitWarning(string warning, Instruction* i, Severity sev, WarningKind kind,
+    const QueryResult& result) {
+  Finding f = makeFinding(warning, i, sev, kind, result);
+  if(AggregateWarnings)
+    printHeldFinding(getWarningStream(), f);
+  else
+    printFinding(getWarningStream(), f);
 }
@@ -5,7 +5,10 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "QueryBudget.h"
+
 #include <iostream>
+#include <memory>
 #include <string>
 
 #ifndef BUGEMITTER_H
@@ -21,6 +24,84 @@ namespace gpucheck {
     SEV_MED,
     SEV_MAX
   };
-  extern void emitWarning(string warning, Instruction* i, Severity sev);
+
+  /**
+   * What a warning is about. The result it is drawn from is requests per
+   * warp for an uncoalesced access, and the fraction of warps diverging for
+   * a divergent branch.
+   */
+  enum WarningKind {
+    WARN_UNCOALESCED,
+    WARN_DIVERGENT
+  };
+
+  /**
+   * How warnings are written, from -warning-format
+   */
+  enum WarningFormat {
+    FormatLocations,  // file:line of each warning with a debug location
+    FormatText,       // The warning, its function and its source line
+    FormatJSONLines,  // One JSON object per warning
+    FormatSARIF       // A SARIF 2.1.0 log, one result per warning
+  };
+  extern WarningFormat getWarningFormat();
+  extern const char *getWarningFormatName();
+
+  /**
+   * The settings which change what is written for a warning, for keying
+   * cached warnings
+   */
+  extern string getWarningOptions();
+
+  /**
+   * Whether warnings are written as records for other tools to read, in
+   * which case nothing else should be written to the warning stream
+   */
+  extern bool isStructuredOutput();
+
+  /**
+   * Why the warning options can't be honoured, or an empty string. A SARIF
+   * log is one document, and stderr also carries errors and the profile
+   * summary, so -warning-format=sarif needs -warning-output.
+   */
+  extern string getWarningOptionsError();
+
+  extern void emitWarning(string warning, Instruction* i, Severity sev, WarningKind kind,
+      const QueryResult& result);
+  /**
+   * Warnings are written to stderr, or the file given by -warning-output,
+   * unless the calling thread sets another stream, such as to buffer the
+   * warnings of one input. Pass null to go back to the default.
+   *
+   * Each warning is written whole, and structured records one per line, so
+   * buffers can be concatenated in any order the caller chooses.
+   */
+  extern void setWarningStream(raw_ostream *os);
+  extern raw_ostream& getWarningStream();
+
+  /**
+   * With -aggregate-warnings, holds the warnings emitted on this thread
+   * while it lives, including those buffered by other threads and written
+   * back to it. They are then grouped by kind and source line, or by
+   * instruction where there is no debug location, and each group written
+   * once with its worst severity and number of occurrences, costliest
+   * first. Anything else written meanwhile is passed through, ahead of the
+   * groups.
+   *
+   * Without the option, warnings are written as they are emitted.
+   */
+  class WarningAggregator {
+    public:
+      WarningAggregator();
+      ~WarningAggregator();
+      WarningAggregator(const WarningAggregator&) = delete;
+      WarningAggregator& operator=(const WarningAggregator&) = delete;
+
+    private:
+      bool active;
+      raw_ostream *outer;
+      string buffer;
+      unique_ptr<raw_string_ostream> held;
+  };
 }
 #endif
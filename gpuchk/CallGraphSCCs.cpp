@@ -0,0 +1,68 @@
+#include "CallGraphSCCs.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace gpucheck {
+
+  CallGraphSCCs::CallGraphSCCs(Module& M, const DenseMap<const Function*, std::vector<const CallInst*>>& callers) {
+    // Visit in module order, so the SCCs are found deterministically
+    for(auto f=M.begin(),e=M.end(); f!=e; ++f) {
+      auto sites = callers.find(&*f);
+      if(sites == callers.end())
+        continue;
+      for(auto ci=sites->second.begin(),e=sites->second.end(); ci!=e; ++ci)
+        callees[(*ci)->getParent()->getParent()].push_back(&*f);
+    }
+    for(auto f=M.begin(),e=M.end(); f!=e; ++f)
+      if(!index.count(&*f))
+        visit(&*f);
+  }
+
+  // Iterative, since call chains can be deeper than the native stack
+  void CallGraphSCCs::visit(const Function *root) {
+    std::vector<Frame> frames;
+    auto enter = [&](const Function *f) {
+      unsigned id = index.size();
+      index[f] = lowlink[f] = id;
+      stack.push_back(f);
+      onStack.insert(f);
+      frames.push_back(Frame{f, 0});
+    };
+    enter(root);
+
+    while(!frames.empty()) {
+      Frame& frame = frames.back();
+      const Function *f = frame.f;
+      const std::vector<const Function*>& next = callees[f];
+      if(frame.next < next.size()) {
+        const Function *g = next[frame.next++];
+        if(!index.count(g))
+          enter(g);
+        else if(onStack.count(g))
+          lowlink[f] = std::min(lowlink[f], index[g]);
+        continue;
+      }
+
+      if(lowlink[f] == index[f]) {
+        std::vector<const Function*> scc;
+        const Function *member;
+        do {
+          member = stack.back();
+          stack.pop_back();
+          onStack.erase(member);
+          scc.push_back(member);
+        } while(member != f);
+        sccs.push_back(scc);
+      }
+
+      // Back in the caller, which takes on the callee's lowlink
+      frames.pop_back();
+      if(!frames.empty()) {
+        const Function *caller = frames.back().f;
+        lowlink[caller] = std::min(lowlink[caller], lowlink[f]);
+      }
+    }
+  }
+}
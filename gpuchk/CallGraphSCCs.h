@@ -0,0 +1,41 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include <vector>
+
+#ifndef CALL_GRAPH_SCCS_H
+#define CALL_GRAPH_SCCS_H
+
+namespace gpucheck {
+
+  /**
+   * Tarjan's algorithm over the call graph given by a caller index. SCCs are
+   * produced bottom-up, with every callee's SCC before those of its callers.
+   */
+  class CallGraphSCCs {
+    public:
+      std::vector<std::vector<const llvm::Function*>> sccs;
+
+      CallGraphSCCs(llvm::Module& M,
+          const llvm::DenseMap<const llvm::Function*, std::vector<const llvm::CallInst*>>& callers);
+
+    private:
+      llvm::DenseMap<const llvm::Function*, std::vector<const llvm::Function*>> callees;
+      llvm::DenseMap<const llvm::Function*, unsigned> index;
+      llvm::DenseMap<const llvm::Function*, unsigned> lowlink;
+      std::vector<const llvm::Function*> stack;
+      llvm::DenseSet<const llvm::Function*> onStack;
+
+      // A function being visited, and how many of its callees it has tried
+      struct Frame {
+        const llvm::Function *f;
+        unsigned next;
+      };
+
+      void visit(const llvm::Function *root);
+  };
+}
+
+#endif
@@ -0,0 +1,111 @@
+#include "DominatorLCA.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include <algorithm>
+#include <utility>
+
+using namespace llvm;
+
+namespace gpucheck {
+
+  DominatorLCA::DominatorLCA(DominatorTree &DT) {
+    // Number the dominator tree in DFS order
+    std::vector<std::pair<DomTreeNode *, DomTreeNode::iterator>> stack;
+    std::vector<unsigned> parent;
+    unsigned clock = 0;
+    if(DomTreeNode *root = DT.getRootNode()) {
+      stack.push_back(std::make_pair(root, root->begin()));
+      index[root->getBlock()] = 0;
+      nodes.push_back(Node{root->getBlock(), clock++, 0});
+      parent.push_back(0);
+    }
+    while(!stack.empty()) {
+      DomTreeNode *node = stack.back().first;
+      if(stack.back().second == node->end()) {
+        nodes[index[node->getBlock()]].dfsOut = clock++;
+        stack.pop_back();
+        continue;
+      }
+      DomTreeNode *child = *stack.back().second++;
+      index[child->getBlock()] = nodes.size();
+      parent.push_back(index[node->getBlock()]);
+      nodes.push_back(Node{child->getBlock(), clock++, 0});
+      stack.push_back(std::make_pair(child, child->begin()));
+    }
+
+    ancestors.push_back(parent);
+    for(unsigned k=1; (1u << k) < nodes.size(); k++) {
+      const std::vector<unsigned>& prev = ancestors.back();
+      std::vector<unsigned> next(nodes.size());
+      for(unsigned n=0; n<nodes.size(); n++)
+        next[n] = prev[prev[n]];
+      ancestors.push_back(std::move(next));
+    }
+
+  }
+
+  bool DominatorLCA::isAncestor(unsigned a, unsigned n) const {
+    return nodes[a].dfsIn <= nodes[n].dfsIn && nodes[n].dfsOut <= nodes[a].dfsOut;
+  }
+
+  bool DominatorLCA::dominates(const BasicBlock *a, const BasicBlock *b) const {
+    auto ai = index.find(a), bi = index.find(b);
+    if(ai == index.end() || bi == index.end())
+      return false;
+    return isAncestor(ai->second, bi->second);
+  }
+
+  BasicBlock *DominatorLCA::findNearestCommonDominator(BasicBlock *l, BasicBlock *r) const {
+    auto li = index.find(l), ri = index.find(r);
+    if(li == index.end() || ri == index.end())
+      return nullptr;
+
+    unsigned a = li->second, b = ri->second;
+    if(isAncestor(a, b))
+      return l;
+    if(isAncestor(b, a))
+      return r;
+
+    // Climb from a to the highest ancestor which still doesn't dominate b
+    for(unsigned k=ancestors.size(); k-- > 0; ) {
+      if(!isAncestor(ancestors[k][a], b))
+        a = ancestors[k][a];
+    }
+    return nodes[ancestors[0][a]].block;
+  }
+
+  static Value *getCondition(BasicBlock *BB) {
+    if(auto B=dyn_cast_or_null<BranchInst>(BB->getTerminator())) {
+      if(B->isConditional())
+        return B->getCondition();
+    }
+    return nullptr;
+  }
+
+  void DominatorLCA::getControllingConditions(ArrayRef<BasicBlock *> blocks,
+      SmallVectorImpl<Value *>& conds) const {
+    // Each reachable block once, in DFS order
+    std::vector<unsigned> order;
+    for(auto b=blocks.begin(),e=blocks.end(); b!=e; ++b) {
+      auto found = index.find(*b);
+      if(found != index.end())
+        order.push_back(found->second);
+    }
+    std::sort(order.begin(), order.end());
+    order.erase(std::unique(order.begin(), order.end()), order.end());
+
+    SmallPtrSet<BasicBlock *, 8> seen;
+    auto consider = [&](BasicBlock *D) {
+      if(!seen.insert(D).second)
+        return;
+      if(Value *cond = getCondition(D))
+        conds.push_back(cond);
+    };
+    for(unsigned i=0; i<order.size(); i++) {
+      consider(nodes[order[i]].block);
+      if(i > 0)
+        consider(findNearestCommonDominator(nodes[order[i-1]].block, nodes[order[i]].block));
+    }
+  }
+}
@@ -0,0 +1,59 @@
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include <vector>
+
+#ifndef DOMINATOR_LCA_H
+#define DOMINATOR_LCA_H
+
+namespace gpucheck {
+
+  /**
+   * Dominator queries over one function, and the conditions which choose
+   * between blocks, built once so that repeated queries don't walk the
+   * tree again.
+   *
+   * Nearest common dominators come from the dominator tree's DFS intervals
+   * and a binary-lifting table of ancestors, so each query is logarithmic.
+   */
+  class DominatorLCA {
+    public:
+      DominatorLCA(llvm::DominatorTree &DT);
+
+      /**
+       * Returns null if either block is unreachable
+       */
+      llvm::BasicBlock *findNearestCommonDominator(llvm::BasicBlock *l, llvm::BasicBlock *r) const;
+      bool dominates(const llvm::BasicBlock *a, const llvm::BasicBlock *b) const;
+
+      /**
+       * The conditional branches ending the nearest common dominator of
+       * each pair of blocks, a block paired with itself included. These are
+       * the conditions getDominatingCondition gives for every pair, found
+       * without trying every pair: the common dominators of all pairs are
+       * those of neighbours in DFS order.
+       */
+      void getControllingConditions(llvm::ArrayRef<llvm::BasicBlock *> blocks,
+          llvm::SmallVectorImpl<llvm::Value *>& conds) const;
+
+    private:
+      struct Node {
+        llvm::BasicBlock *block;
+        unsigned dfsIn;
+        unsigned dfsOut;
+      };
+
+      // Nodes in DFS preorder of the dominator tree
+      std::vector<Node> nodes;
+      llvm::DenseMap<const llvm::BasicBlock *, unsigned> index;
+      // ancestors[k][n] is the 2^k-th dominator of node n, or the root
+      std::vector<std::vector<unsigned>> ancestors;
+
+      bool isAncestor(unsigned a, unsigned n) const;
+  };
+}
+
+#endif
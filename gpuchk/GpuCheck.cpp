@@ -0,0 +1,133 @@
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "BugEmitter.h"
+#include "KernelScheduler.h"
+#include "MemCoalesceAnalysis.h"
+#include "BranchDivergeAnalysis.h"
+#include "OffsetVal.h"
+#include "Utilities.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+using namespace gpucheck;
+
+static cl::list<string> InputFilenames(cl::Positional, cl::OneOrMore,
+    cl::desc("<input bitcode or IR files>"));
+
+static cl::opt<unsigned> Jobs("j", cl::init(0),
+    cl::desc("Number of inputs analyzed at once (default: one per core)"));
+
+static cl::opt<bool> RunCoalesce("coalesce", cl::init(true),
+    cl::desc("Locate uncoalesced memory accesses"));
+
+static cl::opt<bool> RunDiverge("bdiverge", cl::init(true),
+    cl::desc("Locate divergent branches"));
+
+/**
+ * Everything one input produced, printed once every input is done so the
+ * output doesn't depend on which worker finished first
+ */
+struct InputResult {
+  string output;
+  string errors;
+  bool failed = false;
+};
+
+static void analyzeFile(const string& filename, InputResult& result) {
+  raw_string_ostream out(result.output);
+
+  // Each input is parsed into its own context, so workers share no IR
+  LLVMContext context;
+  SMDiagnostic err;
+  unique_ptr<Module> M = parseIRFile(filename, err, context);
+  if(!M) {
+    // Errors go to stderr, apart from warnings which may be structured
+    raw_string_ostream errors(result.errors);
+    err.print("gpucheck", errors);
+    result.failed = true;
+    return;
+  }
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  registerGpuCheckAnalyses(MAM);
+
+  ModulePassManager MPM;
+  if(RunCoalesce)
+    MPM.addPass(MemCoalescePass());
+  if(RunDiverge)
+    MPM.addPass(BranchDivergePass());
+
+  setWarningStream(&out);
+  MPM.run(*M, MAM);
+  setWarningStream(nullptr);
+  out.flush();
+}
+
+int main(int argc, char **argv) {
+  llvm_shutdown_obj shutdown;
+  cl::ParseCommandLineOptions(argc, argv, "GPU performance bug checker\n");
+  string problem = getWarningOptionsError();
+  if(!problem.empty()) {
+    errs() << "gpucheck: " << problem << "\n";
+    return 1;
+  }
+
+  // Every worker holds an OffsetVal arena while it runs, plus one for each
+  // kernel thread it starts
+  unsigned arenasPerJob = getKernelThreads() > 1 ? getKernelThreads() + 1 : 1;
+  unsigned jobs = Jobs ? Jobs : llvm::heavyweight_hardware_concurrency();
+  if(jobs > (OffsetValArena::MaxArenas - 1) / arenasPerJob) {
+    jobs = (OffsetValArena::MaxArenas - 1) / arenasPerJob;
+    if(Jobs)
+      errs() << "warning: -j=" << Jobs << " with -kernel-threads=" << getKernelThreads()
+             << " needs more OffsetVal arenas than there are, using -j=" << max(jobs, 1u) << "\n";
+  }
+  if(jobs == 0)
+    jobs = 1;
+  if(jobs > InputFilenames.size())
+    jobs = InputFilenames.size();
+
+  vector<InputResult> results(InputFilenames.size());
+  {
+    ThreadPool pool(jobs);
+    for(unsigned i=0; i<InputFilenames.size(); i++) {
+      pool.async([i, &results] {
+        analyzeFile(InputFilenames[i], results[i]);
+      });
+    }
+    pool.wait();
+  }
+
+  // Merge in input order
+  bool failed = false;
+  for(auto r=results.begin(),e=results.end(); r!=e; ++r) {
+    errs() << r->errors;
+    getWarningStream() << r->output;
+    failed |= r->failed;
+  }
+  return failed ? 1 : 0;
+}
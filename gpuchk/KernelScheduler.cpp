@@ -0,0 +1,198 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "KernelScheduler.h"
+#include "BugEmitter.h"
+#include "QueryBudget.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace std;
+using namespace llvm;
+
+static cl::opt<unsigned> KernelThreads("kernel-threads", cl::init(1),
+    cl::desc("Number of threads GPU code is analyzed on"));
+
+// Every thread holds an arena, besides the reserved arena 0 and the caller's
+static const unsigned MaxKernelThreads = gpucheck::OffsetValArena::MaxArenas - 2;
+
+unsigned gpucheck::getKernelThreads() {
+  static const bool clamped = [] {
+    if(KernelThreads <= MaxKernelThreads)
+      return false;
+    errs() << "warning: -kernel-threads=" << KernelThreads << " exceeds the "
+           << MaxKernelThreads << " threads with an OffsetVal arena each, using "
+           << MaxKernelThreads << "\n";
+    return true;
+  }();
+  if(clamped)
+    return MaxKernelThreads;
+  return KernelThreads ? KernelThreads : 1;
+}
+
+namespace {
+  /**
+   * The queries a worker has left, [next, end). The owner takes from the
+   * front, thieves split off the back.
+   */
+  struct WorkRange {
+    mutex lock;
+    unsigned next = 0;
+    unsigned end = 0;
+
+    bool take(unsigned& index) {
+      lock_guard<mutex> guard(lock);
+      if(next == end)
+        return false;
+      index = next++;
+      return true;
+    }
+
+    bool stealHalf(unsigned& from, unsigned& to) {
+      lock_guard<mutex> guard(lock);
+      if(next == end)
+        return false;
+      to = end;
+      end -= (end - next + 1) / 2;
+      from = end;
+      return true;
+    }
+
+    void refill(unsigned from, unsigned to) {
+      lock_guard<mutex> guard(lock);
+      next = from;
+      end = to;
+    }
+  };
+}
+
+void gpucheck::analyzeQueries(unsigned count, OffsetPropagation& OP,
+    function<void(unsigned, OffsetPropagation&)> query, vector<string> *results) {
+  unsigned threads = getKernelThreads();
+  if(threads > count)
+    threads = count;
+
+  if(threads <= 1 && !results) {
+    for(unsigned i=0; i<count; i++)
+      query(i, OP);
+    return;
+  }
+  raw_ostream& caller = getWarningStream();
+  vector<string> buffers(count);
+  if(threads <= 1) {
+    for(unsigned i=0; i<count; i++) {
+      raw_string_ostream out(buffers[i]);
+      setWarningStream(&out);
+      query(i, OP);
+      out.flush();
+    }
+    setWarningStream(&caller);
+    results->swap(buffers);
+    return;
+  }
+
+  // Shards only share analyses which are already built
+  OP.prepareAnalyses();
+  vector<unique_ptr<OffsetPropagation>> shards;
+  for(unsigned t=0; t<threads; t++)
+    shards.push_back(OP.createShard());
+
+  vector<WorkRange> ranges(threads);
+  for(unsigned t=0; t<threads; t++)
+    ranges[t].refill(count * (uint64_t)t / threads, count * (uint64_t)(t + 1) / threads);
+
+  {
+    ThreadPool pool(threads);
+    for(unsigned t=0; t<threads; t++) {
+      OffsetPropagation *shard = shards[t].get();
+      pool.async([t, threads, shard, &ranges, &buffers, &query] {
+        shard->makeCurrent();
+        WorkRange& own = ranges[t];
+        while(true) {
+          unsigned i;
+          if(!own.take(i)) {
+            // Queries are never added, so once every range is empty we're done
+            unsigned from, to;
+            bool stolen = false;
+            for(unsigned v=1; v<threads && !stolen; v++)
+              stolen = ranges[(t + v) % threads].stealHalf(from, to);
+            if(!stolen)
+              break;
+            own.refill(from, to);
+            continue;
+          }
+          raw_string_ostream out(buffers[i]);
+          setWarningStream(&out);
+          query(i, *shard);
+          setWarningStream(nullptr);
+          out.flush();
+        }
+      });
+    }
+    pool.wait();
+  }
+  // Without threading support the pool may have run on this thread
+  OP.makeCurrent();
+  setWarningStream(&caller);
+
+  if(results) {
+    results->swap(buffers);
+    return;
+  }
+  for(auto b=buffers.begin(),e=buffers.end(); b!=e; ++b)
+    caller << *b;
+}
+
+void gpucheck::analyzeFunctions(const vector<Function *>& funcs, OffsetPropagation& OP,
+    AnalysisCache& cache, function<void(Function&, vector<Instruction *>&)> gather,
+    function<void(Instruction *, OffsetPropagation&)> query) {
+  vector<Instruction *> queries;
+  // Written only by the thread answering each query
+  vector<char> timedOut;
+  auto answer = [&queries, &query, &timedOut](unsigned n, OffsetPropagation& shard) {
+    unsigned before = QueryBudget::getTimeouts();
+    query(queries[n], shard);
+    timedOut[n] = QueryBudget::getTimeouts() != before;
+  };
+  if(!cache.enabled()) {
+    for(auto f=funcs.begin(),e=funcs.end(); f!=e; ++f)
+      gather(**f, queries);
+    timedOut.resize(queries.size());
+    analyzeQueries(queries.size(), OP, answer);
+    return;
+  }
+
+  // Each function's queries are [start[f], start[f+1]); replayed ones have none
+  vector<string> replayed(funcs.size());
+  vector<bool> hit(funcs.size());
+  vector<unsigned> start;
+  for(unsigned f=0; f<funcs.size(); f++) {
+    start.push_back(queries.size());
+    hit[f] = cache.lookup(*funcs[f], replayed[f]);
+    if(!hit[f])
+      gather(*funcs[f], queries);
+  }
+  start.push_back(queries.size());
+  timedOut.resize(queries.size());
+
+  vector<string> results;
+  analyzeQueries(queries.size(), OP, answer, &results);
+
+  raw_ostream& out = getWarningStream();
+  for(unsigned f=0; f<funcs.size(); f++) {
+    if(!hit[f]) {
+      bool timely = true;
+      for(unsigned q=start[f]; q<start[f+1]; q++) {
+        replayed[f] += results[q];
+        timely &= !timedOut[q];
+      }
+      // A warning only given for lack of time might not be given next time
+      if(timely)
+        cache.store(*funcs[f], replayed[f]);
+    }
+    out << replayed[f];
+  }
+}
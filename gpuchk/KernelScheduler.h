@@ -0,0 +1,52 @@
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "OffsetPropagation.h"
+#include "AnalysisCache.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifndef KERNEL_SCHEDULER_H
+#define KERNEL_SCHEDULER_H
+
+namespace gpucheck {
+
+  /**
+   * Number of threads GPU code is analyzed on, from -kernel-threads.
+   * One, the default, analyzes it serially on the calling thread. Each
+   * thread needs its own OffsetVal arena, so the option is capped, with a
+   * warning, at the number of arenas left to them.
+   */
+  extern unsigned getKernelThreads();
+
+  /**
+   * Run query over each index below count. Queries only read the IR and
+   * ThreadDependence, so with more than one kernel thread they are spread
+   * over a thread pool, each worker answering them on its own shard of OP.
+   *
+   * Workers start on contiguous runs of queries, so neighbouring accesses
+   * reuse the expressions and simplifications cached in the same shard,
+   * and steal half of another worker's remaining run once theirs is done.
+   *
+   * Warnings are buffered per query and written to the calling thread's
+   * warning stream in index order, whatever order the queries finish in.
+   * If results is given, each query's warnings are left in it instead.
+   */
+  extern void analyzeQueries(unsigned count, OffsetPropagation& OP,
+      std::function<void(unsigned, OffsetPropagation&)> query,
+      std::vector<std::string> *results = nullptr);
+
+  /**
+   * Answer the queries gather finds in each of funcs with analyzeQueries,
+   * writing the warnings in the order of funcs. Functions whose warnings
+   * are in cache are replayed without gathering them, and the warnings of
+   * the others are stored, unless one of their queries ran out of time.
+   */
+  extern void analyzeFunctions(const std::vector<llvm::Function *>& funcs, OffsetPropagation& OP,
+      AnalysisCache& cache,
+      std::function<void(llvm::Function&, std::vector<llvm::Instruction *>&)> gather,
+      std::function<void(llvm::Instruction *, OffsetPropagation&)> query);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "LaneProgram.h"
+#include "OffsetPoly.h"
+
+using namespace llvm;
+
+namespace gpucheck {
+
+  static bool fitsLane(int64_t v) {
+    return v == (int32_t)v;
+  }
+
+  bool LaneProgram::compile(const OffsetValPtr& ov) {
+    code.clear();
+    DenseMap<OffsetValPtr, unsigned> emitted;
+    unsigned reg;
+    if(!emit(ov, emitted, reg)) {
+      code.clear();
+      return false;
+    }
+    registers.assign(code.size() * Lanes, 0);
+    return true;
+  }
+
+  bool LaneProgram::emit(const OffsetValPtr& ov, DenseMap<OffsetValPtr, unsigned>& emitted, unsigned& reg) {
+    auto found = emitted.find(ov);
+    if(found != emitted.end()) {
+      reg = found->second;
+      return true;
+    }
+
+    Instr instr;
+    instr.op = OffsetOperator::end;
+    instr.index = AffineOffset::NumIndices;
+    instr.lhs = instr.rhs = 0;
+    instr.value = 0;
+
+    if(ov->isConst()) {
+      APInt c = toCoefficient(ov->constVal());
+      if(!fitsLane(c.getSExtValue()))
+        return false;
+      instr.kind = LoadConst;
+      instr.value = c.getSExtValue();
+    } else if(auto bo = dyn_cast<BinOpOffsetVal>(&*ov)) {
+      if(!emit(bo->lhs, emitted, instr.lhs) || !emit(bo->rhs, emitted, instr.rhs))
+        return false;
+      instr.kind = Apply;
+      instr.op = bo->op;
+    } else {
+      instr.kind = LoadIndex;
+      instr.index = getIndexKind(ov);
+      if(instr.index == AffineOffset::NumIndices)
+        return false; // Not known for any thread
+    }
+
+    reg = code.size();
+    code.push_back(instr);
+    emitted[ov] = reg;
+    return true;
+  }
+
+  // Lane-wise r = a op b. Returns false if any lane faults.
+  static bool apply(OffsetOperator op, const int64_t* a, const int64_t* b, int64_t* r) {
+    const unsigned N = LaneProgram::Lanes;
+    bool fault = false;
+    switch(op) {
+      case OffsetOperator::SDiv:
+      case OffsetOperator::SRem:
+        for(unsigned l=0; l<N; l++)
+          fault |= b[l] == 0;
+        break;
+      case OffsetOperator::UDiv:
+      case OffsetOperator::URem:
+        // Negative values would need their real width
+        for(unsigned l=0; l<N; l++)
+          fault |= b[l] <= 0 || a[l] < 0;
+        break;
+      default:
+        break;
+    }
+    if(fault)
+      return false;
+
+    switch(op) {
+      case OffsetOperator::Add: for(unsigned l=0; l<N; l++) r[l] = a[l] + b[l]; break;
+      case OffsetOperator::Sub: for(unsigned l=0; l<N; l++) r[l] = a[l] - b[l]; break;
+      case OffsetOperator::Mul: for(unsigned l=0; l<N; l++) r[l] = a[l] * b[l]; break;
+      case OffsetOperator::SDiv:
+      case OffsetOperator::UDiv: for(unsigned l=0; l<N; l++) r[l] = a[l] / b[l]; break;
+      case OffsetOperator::SRem:
+      case OffsetOperator::URem: for(unsigned l=0; l<N; l++) r[l] = a[l] % b[l]; break;
+      case OffsetOperator::And: for(unsigned l=0; l<N; l++) r[l] = a[l] & b[l]; break;
+      case OffsetOperator::Or: for(unsigned l=0; l<N; l++) r[l] = a[l] | b[l]; break;
+      case OffsetOperator::Xor: for(unsigned l=0; l<N; l++) r[l] = a[l] ^ b[l]; break;
+      case OffsetOperator::Eq: for(unsigned l=0; l<N; l++) r[l] = a[l] == b[l]; break;
+      case OffsetOperator::Neq: for(unsigned l=0; l<N; l++) r[l] = a[l] != b[l]; break;
+      case OffsetOperator::SLT: for(unsigned l=0; l<N; l++) r[l] = a[l] < b[l]; break;
+      case OffsetOperator::SLE: for(unsigned l=0; l<N; l++) r[l] = a[l] <= b[l]; break;
+      case OffsetOperator::SGT: for(unsigned l=0; l<N; l++) r[l] = a[l] > b[l]; break;
+      case OffsetOperator::SGE: for(unsigned l=0; l<N; l++) r[l] = a[l] >= b[l]; break;
+      case OffsetOperator::ULT: for(unsigned l=0; l<N; l++) r[l] = (uint64_t)a[l] < (uint64_t)b[l]; break;
+      case OffsetOperator::ULE: for(unsigned l=0; l<N; l++) r[l] = (uint64_t)a[l] <= (uint64_t)b[l]; break;
+      case OffsetOperator::UGT: for(unsigned l=0; l<N; l++) r[l] = (uint64_t)a[l] > (uint64_t)b[l]; break;
+      case OffsetOperator::UGE: for(unsigned l=0; l<N; l++) r[l] = (uint64_t)a[l] >= (uint64_t)b[l]; break;
+      case OffsetOperator::end: assert(false); return false;
+    }
+
+    for(unsigned l=0; l<N; l++)
+      fault |= !fitsLane(r[l]);
+    return !fault;
+  }
+
+  bool LaneProgram::run(int thread_idx, int thread_idy, int thread_idz,
+      int block_idx, int block_idy, int block_idz, int64_t out[Lanes]) {
+    assert(!code.empty() && "Running a program which failed to compile");
+    int64_t index[AffineOffset::NumIndices] = { thread_idx, thread_idy, thread_idz, 0,
+      block_idx, block_idy, block_idz };
+
+    for(unsigned i=0, e=code.size(); i!=e; i++) {
+      const Instr& instr = code[i];
+      int64_t* r = &registers[i * Lanes];
+      switch(instr.kind) {
+        case LoadConst:
+          for(unsigned l=0; l<Lanes; l++)
+            r[l] = instr.value;
+          break;
+        case LoadIndex:
+          // Only the x index and lane id vary across the warp
+          if(instr.index == AffineOffset::ThreadX) {
+            for(unsigned l=0; l<Lanes; l++)
+              r[l] = thread_idx + l;
+          } else if(instr.index == AffineOffset::LaneId) {
+            for(unsigned l=0; l<Lanes; l++)
+              r[l] = (thread_idx + l) % 32;
+          } else {
+            for(unsigned l=0; l<Lanes; l++)
+              r[l] = index[instr.index];
+          }
+          break;
+        case Apply:
+          if(!apply(instr.op, &registers[instr.lhs * Lanes], &registers[instr.rhs * Lanes], r))
+            return false;
+          break;
+      }
+    }
+
+    const int64_t* result = &registers[(code.size() - 1) * Lanes];
+    for(unsigned l=0; l<Lanes; l++)
+      out[l] = result[l];
+    return true;
+  }
+}
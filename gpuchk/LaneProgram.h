@@ -0,0 +1,64 @@
+#include "OffsetVal.h"
+#include "OffsetOps.h"
+#include "llvm/ADT/DenseMap.h"
+#include <cstdint>
+#include <vector>
+
+#ifndef LANE_PROGRAM_H
+#define LANE_PROGRAM_H
+
+namespace gpucheck {
+
+  /**
+   * An OffsetVal compiled once into a flat program over int64 registers,
+   * then evaluated for all lanes of a warp at once. Each instruction writes
+   * its own register, holding one value per lane, and shared subexpressions
+   * are only computed once.
+   *
+   * Only constants and the thread and block indices may appear as leaves.
+   * Values are kept within 32 bits, where int64 arithmetic agrees with the
+   * folding done on substituted OffsetVals; anything else faults.
+   */
+  class LaneProgram {
+    public:
+      static const unsigned Lanes = 32;
+
+      /**
+       * Returns false if ov cannot be compiled
+       */
+      bool compile(const OffsetValPtr& ov);
+
+      /**
+       * Evaluate for the threads thread_idx .. thread_idx+Lanes-1, with the
+       * other indices as given. Returns false if any lane faults, such as
+       * on division by zero.
+       */
+      bool run(int thread_idx, int thread_idy, int thread_idz,
+          int block_idx, int block_idy, int block_idz, int64_t out[Lanes]);
+
+      unsigned size() const { return code.size(); }
+
+    private:
+      enum InstrKind : uint8_t {
+        LoadConst,
+        LoadIndex,
+        Apply
+      };
+      struct Instr {
+        InstrKind kind;
+        OffsetOperator op;
+        AffineOffset::Index index;
+        unsigned lhs;
+        unsigned rhs;
+        int64_t value;
+      };
+
+      // Instruction i writes register i
+      std::vector<Instr> code;
+      std::vector<int64_t> registers;
+
+      bool emit(const OffsetValPtr& ov, llvm::DenseMap<OffsetValPtr, unsigned>& emitted, unsigned& reg);
+  };
+}
+
+#endif
@@ -12,6 +12,9 @@
 #include "BugEmitter.h"
 #include "Utilities.h"
 #include "OffsetOps.h"
+#include "LaneProgram.h"
+#include "KernelScheduler.h"
+#include "Profiler.h"
 
 #include <vector>
 #include <utility>
@@ -28,34 +31,71 @@ using namespace gpucheck;
 #define ACCESS_SIZE 256
 
 bool MemCoalesceAnalysis::runOnModule(Module &M) {
-  TD = &getAnalysis<ThreadDependence>();
-  OP = &getAnalysis<OffsetPropagation>();
-  ASA = &getAnalysis<AddrSpaceAnalysis>();
-  // Run over each GPU function
+  return runOnModule(M, &getAnalysis<ThreadDependence>(),
+      &getAnalysis<OffsetPropagation>(), &getAnalysis<AddrSpaceAnalysis>());
+}
+
+bool MemCoalesceAnalysis::runOnModule(Module &M, ThreadDependence *TD,
+    OffsetPropagation *OP, AddrSpaceAnalysis *ASA) {
+  this->TD = TD;
+  this->OP = OP;
+  this->ASA = ASA;
+  // Every access is an independent query, so gather them from each GPU
+  // function in order and answer them as one batch
+  vector<Function *> funcs;
   for(auto f=M.begin(), e=M.end(); f!=e; ++f) {
     //if(isKernelFunction(*f))
-      runOnKernel(*f);
+    if(!f->isDeclaration())
+      funcs.push_back(&*f);
+  }
+  DebugVariableIndex variables;
+  this->names = &variables;
+  AnalysisCache cache(M, "coalesce", "threshold=" + to_string(COALESCE_THRES) +
+      " access=" + to_string(ACCESS_SIZE) + " " + getBudgetOptions());
+  {
+    // Groups repeated warnings, if asked to, once every query is answered
+    WarningAggregator aggregate;
+    analyzeFunctions(funcs, *OP, cache, [](Function &F, vector<Instruction *>& accesses) {
+      for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+        for(auto i=b->begin(),ie=b->end(); i!=ie; ++i) {
+          if(isa<LoadInst>(i) || isa<StoreInst>(i) || isa<CallInst>(i))
+            accesses.push_back(&*i);
+        }
+      }
+    }, [this](Instruction *i, OffsetPropagation &shard) {
+      MemCoalesceAnalysis worker;
+      worker.TD = this->TD;
+      worker.OP = &shard;
+      worker.ASA = this->ASA;
+      worker.names = this->names;
+      worker.testInstruction(i);
+    });
   }
+  reportProfile(M, "coalesce");
+  this->names = nullptr;
   return false;
 }
 
 bool MemCoalesceAnalysis::runOnKernel(Function &F) {
 
   for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
-    for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
-      if(auto L=dyn_cast<LoadInst>(i))
-        testLoad(L);
-
-      if(auto S=dyn_cast<StoreInst>(i))
-        testStore(S);
-
-      if(auto CI=dyn_cast<CallInst>(i))
-        testCall(CI);
-    }
+    for(auto i=b->begin(),e=b->end(); i!=e; ++i)
+      testInstruction(&*i);
   }
   return false;
 }
 
+void MemCoalesceAnalysis::testInstruction(Instruction *i) {
+  if(auto L=dyn_cast<LoadInst>(i))
+    testLoad(L);
+
+  if(auto S=dyn_cast<StoreInst>(i))
+    testStore(S);
+
+  if(auto CI=dyn_cast<CallInst>(i))
+    testCall(CI);
+}
+
 void MemCoalesceAnalysis::testCall(CallInst *CI) {
   if(auto MC = dyn_cast<MemCpyInst>(CI))
     if(!testAccess(MC, MC->getDest()))
@@ -81,23 +121,28 @@ bool MemCoalesceAnalysis::testAccess(Instruction *i, Value *ptr) {
   // Ignore stack allocations
   if(isa<AllocaInst>(ptr))
     return false;
-  // Ignore shared/constant memory accesses
-  if(!ASA->mayBeGlobal(i))
+  // Ignore shared/local memory accesses
+  if(!ASA->mayBeGlobal(ptr))
     return false;
   MemAccess tpe = getAccessType(i, ptr);
   if(tpe == Update && isa<StoreInst>(i)) {
     // Don't report updates twice
     return false;
   }
+  QueryProfile profile("coalesce", i);
   DEBUG(errs() << "Found a memory access:\n");
   DEBUG(i->dump());
-  DEBUG(errs() << "\n Memory requests required per warp: " <<
-      requestsPerWarp(ptr) << "\n");
   // We have a memory access to inspect
-  float requests = requestsPerWarp(ptr);
-  if(requests > COALESCE_THRES) {
+  QueryResult requests = requestsPerWarp(ptr);
+  profileResult(requests);
+  DEBUG(errs() << "\n Memory requests required per warp: " << requests.value
+      << " (" << getTierName(requests.tier) << " tier"
+      << (requests.conservative ? ", conservative" : "") << ")\n");
+  if(requests.value > COALESCE_THRES) {
+    // getWarning sets the severity, so it must run before sev is read
     Severity sev;
-    emitWarning(getWarning(&*ptr, tpe, requests, sev), &*i, sev);
+    string warning = getWarning(&*ptr, tpe, requests.value, sev) + requests.caveat();
+    emitWarning(warning, &*i, sev, WARN_UNCOALESCED, requests);
     return true;
   }
 
@@ -133,18 +178,19 @@ MemAccess MemCoalesceAnalysis::getAccessType(Instruction *i, Value *address) {
 string MemCoalesceAnalysis::getWarning(Value *ptr, MemAccess tpe, float requestsPerWarp, Severity& severity) {
   int reqs = (int) requestsPerWarp;
   string prefix = "";
+  string name = names ? getValueName(ptr, *names) : getValueName(ptr);
   switch (tpe) {
     case Write:
-      prefix = "In write to "+getValueName(ptr)+", ";
+      prefix = "In write to "+name+", ";
       break;
     case Read:
-      prefix = "In read from "+getValueName(ptr)+", ";
+      prefix = "In read from "+name+", ";
       break;
     case Update:
-      prefix = "In update to "+getValueName(ptr)+", ";
+      prefix = "In update to "+name+", ";
       break;
     case Copy:
-      prefix = "In copy to "+getValueName(ptr)+", ";
+      prefix = "In copy to "+name+", ";
       break;
   }
 
@@ -187,80 +233,181 @@ string MemCoalesceAnalysis::getWarning(Value *ptr, MemAccess tpe, float requests
   */
 }
 
-float MemCoalesceAnalysis::requestsPerWarp(Value *ptr) {
+/**
+ * Merge the access at offset into the first request it fits, or start a new one
+ */
+static void addToRequests(vector<pair<long long, long long>>& requests, long long offset) {
+  for(auto r=requests.begin(),e=requests.end();r!=e;++r) {
+    if(offset >= r->first && offset <= r->second) {
+      return;
+    } else if(offset < r->first && offset >= r->second - ACCESS_SIZE) {
+      r->first = offset;
+      return;
+    } else if(offset + 4 > r->second && offset + 4 <= r->first + ACCESS_SIZE) {
+      r->second = offset + 4;
+      return;
+    }
+  }
+  requests.push_back(make_pair(offset, offset + 4));
+}
+
+/**
+ * Closed form of addToRequests for lanes a constant stride
+ * apart. Each request spans ACCESS_SIZE bytes, including the final 4-byte
+ * access, so holds every lane within ACCESS_SIZE-4 bytes of its first.
+ */
+static int affineRequests(int64_t stride) {
+  if(stride == 0)
+    return 1;
+  uint64_t distance = stride < 0 ? -(uint64_t)stride : (uint64_t)stride;
+  uint64_t lanesPerRequest = (ACCESS_SIZE - 4) / distance + 1;
+  return (int)((32 + lanesPerRequest - 1) / lanesPerRequest);
+}
 
-  OffsetValPtr ptr_offset = OP->getOrCreateVal(ptr);
+QueryResult MemCoalesceAnalysis::requestsPerWarp(Value *ptr) {
+  // All the thread dependence lattice knows is that the address varies
+  // across threads, so at worst every lane needs its own request
+  QueryResult worst(32.0f, TierLattice, true);
+  if(getMaxAnalysisTier() == TierLattice)
+    return worst;
+  QueryBudget budget;
+
+  OffsetValPtr ptr_offset;
+  {
+    PhaseTimer timer(PhaseConstruct);
+    ptr_offset = OP->getOrCreateVal(ptr);
+  }
   assert(ptr_offset != nullptr);
+  profileExpression(PhaseConstruct, ptr_offset);
   DEBUG(errs() << "Analyzing possibly uncoalesced access:\n    " << *ptr << "\n");
-  vector<OffsetValPtr> all_paths = OP->inContexts(ptr_offset);
+  vector<OffsetValPtr> all_paths;
+  {
+    PhaseTimer timer(PhaseContexts);
+    all_paths = OP->inContexts(ptr_offset);
+  }
   DEBUG(errs() << "Context-sensitive analysis generated " << all_paths.size() << " contexts\n");
 
   float maxRequests = 0.0f;
+  AnalysisTier tier = TierSymbolic;
+  bool conservative = false;
   for(auto path=all_paths.begin(),e=all_paths.end(); path != e; ++path) {
     // Apply some (arbitrary) grid boundaries
-    OffsetValPtr gridCtx = OP->inGridContext(*path, 256, 32, 32, 1, 1, 1);
+    OffsetValPtr gridCtx;
+    {
+      PhaseTimer timer(PhaseContexts);
+      gridCtx = OP->inGridContext(*path, 256, 32, 32, 1, 1, 1);
+    }
+    profileExpression(PhaseContexts, gridCtx);
     DEBUG(cerr << "In grid context: " << *gridCtx <<"\n");
     // Perform as much simplification as we can early
-    OffsetValPtr simp = simplifyOffsetVal(sumOfProducts(gridCtx));
-
-    // Optimization: Calculate the difference between threads 0 and 1
-    OffsetValPtr threadDiff = cancelDiffs(make_shared<BinOpOffsetVal>(
-        OP->inThreadContext(simp,1,0,0,0,0,0),
-        Sub,
-        OP->inThreadContext(simp,0,0,0,0,0,0)), *TD);
-
-    if(!threadDiff->isConst()) {
-      DEBUG(errs() << "Cannot generate constant for access. Expression follows.\n");
-      DEBUG(cerr << *threadDiff <<"\n");
-      auto rnge = threadDiff->constRange();
-      DEBUG(errs() << "Range: " << rnge.first << " to " << rnge.second << "\n");
-      return 32.0; // Branch cannot be analyzed in at least 1 context
+    OffsetValPtr simp;
+    {
+      PhaseTimer timer(PhaseSimplify);
+      simp = simplifyOffsetVal(sumOfProducts(gridCtx));
+    }
+    profileExpression(PhaseSimplify, simp);
+    if(budget.exhausted()) {
+      DEBUG(errs() << "Out of budget simplifying access\n");
+      return worst;
     }
 
-
+    // Everything from here on counts requests across the lanes
+    PhaseTimer lanes(PhaseLanes);
     int requestCount = 0;
-    for(int warp=0; warp<8; warp++) {
-      OffsetValPtr warpBase = OP->inThreadContext(simp, warp*32, 0, 0, 0, 0, 0);
-      vector<std::pair<long long, long long>> requests;
-      for(int tid=0; tid<32; tid++) {
-        OffsetValPtr threadBase = OP->inThreadContext(simp, warp*32+tid, 0, 0, 0, 0, 0);
-        OffsetValPtr threadDiff = cancelDiffs(make_shared<BinOpOffsetVal>(warpBase, Sub, threadBase), *TD);
-
-        if(!threadDiff->isConst()) {
-          requestCount++;
-          continue;
+    AffineOffset affine;
+    LaneProgram program;
+    if(getAffineOffset(simp, *TD, affine)) {
+      // Every warp sees the same stride between lanes, so the count follows directly
+      int64_t stride = affine.at(1,0,0,0,0,0) - affine.at(0,0,0,0,0,0);
+      DEBUG(errs() << "Affine access with lane stride " << stride << "\n");
+      requestCount = 8 * affineRequests(stride);
+    } else if(program.compile(threadDependentPart(simp, *TD))) {
+      // Concrete offsets for every lane, without building any expressions
+      DEBUG(errs() << "Evaluating access with a " << program.size() << " instruction program\n");
+      int64_t offsets[LaneProgram::Lanes];
+      for(int warp=0; warp<8; warp++) {
+        if(!program.run(warp*32, 0, 0, 0, 0, 0, offsets)) {
+          requestCount = -1;
+          break;
         }
-        long long offset = threadDiff->constVal().getSExtValue();
-
-        bool fits = false;
-        for(auto r=requests.begin(),e=requests.end();r!=e;++r) {
-          if(offset >= r->first && offset <= r->second) {
-            fits = true;
-            break;
-          } else if(offset < r->first && offset >= r->second - ACCESS_SIZE) {
-            r->first = offset;
-            fits = true;
-            break;
-          } else if(offset + 4 > r->second && offset + 4 <= r->first + ACCESS_SIZE) {
-            r->second = offset + 4;
-            fits = true;
-            break;
+        vector<std::pair<long long, long long>> requests;
+        for(unsigned tid=0; tid<LaneProgram::Lanes; tid++)
+          addToRequests(requests, offsets[0] - offsets[tid]);
+        requestCount += requests.size();
+      }
+    } else {
+      requestCount = -1;
+    }
+    if(budget.exhausted()) {
+      DEBUG(errs() << "Out of budget solving access\n");
+      return worst;
+    }
+
+    if(requestCount < 0 && getMaxAnalysisTier() < TierEnumerate)
+      return worst;
+    if(requestCount < 0) {
+      requestCount = 0;
+      tier = TierEnumerate;
+      // Optimization: Calculate the difference between threads 0 and 1
+      OffsetValPtr threadDiff = cancelDiffs(BinOpOffsetVal::get(
+          OP->inThreadContext(simp,1,0,0,0,0,0),
+          Sub,
+          OP->inThreadContext(simp,0,0,0,0,0,0)), *TD);
+
+      if(budget.exhausted()) {
+        DEBUG(errs() << "Out of budget enumerating access\n");
+        return worst;
+      }
+      if(!threadDiff->isConst()) {
+        DEBUG(errs() << "Cannot generate constant for access. Expression follows.\n");
+        DEBUG(cerr << *threadDiff <<"\n");
+        auto rnge = threadDiff->constRange();
+        DEBUG(errs() << "Range: " << rnge.first << " to " << rnge.second << "\n");
+        // Branch cannot be analyzed in at least 1 context
+        return QueryResult(32.0f, TierEnumerate, true);
+      }
+
+
+      for(int warp=0; warp<8 && !budget.exhausted(); warp++) {
+        OffsetValPtr warpBase = OP->inThreadContext(simp, warp*32, 0, 0, 0, 0, 0);
+        vector<std::pair<long long, long long>> requests;
+        for(int tid=0; tid<32; tid++) {
+          OffsetValPtr threadBase = OP->inThreadContext(simp, warp*32+tid, 0, 0, 0, 0, 0);
+          OffsetValPtr threadDiff = cancelDiffs(BinOpOffsetVal::get(warpBase, Sub, threadBase), *TD);
+
+          if(!threadDiff->isConst()) {
+            // Assume the lane needs a request of its own
+            requestCount++;
+            conservative = true;
+            continue;
           }
+          addToRequests(requests, threadDiff->constVal().getSExtValue());
         }
-        if(!fits)
-          requests.push_back(make_pair(offset, offset + 4));
+        requestCount += requests.size();
+      }
+      if(budget.exhausted()) {
+        DEBUG(errs() << "Out of budget enumerating access\n");
+        return worst;
       }
-      requestCount += requests.size();
     }
 
     if(requestCount/8.0f > maxRequests) {
       maxRequests = requestCount/8.0f;
       if(maxRequests > COALESCE_THRES) {
-        return maxRequests; // Might as well short-circuit here
+        // Might as well short-circuit here
+        return QueryResult(maxRequests, tier, conservative);
       }
     }
   }
-  return maxRequests / 32.0f;
+  return QueryResult(maxRequests / 32.0f, tier, conservative);
+}
+
+PreservedAnalyses MemCoalescePass::run(Module &M, ModuleAnalysisManager &AM) {
+  MemCoalesceAnalysis MCA;
+  MCA.runOnModule(M, AM.getResult<ThreadDependenceAnalysis>(M).get(),
+      AM.getResult<OffsetPropagationAnalysis>(M).get(),
+      AM.getResult<AddrSpaceAnalysisNPM>(M).get());
+  return PreservedAnalyses::all();
 }
 
 char MemCoalesceAnalysis::ID = 0;
@@ -1,11 +1,14 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
 
 #include "BugEmitter.h"
 #include "AddrSpaceAnalysis.h"
 #include "ThreadDepAnalysis.h"
 #include "OffsetPropagation.h"
+#include "QueryBudget.h"
+#include "Utilities.h"
 
 #ifndef MEM_COALESCE_H
 #define MEM_COALESCE_H
@@ -23,7 +26,7 @@ namespace gpucheck {
   class MemCoalesceAnalysis : public ModulePass {
     public:
       static char ID;
-      MemCoalesceAnalysis() : ModulePass(ID) {}
+      MemCoalesceAnalysis() : ModulePass(ID), names(nullptr) {}
       void getAnalysisUsage(AnalysisUsage &AU) const {
         AU.setPreservesAll();
         AU.addRequired<ThreadDependence>();
@@ -31,8 +34,11 @@ namespace gpucheck {
         AU.addRequired<AddrSpaceAnalysis>();
       }
       bool runOnModule(Module &M);
+      bool runOnModule(Module &M, ThreadDependence *TD, OffsetPropagation *OP,
+          AddrSpaceAnalysis *ASA);
       bool runOnKernel(Function &F);
-      float requestsPerWarp(Value *ptr);
+      void testInstruction(Instruction *i);
+      QueryResult requestsPerWarp(Value *ptr);
       MemAccess getAccessType(Instruction *i, Value *address);
       string getWarning(Value *ptr, MemAccess tpe, float requestsPerWarp, Severity& severity);
 
@@ -44,6 +50,16 @@ namespace gpucheck {
       AddrSpaceAnalysis *ASA;
       ThreadDependence *TD;
       OffsetPropagation *OP;
+      // Names for warnings, shared by every worker of one run
+      DebugVariableIndex *names;
+  };
+
+  /**
+   * MemCoalesceAnalysis for the new pass manager
+   */
+  class MemCoalescePass : public PassInfoMixin<MemCoalescePass> {
+    public:
+      PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
   };
 
 }
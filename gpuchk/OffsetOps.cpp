@@ -1,11 +1,47 @@
 #include "ThreadDepAnalysis.h"
 #include "OffsetOps.h"
+#include "QueryBudget.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Intrinsics.h"
+
+#define DEBUG_TYPE "acf"
+
+STATISTIC(ACFMemoHits, "Number of ACF Rewrites Answered From Memo Tables");
+STATISTIC(ACFMemoMisses, "Number of ACF Rewrites Computed And Memoized");
 
 using namespace llvm;
 using namespace std;
 
 namespace gpucheck {
 
+  /**
+   * Returns the memoized result of compute(ov), computing it on a miss.
+   * Leaves are never rewritten, so they bypass the tables entirely.
+   *
+   * Each miss is charged to the query's budget. Once it is spent, nodes are
+   * returned unrewritten, and nothing computed from then on is memoized,
+   * since it may be built on those.
+   */
+  template<typename Compute>
+  OffsetValPtr memoized(OffsetValArena::MemoKind kind, OffsetValPtr ov, Compute compute) {
+    if(!isa<BinOpOffsetVal>(&*ov))
+      return ov;
+
+    DenseMap<OffsetValPtr, OffsetValPtr>& memo = OffsetValArena::current().getMemo(kind);
+    auto cached = memo.find(ov);
+    if(cached != memo.end()) {
+      ++ACFMemoHits;
+      return cached->second;
+    }
+    if(!QueryBudget::charge())
+      return ov;
+    ++ACFMemoMisses;
+    OffsetValPtr res = compute(ov);
+    if(!QueryBudget::currentExhausted())
+      memo[ov] = res;
+    return res;
+  }
+
   OffsetValPtr negateCondition(OffsetValPtr& cond) {
     assert(isa<BinOpOffsetVal>(cond.get()));
     auto b=dyn_cast<BinOpOffsetVal>(cond.get());
@@ -13,9 +49,9 @@ namespace gpucheck {
     OffsetValPtr rhs = b->rhs;
     // Logical conditionals, apply DeMorgan's laws.
     if (b->op == OffsetOperator::And)
-      return make_shared<BinOpOffsetVal>(negateCondition(lhs), OffsetOperator::Or, negateCondition(rhs));
+      return BinOpOffsetVal::get(negateCondition(lhs), OffsetOperator::Or, negateCondition(rhs));
     else if (b->op == OffsetOperator::Or)
-      return make_shared<BinOpOffsetVal>(negateCondition(lhs), OffsetOperator::And, negateCondition(rhs));
+      return BinOpOffsetVal::get(negateCondition(lhs), OffsetOperator::And, negateCondition(rhs));
     // Comparison conditions are negated by flipping the operator.
     OffsetOperator flipped;
     switch(b->op) {
@@ -32,23 +68,31 @@ namespace gpucheck {
       default: flipped = end; break;
     }
     assert(flipped != OffsetOperator::end);
-    return make_shared<BinOpOffsetVal>(b->lhs, flipped, b->rhs);
+    return BinOpOffsetVal::get(b->lhs, flipped, b->rhs);
   }
 
-  OffsetValPtr sumOfProducts(OffsetValPtr ov) {    
-    OffsetValPtr tmp = ov;
-    OffsetValPtr res = sumOfProductsPass(ov);
-    while (!matchingOffsets(tmp, res)) {
-      tmp = res;
-      res = sumOfProductsPass(tmp);
-    }
-    return res;
+  OffsetValPtr sumOfProducts(OffsetValPtr ov) {
+    return memoized(OffsetValArena::MemoSumOfProducts, ov, [](OffsetValPtr ov) {
+      OffsetValPtr tmp = ov;
+      OffsetValPtr res = sumOfProductsPass(ov);
+      while (!matchingOffsets(tmp, res)) {
+        tmp = res;
+        res = sumOfProductsPass(tmp);
+      }
+      // The fixed point is already in normal form
+      if(!QueryBudget::currentExhausted())
+        OffsetValArena::current().getMemo(OffsetValArena::MemoSumOfProducts)[res] = res;
+      return res;
+    });
   }
 
   OffsetValPtr sumOfProductsPass(OffsetValPtr ov) {
+    return memoized(OffsetValArena::MemoSumOfProductsPass, ov, computeSumOfProductsPass);
+  }
+
+  OffsetValPtr computeSumOfProductsPass(OffsetValPtr ov) {
     auto bo=dyn_cast<BinOpOffsetVal>(&*ov);
-    if(bo == nullptr)
-      return ov;
+    assert(bo != nullptr);
 
     // We're working with a binary operator
     OffsetValPtr lhs = sumOfProductsPass(bo->lhs);
@@ -58,30 +102,30 @@ namespace gpucheck {
       auto lhs_bo=dyn_cast<BinOpOffsetVal>(&*lhs);
       if(lhs_bo != nullptr && (lhs_bo->op == OffsetOperator::Add || lhs_bo->op == OffsetOperator::Sub)) {
         // Multiply RHS into LHS operands
-        auto new_lhs = make_shared<BinOpOffsetVal>(lhs_bo->lhs, bo->op, rhs);
-        auto new_rhs = make_shared<BinOpOffsetVal>(lhs_bo->rhs, bo->op, rhs);
-        return make_shared<BinOpOffsetVal>(new_lhs, lhs_bo->op, new_rhs);
+        auto new_lhs = BinOpOffsetVal::get(lhs_bo->lhs, bo->op, rhs);
+        auto new_rhs = BinOpOffsetVal::get(lhs_bo->rhs, bo->op, rhs);
+        return BinOpOffsetVal::get(new_lhs, lhs_bo->op, new_rhs);
       }
 
       auto rhs_bo=dyn_cast<BinOpOffsetVal>(&*rhs);
       if(rhs_bo != nullptr && (rhs_bo->op == OffsetOperator::Add || rhs_bo->op == OffsetOperator::Sub)) {
         // Multiply LHS into RHS operands
-        auto new_lhs = make_shared<BinOpOffsetVal>(lhs, bo->op, rhs_bo->lhs);
-        auto new_rhs = make_shared<BinOpOffsetVal>(lhs, bo->op, rhs_bo->rhs);
-        return make_shared<BinOpOffsetVal>(new_lhs, rhs_bo->op, new_rhs);
+        auto new_lhs = BinOpOffsetVal::get(lhs, bo->op, rhs_bo->lhs);
+        auto new_rhs = BinOpOffsetVal::get(lhs, bo->op, rhs_bo->rhs);
+        return BinOpOffsetVal::get(new_lhs, rhs_bo->op, new_rhs);
       }
     }
     else if (bo->op == OffsetOperator::SDiv || bo->op == OffsetOperator::UDiv) {
       auto lhs_bo=dyn_cast<BinOpOffsetVal>(&*lhs);
       if(lhs_bo != nullptr && (lhs_bo->op == OffsetOperator::Add || lhs_bo->op == OffsetOperator::Sub)) {
-        auto new_lhs = make_shared<BinOpOffsetVal>(lhs_bo->lhs, bo->op, rhs);
-        auto new_rhs = make_shared<BinOpOffsetVal>(lhs_bo->rhs, bo->op, rhs);
-        return make_shared<BinOpOffsetVal>(new_lhs, lhs_bo->op, new_rhs);
+        auto new_lhs = BinOpOffsetVal::get(lhs_bo->lhs, bo->op, rhs);
+        auto new_rhs = BinOpOffsetVal::get(lhs_bo->rhs, bo->op, rhs);
+        return BinOpOffsetVal::get(new_lhs, lhs_bo->op, new_rhs);
       }
     }
 
     // Just return the sum-of-productsed operands
-    return make_shared<BinOpOffsetVal>(lhs, bo->op, rhs);
+    return BinOpOffsetVal::get(lhs, bo->op, rhs);
   }
 
   OffsetValPtr simplifyConditions(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs) {
@@ -89,7 +133,7 @@ namespace gpucheck {
     if(auto bo_lhs=dyn_cast<BinOpOffsetVal>(&*lhs)) {
       if(auto bo_rhs=dyn_cast<BinOpOffsetVal>(&*rhs)) {
         if(bo_lhs->isCompare() && bo_rhs->isCompare() && op == OffsetOperator::Sub) {
-          return make_shared<BinOpOffsetVal>(lhs, OffsetOperator::Mul, negateCondition(rhs));
+          return BinOpOffsetVal::get(lhs, OffsetOperator::Mul, negateCondition(rhs));
         }
       }
     }
@@ -98,47 +142,17 @@ namespace gpucheck {
 
   OffsetValPtr simplifyConstantVal(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs) {
     assert(lhs->isConst() && rhs->isConst());
-    APInt lhsi = lhs->constVal();
-    APInt rhsi = rhs->constVal();
-
-    // Always just work in the larger bitwidth
-    if(lhsi.getBitWidth() > rhsi.getBitWidth())
-      rhsi = rhsi.zext(lhsi.getBitWidth());
-
-    if(rhsi.getBitWidth() > lhsi.getBitWidth())
-      lhsi = lhsi.zext(rhsi.getBitWidth());
-
-    APInt out;
-    switch(op) {
-      case OffsetOperator::Add: out = lhsi + rhsi; break;
-      case OffsetOperator::Sub: out = lhsi - rhsi; break;
-      case OffsetOperator::Mul: out = lhsi * rhsi; break;
-      case OffsetOperator::SDiv: out = lhsi.sdiv(rhsi); break;
-      case OffsetOperator::UDiv: out = lhsi.udiv(rhsi); break;
-      case OffsetOperator::SRem: out = lhsi.srem(rhsi); break;
-      case OffsetOperator::URem: out = lhsi.urem(rhsi); break;
-      //case OffsetOperator::And: out = lhsi.And(rhsi); break;
-      //case OffsetOperator::Or: out = lhsi.Or(rhsi); break;
-      //case OffsetOperator::Xor: out = lhsi.Xor(rhsi); break;
-      case OffsetOperator::Eq: out = lhsi.eq(rhsi); break;
-      case OffsetOperator::Neq: out = lhsi.ne(rhsi); break;
-      case OffsetOperator::SLT: out = lhsi.slt(rhsi); break;
-      case OffsetOperator::SLE: out = lhsi.sle(rhsi); break;
-      case OffsetOperator::ULT: out = lhsi.ult(rhsi); break;
-      case OffsetOperator::ULE: out = lhsi.ule(rhsi); break;
-      case OffsetOperator::SGT: out = lhsi.sgt(rhsi); break;
-      case OffsetOperator::SGE: out = lhsi.sge(rhsi); break;
-      case OffsetOperator::UGT: out = lhsi.ugt(rhsi); break;
-      case OffsetOperator::UGE: out = lhsi.uge(rhsi); break;
-      case OffsetOperator::end: assert(false); break;
-    }
-    return make_shared<ConstOffsetVal>(out);
+    // Constant operands are folded as the node is built
+    return BinOpOffsetVal::get(lhs, op, rhs);
   }
 
   OffsetValPtr simplifyOffsetVal(OffsetValPtr ov) {
+    return memoized(OffsetValArena::MemoSimplify, ov, computeSimplifiedOffsetVal);
+  }
+
+  OffsetValPtr computeSimplifiedOffsetVal(OffsetValPtr ov) {
     auto bo=dyn_cast<BinOpOffsetVal>(&*ov);
-    if(bo == nullptr)
-      return ov;
+    assert(bo != nullptr);
 
     OffsetValPtr lhs = simplifyOffsetVal(bo->lhs);
     OffsetValPtr rhs = simplifyOffsetVal(bo->rhs);
@@ -196,7 +210,7 @@ namespace gpucheck {
           return lhs;
         // anything%1 is always 0
         if (rhs->isConst() && rhs->constVal() == 1)
-          return make_shared<ConstOffsetVal>(0);
+          return ConstOffsetVal::get(0);
       }
     }
 
@@ -205,7 +219,7 @@ namespace gpucheck {
     }
 
     // Just return the simplified components
-    return make_shared<BinOpOffsetVal>(lhs, bo->op, rhs);
+    return BinOpOffsetVal::get(lhs, bo->op, rhs);
   }
 
   OffsetValPtr simplifyConstantSubExpressions(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs)
@@ -221,12 +235,12 @@ namespace gpucheck {
         switch (lhsBinop->op) {
         case OffsetOperator::Add: {
           APInt newConst = boAdd ? lrhs->constVal() + rhs->constVal() : lrhs->constVal() - rhs->constVal();
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(llhs, lhsBinop->op, make_shared<ConstOffsetVal>(newConst));
+          OffsetValPtr result = BinOpOffsetVal::get(llhs, lhsBinop->op, ConstOffsetVal::get(newConst));
           return simplifyOffsetVal(result);
         } break;
         case OffsetOperator::Sub: {
           APInt newConst = boAdd ? lrhs->constVal() - rhs->constVal() : lrhs->constVal() + rhs->constVal();
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(llhs, lhsBinop->op, make_shared<ConstOffsetVal>(newConst));
+          OffsetValPtr result = BinOpOffsetVal::get(llhs, lhsBinop->op, ConstOffsetVal::get(newConst));
           return simplifyOffsetVal(result);
           break;
         }
@@ -237,7 +251,7 @@ namespace gpucheck {
         case OffsetOperator::Sub:
         case OffsetOperator::Add: {
           APInt newConst = boAdd ? llhs->constVal() + rhs->constVal() : llhs->constVal() - rhs->constVal();
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(make_shared<ConstOffsetVal>(newConst), lhsBinop->op, lrhs);
+          OffsetValPtr result = BinOpOffsetVal::get(ConstOffsetVal::get(newConst), lhsBinop->op, lrhs);
           return simplifyOffsetVal(result);
         } break;
         }
@@ -252,13 +266,13 @@ namespace gpucheck {
         case OffsetOperator::Add: {
           APInt newConst = boAdd ? lhs->constVal() + rlhs->constVal() : lhs->constVal() - rlhs->constVal();
           OffsetOperator newOp = boAdd ? rhsBinop->op : OffsetOperator::Sub;
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(make_shared<ConstOffsetVal>(newConst), newOp, rrhs);
+          OffsetValPtr result = BinOpOffsetVal::get(ConstOffsetVal::get(newConst), newOp, rrhs);
           return simplifyOffsetVal(result);
         } break;
         case OffsetOperator::Sub: {
           APInt newConst = boAdd ? lhs->constVal() + rlhs->constVal() : lhs->constVal() - rlhs->constVal();
           OffsetOperator newOp = boAdd ? rhsBinop->op : OffsetOperator::Add;
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(make_shared<ConstOffsetVal>(newConst), newOp, rrhs);
+          OffsetValPtr result = BinOpOffsetVal::get(ConstOffsetVal::get(newConst), newOp, rrhs);
           return simplifyOffsetVal(result);
         } break;
         }
@@ -268,13 +282,13 @@ namespace gpucheck {
         case OffsetOperator::Add: {
           APInt newConst = boAdd ? lhs->constVal() + rrhs->constVal() : lhs->constVal() - rrhs->constVal();
           OffsetOperator newOp = boAdd ? rhsBinop->op : OffsetOperator::Sub;
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(make_shared<ConstOffsetVal>(newConst), newOp, rlhs);
+          OffsetValPtr result = BinOpOffsetVal::get(ConstOffsetVal::get(newConst), newOp, rlhs);
           return simplifyOffsetVal(result);
         } break;
         case OffsetOperator::Sub: {
           APInt newConst = boAdd ? lhs->constVal() - rrhs->constVal() : lhs->constVal() + rrhs->constVal();
           OffsetOperator newOp = boAdd ? rhsBinop->op : OffsetOperator::Sub;
-          OffsetValPtr result = make_shared<BinOpOffsetVal>(make_shared<ConstOffsetVal>(newConst), newOp, rlhs);
+          OffsetValPtr result = BinOpOffsetVal::get(ConstOffsetVal::get(newConst), newOp, rlhs);
           return simplifyOffsetVal(result);
         } break;
         }
@@ -286,6 +300,11 @@ namespace gpucheck {
   bool matchingOffsets(OffsetValPtr lhs, OffsetValPtr rhs) {
     assert(lhs != nullptr);
     assert(rhs != nullptr);
+    // OffsetVals are uniqued, so identical trees share a node
+    if(lhs == rhs)
+      return true;
+
+    // Constants of different bitwidths may still hold matching values
     if(lhs->isConst() && rhs->isConst()) {
       APInt lhs_c = lhs->constVal();
       APInt rhs_c = rhs->constVal();
@@ -293,24 +312,6 @@ namespace gpucheck {
       return lhs_c.sextOrSelf(bitwidth) == rhs_c.sextOrSelf(bitwidth);
     }
 
-    auto i_lhs = dyn_cast<InstOffsetVal>(&*lhs);
-    auto i_rhs = dyn_cast<InstOffsetVal>(&*rhs);
-    if(i_lhs && i_rhs) {
-      return (i_lhs->inst == i_rhs->inst);
-    }
-
-    auto a_lhs = dyn_cast<ArgOffsetVal>(&*lhs);
-    auto a_rhs = dyn_cast<ArgOffsetVal>(&*rhs);
-    if(a_lhs && a_rhs) {
-      return (a_lhs->arg == a_rhs->arg);
-    }
-
-    auto u_lhs = dyn_cast<UnknownOffsetVal>(&*lhs);
-    auto u_rhs = dyn_cast<UnknownOffsetVal>(&*rhs);
-    if(u_lhs && u_rhs) {
-      return (u_lhs->cause == u_rhs->cause);
-    }
-
     auto bo_lhs = dyn_cast<BinOpOffsetVal>(&*lhs);
     auto bo_rhs = dyn_cast<BinOpOffsetVal>(&*rhs);
     if(bo_lhs && bo_rhs) {
@@ -319,133 +320,166 @@ namespace gpucheck {
         && matchingOffsets(bo_lhs->rhs, bo_rhs->rhs);
     }
 
+    // Distinct leaves never match
     return false;
   }
 
-  bool equalOffsets(OffsetValPtr lhs, OffsetValPtr rhs, ThreadDependence& td) {
-    assert(lhs != nullptr);
-    assert(rhs != nullptr);
-    if(lhs->isConst() && rhs->isConst()) {
-      APInt lhs_c = lhs->constVal();
-      APInt rhs_c = rhs->constVal();
-      uint64_t bitwidth = max(lhs_c.getBitWidth(), rhs_c.getBitWidth());
-      return lhs_c.sextOrSelf(bitwidth) == rhs_c.sextOrSelf(bitwidth);
-    }
+  bool isThreadInvariant(const OffsetValPtr& ov, ThreadDependence& td) {
+    if(ov->isConst())
+      return true;
+    if(auto i = dyn_cast<InstOffsetVal>(&*ov))
+      return !td.isDependent(const_cast<Instruction *>(i->inst));
+    if(auto a = dyn_cast<ArgOffsetVal>(&*ov))
+      return !td.isDependent(const_cast<Argument *>(a->arg));
+    if(auto u = dyn_cast<UnknownOffsetVal>(&*ov))
+      return !td.isDependent(const_cast<Value *>(u->cause));
+    auto bo = cast<BinOpOffsetVal>(&*ov);
+    return isThreadInvariant(bo->lhs, td) && isThreadInvariant(bo->rhs, td);
+  }
 
-    auto i_lhs = dyn_cast<InstOffsetVal>(&*lhs);
-    auto i_rhs = dyn_cast<InstOffsetVal>(&*rhs);
-    if(i_lhs && i_rhs) {
-      if(i_lhs->inst == i_rhs->inst)
-        return !td.isDependent(const_cast<Instruction *>(i_lhs->inst));
-    }
+  OffsetPoly toPolynomial(const OffsetValPtr& ov, ThreadDependence& td) {
+    assert(ov != nullptr);
+    if(ov->isConst())
+      return OffsetPoly::constant(ov->constVal());
 
-    auto a_lhs = dyn_cast<ArgOffsetVal>(&*lhs);
-    auto a_rhs = dyn_cast<ArgOffsetVal>(&*rhs);
-    if(a_lhs && a_rhs) {
-      if(a_lhs->arg == a_rhs->arg)
-        return !td.isDependent(const_cast<Argument *>(a_lhs->arg));
-    }
+    // Shared subexpressions are expanded once per use, so charge each visit
+    if(!QueryBudget::charge())
+      return OffsetPoly::atom(ov, true);
 
-    auto u_lhs = dyn_cast<UnknownOffsetVal>(&*lhs);
-    auto u_rhs = dyn_cast<UnknownOffsetVal>(&*rhs);
-    if(u_lhs && u_rhs) {
-      if(u_lhs->cause == u_rhs->cause)
-        return !td.isDependent(const_cast<Value *>(u_lhs->cause));
+    if(auto bo = dyn_cast<BinOpOffsetVal>(&*ov)) {
+      switch(bo->op) {
+        case OffsetOperator::Add:
+        case OffsetOperator::Sub: {
+          OffsetPoly lhs = toPolynomial(bo->lhs, td);
+          OffsetPoly rhs = toPolynomial(bo->rhs, td);
+          // Merging copies both sides, so a long chain of sums costs its square
+          if(!QueryBudget::charge((uint64_t)lhs.numTerms() + rhs.numTerms()))
+            return OffsetPoly::atom(ov, true);
+          return bo->op == OffsetOperator::Add ? lhs + rhs : lhs - rhs;
+        }
+        case OffsetOperator::Mul: {
+          OffsetPoly lhs = toPolynomial(bo->lhs, td);
+          OffsetPoly rhs = toPolynomial(bo->rhs, td);
+          // Expanding builds a term for every pair, so charge for each
+          if(!QueryBudget::charge((uint64_t)lhs.numTerms() * rhs.numTerms()))
+            return OffsetPoly::atom(ov, true);
+          return lhs * rhs;
+        }
+        default:
+          break;
+      }
     }
 
-    auto bo_lhs = dyn_cast<BinOpOffsetVal>(&*lhs);
-    auto bo_rhs = dyn_cast<BinOpOffsetVal>(&*rhs);
-    if(bo_lhs && bo_rhs) {
-      return bo_lhs->op == bo_rhs->op
-        && equalOffsets(bo_lhs->lhs, bo_rhs->lhs, td)
-        && equalOffsets(bo_lhs->rhs, bo_rhs->rhs, td);
-    }
+    // Anything else is an indivisible factor
+    return OffsetPoly::atom(ov, !isThreadInvariant(ov, td));
+  }
 
-    return false;
+  OffsetValPtr fromPolynomial(const OffsetPoly& poly) {
+    return poly.toOffsetVal();
   }
 
-  void addToVector(const OffsetValPtr& ov, vector<OffsetValPtr>& add, vector<OffsetValPtr>&sub, bool isSub = false) {
-    assert(ov != nullptr);
-    auto bo = dyn_cast<BinOpOffsetVal>(&*ov);
-    if(bo != nullptr) {
-      if(bo->op == Add) {
-        addToVector(bo->lhs, add, sub, isSub);
-        addToVector(bo->rhs, add, sub, isSub);
-        return;
-      }
-      if(bo->op == Sub) {
-        addToVector(bo->lhs, add, sub, isSub);
-        addToVector(bo->rhs, add, sub, !isSub);
-        return;
-      }
-    }
-    if(isSub) {
-      sub.push_back(ov);
-    } else {
-      add.push_back(ov);
+  OffsetValPtr threadDependentPart(const OffsetValPtr& ov, ThreadDependence& td) {
+    return fromPolynomial(toPolynomial(ov, td).threadDependent());
+  }
+
+  AffineOffset::Index getIndexKind(const OffsetValPtr& ov) {
+    auto i_off = dyn_cast<InstOffsetVal>(&*ov);
+    if(!i_off)
+      return AffineOffset::NumIndices;
+    auto ci = dyn_cast<CallInst>(i_off->inst);
+    if(!ci || ci->getCalledFunction() == nullptr)
+      return AffineOffset::NumIndices;
+
+    switch(ci->getCalledFunction()->getIntrinsicID()) {
+      case Intrinsic::nvvm_read_ptx_sreg_tid_x: return AffineOffset::ThreadX;
+      case Intrinsic::nvvm_read_ptx_sreg_tid_y: return AffineOffset::ThreadY;
+      case Intrinsic::nvvm_read_ptx_sreg_tid_z: return AffineOffset::ThreadZ;
+      case Intrinsic::nvvm_read_ptx_sreg_laneid: return AffineOffset::LaneId;
+      case Intrinsic::nvvm_read_ptx_sreg_ctaid_x: return AffineOffset::BlockX;
+      case Intrinsic::nvvm_read_ptx_sreg_ctaid_y: return AffineOffset::BlockY;
+      case Intrinsic::nvvm_read_ptx_sreg_ctaid_z: return AffineOffset::BlockZ;
+      default: return AffineOffset::NumIndices;
     }
   }
 
-  OffsetValPtr cancelDiffs(OffsetValPtr ov, ThreadDependence& td) {
-    assert(ov != nullptr);
-    OffsetValPtr sop = sumOfProducts(ov);
-    // Convert from binary tree to n-ary addition and subtraction
-    vector<OffsetValPtr> added;
-    vector<OffsetValPtr> subtracted;
-    added.clear();
-    subtracted.clear();
-    addToVector(ov, added, subtracted);
-
-    // Cancel any matching trees in the sums
-    bool changed = true;
-    while(changed) {
-      changed = false;
-      for(auto o_a=added.begin(),e_a=added.end(); o_a!=e_a; ++o_a) {
-        for(auto o_s=subtracted.begin(),e_s=subtracted.end(); o_s!=e_s; ++o_s) {
-          assert(*o_s != nullptr);
-          if(equalOffsets(*o_a, *o_s, td)) {
-            added.erase(o_a);
-            subtracted.erase(o_s);
-            changed = true;
-            break;
-          }
-          if (OffsetValPtr simp = simplifyDifferenceOfProducts(*o_a, *o_s, td)) {
-            added.erase(o_a);
-            subtracted.erase(o_s);
-            changed = true;
-            addToVector(simp, added,subtracted);
-            break;
-          }
-        }
-        if(changed)
-          break;
+  // Returns false if this term breaks affinity
+  static bool addAffineTerm(const OffsetPoly::Monomial& m, const APInt& coeff, bool opaque, AffineOffset& out) {
+    if(m.empty()) {
+      out.base += coeff.getSExtValue();
+      return true;
+    }
+
+    if(m.size() == 1) {
+      AffineOffset::Index idx = getIndexKind(m.front());
+      if(idx != AffineOffset::NumIndices) {
+        out.stride[idx] += coeff.getSExtValue();
+        return true;
       }
     }
 
-    // Rebuild the binary tree
-    OffsetValPtr ret = (added.size() == 0) ? make_shared<ConstOffsetVal>(0) : added.back();
-    if(added.size() > 0)
-      added.pop_back();
+    // Only thread-invariant terms without any index may remain
+    if(opaque)
+      return false;
+    for(auto a=m.begin(),e=m.end(); a!=e; ++a)
+      if(getIndexKind(*a) != AffineOffset::NumIndices)
+        return false;
+    out.hasConstBase = false;
+    return true;
+  }
 
-    while(added.size() > 0) {
-      ret = make_shared<BinOpOffsetVal>(ret, Add, added.back());
-      added.pop_back();
-    }
+  bool getAffineOffset(const OffsetValPtr& ov, ThreadDependence& td, AffineOffset& out) {
+    out.base = 0;
+    out.hasConstBase = true;
+    for(unsigned i=0; i<AffineOffset::NumIndices; i++)
+      out.stride[i] = 0;
+
+    OffsetPoly poly = toPolynomial(ov, td);
+    const OffsetPoly::TermMap& terms = poly.invariantTerms();
+    for(auto t=terms.begin(),e=terms.end(); t!=e; ++t)
+      if(!addAffineTerm(t->first, t->second, false, out))
+        return false;
+
+    const OffsetPoly::TermMap& added = poly.addedTerms();
+    for(auto t=added.begin(),e=added.end(); t!=e; ++t)
+      if(!addAffineTerm(t->first, t->second, true, out))
+        return false;
+
+    const OffsetPoly::TermMap& subtracted = poly.subtractedTerms();
+    for(auto t=subtracted.begin(),e=subtracted.end(); t!=e; ++t)
+      if(!addAffineTerm(t->first, APInt(OffsetPoly::CoeffBits, 0) - t->second, true, out))
+        return false;
+    return true;
+  }
 
-    while(subtracted.size() > 0) {
-      ret = make_shared<BinOpOffsetVal>(ret, Sub, subtracted.back());
-      subtracted.pop_back();
-    }
-    return simplifyOffsetVal(ret);
+  int64_t AffineOffset::at(int thread_idx, int thread_idy, int thread_idz,
+      int block_idx, int block_idy, int block_idz) const {
+    int64_t index[NumIndices] = { thread_idx, thread_idy, thread_idz, thread_idx % 32,
+      block_idx, block_idy, block_idz };
+    // Wrap on overflow as the IR would, rather than invoking undefined behaviour
+    uint64_t ret = base;
+    for(unsigned i=0; i<NumIndices; i++)
+      ret += (uint64_t)stride[i] * (uint64_t)index[i];
+    return (int64_t)ret;
+  }
+
+  OffsetValPtr cancelDiffs(OffsetValPtr ov, ThreadDependence& td) {
+    assert(ov != nullptr);
+    // A single ThreadDependence result is live per arena, so ov alone is the key
+    return memoized(OffsetValArena::MemoCancelDiffs, ov, [&td](OffsetValPtr ov) {
+      return computeCancelledDiffs(ov, td);
+    });
+  }
+
+  OffsetValPtr computeCancelledDiffs(OffsetValPtr ov, ThreadDependence& td) {
+    // Matching terms cancel as the polynomial's sums are merged
+    return simplifyOffsetVal(fromPolynomial(toPolynomial(ov, td)));
   }
 
   OffsetValPtr replaceComponents(const OffsetValPtr& orig, std::unordered_map<OffsetValPtr, OffsetValPtr>& rep) {
-    // Our loose definition of equality is a problem here
-    for(auto r=rep.begin(),e=rep.end(); r!=e; ++r) {
-      // Perform a tree-match
-      if(matchingOffsets(orig, r->first))
-        return r->second;
-    }
+    // Uniqued OffsetVals allow an exact lookup instead of a tree-match
+    auto r = rep.find(orig);
+    if(r != rep.end())
+      return r->second;
 
     auto bo = dyn_cast<BinOpOffsetVal>(&*orig);
     if(!bo)
@@ -458,45 +492,8 @@ namespace gpucheck {
     if(lhs == bo->lhs && rhs == bo->rhs)
       return orig; // No changes were made
     else
-      return make_shared<BinOpOffsetVal>(lhs, bo->op, rhs);
-  }
-
-  // Returns NULL if unable to change anything
-  OffsetValPtr simplifyDifferenceOfProducts(OffsetValPtr addt, OffsetValPtr subt, ThreadDependence& td) {
-    auto bo_a = dyn_cast<BinOpOffsetVal>(&*addt);
-    auto bo_s = dyn_cast<BinOpOffsetVal>(&*subt);
-    if (bo_a && bo_s && bo_a->op == OffsetOperator::Mul && bo_s->op == OffsetOperator::Mul) {
-      OffsetValPtr a_lhs = bo_a->lhs, s_lhs = bo_s->lhs;
-      OffsetValPtr a_rhs = bo_a->rhs, s_rhs = bo_s->rhs;
-      if (equalOffsets(a_rhs, s_rhs, td)) {
-        // ax-bx
-        OffsetValPtr origDiff = make_shared<BinOpOffsetVal>(addt, OffsetOperator::Sub, subt);
-        // (a-b)
-        OffsetValPtr lhsDiff = make_shared<BinOpOffsetVal>(a_lhs, OffsetOperator::Sub, s_lhs);
-        // cancellDiff on (a-b)
-        OffsetValPtr new_lhs = cancelDiffs(lhsDiff, td);
-        OffsetValPtr new_binop = make_shared<BinOpOffsetVal>(new_lhs, OffsetOperator::Mul, s_rhs);
-        OffsetValPtr newsop = sumOfProducts(new_binop);
-        OffsetValPtr oldsop = sumOfProducts(origDiff);
-        // Did not achieve anything, important for termination.
-        if (matchingOffsets(simplifyOffsetVal(newsop), simplifyOffsetVal(oldsop)))
-          return nullptr;
-        else
-          return newsop;
-      }
-      else if (equalOffsets(a_lhs, s_lhs, td)) {
-        OffsetValPtr origDiff = make_shared<BinOpOffsetVal>(addt, OffsetOperator::Sub, subt);
-        OffsetValPtr rhsDiff = make_shared<BinOpOffsetVal>(a_rhs, OffsetOperator::Sub, s_rhs);
-        OffsetValPtr new_rhs = cancelDiffs(rhsDiff, td);
-        OffsetValPtr new_binop = make_shared<BinOpOffsetVal>(s_lhs, OffsetOperator::Mul, new_rhs);
-        OffsetValPtr newsop = sumOfProducts(new_binop);
-        OffsetValPtr oldsop = sumOfProducts(origDiff);
-        if (matchingOffsets(simplifyOffsetVal(newsop), simplifyOffsetVal(oldsop)))
-          return nullptr;
-        else
-          return newsop;
-      }
-    }
-    return nullptr;
+      return BinOpOffsetVal::get(lhs, bo->op, rhs);
   }
 }
+
+#undef DEBUG_TYPE
@@ -1,4 +1,5 @@
 #include "OffsetVal.h"
+#include "OffsetPoly.h"
 #include "ThreadDepAnalysis.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
@@ -9,12 +10,67 @@
 #define OFFSET_OP_H
 
 namespace gpucheck {
+  // Memoized in the current OffsetValArena
   OffsetValPtr sumOfProducts(OffsetValPtr ov);
   OffsetValPtr sumOfProductsPass(OffsetValPtr ov);
-  OffsetValPtr negateCondition(OffsetValPtr& cond);
   OffsetValPtr simplifyOffsetVal(OffsetValPtr ov);
   OffsetValPtr cancelDiffs(OffsetValPtr ov, ThreadDependence& td);
-  OffsetValPtr simplifyDifferenceOfProducts(OffsetValPtr addt, OffsetValPtr subt, ThreadDependence& td);
+
+  // Uncached implementations of the above
+  OffsetValPtr computeSumOfProductsPass(OffsetValPtr ov);
+  OffsetValPtr computeSimplifiedOffsetVal(OffsetValPtr ov);
+  OffsetValPtr computeCancelledDiffs(OffsetValPtr ov, ThreadDependence& td);
+
+  OffsetValPtr negateCondition(OffsetValPtr& cond);
+
+  // Conversion to and from the canonical polynomial form
+  OffsetPoly toPolynomial(const OffsetValPtr& ov, ThreadDependence& td);
+  OffsetValPtr fromPolynomial(const OffsetPoly& poly);
+  /**
+   * Drop the terms of ov which are equal in every thread
+   */
+  OffsetValPtr threadDependentPart(const OffsetValPtr& ov, ThreadDependence& td);
+  bool isThreadInvariant(const OffsetValPtr& ov, ThreadDependence& td);
+
+  /**
+   * An offset of the form base + sum(stride * index) over the thread, lane
+   * and block indices. Thread-invariant terms which are not constant are
+   * left out of base, in which case hasConstBase is false.
+   */
+  struct AffineOffset {
+    enum Index {
+      ThreadX,
+      ThreadY,
+      ThreadZ,
+      LaneId,
+      BlockX,
+      BlockY,
+      BlockZ,
+      NumIndices
+    };
+    int64_t base;
+    bool hasConstBase;
+    int64_t stride[NumIndices];
+
+    /**
+     * Evaluate for one thread, with the indices of inThreadContext
+     */
+    int64_t at(int thread_idx, int thread_idy, int thread_idz,
+        int block_idx, int block_idy, int block_idz) const;
+  };
+
+  /**
+   * Which thread or block index ov reads, or NumIndices if it is not one
+   */
+  AffineOffset::Index getIndexKind(const OffsetValPtr& ov);
+
+  /**
+   * Returns true and fills out if ov is affine in the thread and block
+   * indices, with constant strides. Thread-dependent terms other than the
+   * indices themselves make an offset non-affine.
+   */
+  bool getAffineOffset(const OffsetValPtr& ov, ThreadDependence& td, AffineOffset& out);
+
   OffsetValPtr simplifyConstantSubExpressions(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs);
 
   OffsetValPtr replaceComponents(const OffsetValPtr& orig, std::unordered_map<OffsetValPtr, OffsetValPtr>& rep);
@@ -0,0 +1,192 @@
+#include "OffsetPoly.h"
+#include <algorithm>
+
+using namespace llvm;
+
+namespace gpucheck {
+
+  APInt toCoefficient(const APInt& c) {
+    if(c.getBitWidth() == 1)
+      return c.zextOrTrunc(OffsetPoly::CoeffBits);
+    return c.sextOrTrunc(OffsetPoly::CoeffBits);
+  }
+
+  OffsetPoly OffsetPoly::constant(const APInt& c) {
+    OffsetPoly p;
+    APInt coeff = toCoefficient(c);
+    if(coeff != 0)
+      p.terms.emplace(Monomial(), coeff);
+    return p;
+  }
+
+  OffsetPoly OffsetPoly::atom(OffsetValPtr ov, bool opaque) {
+    OffsetPoly p;
+    Monomial m;
+    m.push_back(ov);
+    if(opaque)
+      p.added.emplace(m, APInt(CoeffBits, 1));
+    else
+      p.terms.emplace(m, APInt(CoeffBits, 1));
+    return p;
+  }
+
+  void OffsetPoly::merge(TermMap& into, const TermMap& from, bool negate) {
+    // Both maps are sorted, so the result is built front to back
+    TermMap result;
+    auto l = into.begin(), le = into.end();
+    auto r = from.begin(), re = from.end();
+    while(l != le || r != re) {
+      if(r == re || (l != le && l->first < r->first)) {
+        result.emplace_hint(result.end(), l->first, l->second);
+        ++l;
+      } else if(l == le || r->first < l->first) {
+        APInt coeff = negate ? APInt(CoeffBits, 0) - r->second : r->second;
+        result.emplace_hint(result.end(), r->first, coeff);
+        ++r;
+      } else {
+        APInt coeff = negate ? l->second - r->second : l->second + r->second;
+        if(coeff != 0)
+          result.emplace_hint(result.end(), l->first, coeff);
+        ++l;
+        ++r;
+      }
+    }
+    into.swap(result);
+  }
+
+  void OffsetPoly::multiply(TermMap& into, const TermMap& lhs, const TermMap& rhs) {
+    for(auto l=lhs.begin(),le=lhs.end(); l!=le; ++l) {
+      for(auto r=rhs.begin(),re=rhs.end(); r!=re; ++r) {
+        Monomial m(l->first.begin(), l->first.end());
+        m.append(r->first.begin(), r->first.end());
+        std::sort(m.begin(), m.end());
+
+        APInt coeff = l->second * r->second;
+        auto existing = into.find(m);
+        if(existing == into.end()) {
+          if(coeff != 0)
+            into.emplace(m, coeff);
+        } else {
+          existing->second += coeff;
+          if(existing->second == 0)
+            into.erase(existing);
+        }
+      }
+    }
+  }
+
+  void OffsetPoly::balance() {
+    // Take the negative terms out of both sides before moving any, so that
+    // nothing moved is seen again
+    TermMap toAdded, toSubtracted;
+    for(auto t=added.begin(); t!=added.end();) {
+      if(t->second.isNegative()) {
+        toSubtracted.emplace(t->first, APInt(CoeffBits, 0) - t->second);
+        t = added.erase(t);
+      } else {
+        ++t;
+      }
+    }
+    for(auto t=subtracted.begin(); t!=subtracted.end();) {
+      if(t->second.isNegative()) {
+        toAdded.emplace(t->first, APInt(CoeffBits, 0) - t->second);
+        t = subtracted.erase(t);
+      } else {
+        ++t;
+      }
+    }
+    // Both sides now only hold positive coefficients, so these add to them
+    merge(added, toAdded, false);
+    merge(subtracted, toSubtracted, false);
+  }
+
+  OffsetPoly OffsetPoly::operator+(const OffsetPoly& rhs) const {
+    OffsetPoly p = *this;
+    merge(p.terms, rhs.terms, false);
+    merge(p.added, rhs.added, false);
+    merge(p.subtracted, rhs.subtracted, false);
+    p.balance();
+    return p;
+  }
+
+  OffsetPoly OffsetPoly::operator-(const OffsetPoly& rhs) const {
+    OffsetPoly p = *this;
+    merge(p.terms, rhs.terms, true);
+    // Opaque terms change sides rather than cancelling
+    merge(p.added, rhs.subtracted, false);
+    merge(p.subtracted, rhs.added, false);
+    p.balance();
+    return p;
+  }
+
+  OffsetPoly OffsetPoly::operator*(const OffsetPoly& rhs) const {
+    OffsetPoly p;
+    multiply(p.terms, terms, rhs.terms);
+
+    // Any product with an opaque factor is opaque, on the side given by the signs
+    multiply(p.added, terms, rhs.added);
+    multiply(p.added, added, rhs.terms);
+    multiply(p.added, added, rhs.added);
+    multiply(p.added, subtracted, rhs.subtracted);
+
+    multiply(p.subtracted, terms, rhs.subtracted);
+    multiply(p.subtracted, subtracted, rhs.terms);
+    multiply(p.subtracted, added, rhs.subtracted);
+    multiply(p.subtracted, subtracted, rhs.added);
+    p.balance();
+    return p;
+  }
+
+  bool OffsetPoly::isConst() const {
+    if(!added.empty() || !subtracted.empty())
+      return false;
+    return terms.empty() || (terms.size() == 1 && terms.begin()->first.empty());
+  }
+
+  APInt OffsetPoly::constVal() const {
+    assert(isConst());
+    if(terms.empty())
+      return APInt(CoeffBits, 0);
+    return terms.begin()->second;
+  }
+
+  OffsetPoly OffsetPoly::threadDependent() const {
+    OffsetPoly p;
+    p.added = added;
+    p.subtracted = subtracted;
+    return p;
+  }
+
+  static OffsetValPtr buildTerm(const OffsetPoly::Monomial& m, const APInt& coeff) {
+    if(m.empty())
+      return ConstOffsetVal::get(coeff);
+
+    OffsetValPtr term = m.front();
+    for(auto a=m.begin()+1,e=m.end(); a!=e; ++a)
+      term = BinOpOffsetVal::get(term, Mul, *a);
+    if(coeff != 1)
+      term = BinOpOffsetVal::get(term, Mul, ConstOffsetVal::get(coeff));
+    return term;
+  }
+
+  OffsetValPtr OffsetPoly::toOffsetVal() const {
+    std::vector<OffsetValPtr> pos, neg;
+    for(auto t=terms.begin(),e=terms.end(); t!=e; ++t) {
+      if(t->second.isNegative())
+        neg.push_back(buildTerm(t->first, APInt(CoeffBits, 0) - t->second));
+      else
+        pos.push_back(buildTerm(t->first, t->second));
+    }
+    for(auto t=added.begin(),e=added.end(); t!=e; ++t)
+      pos.push_back(buildTerm(t->first, t->second));
+    for(auto t=subtracted.begin(),e=subtracted.end(); t!=e; ++t)
+      neg.push_back(buildTerm(t->first, t->second));
+
+    OffsetValPtr ret = pos.empty() ? ConstOffsetVal::get(APInt(CoeffBits, 0)) : pos.front();
+    for(auto t=pos.begin()+(pos.empty() ? 0 : 1),e=pos.end(); t!=e; ++t)
+      ret = BinOpOffsetVal::get(ret, Add, *t);
+    for(auto t=neg.begin(),e=neg.end(); t!=e; ++t)
+      ret = BinOpOffsetVal::get(ret, Sub, *t);
+    return ret;
+  }
+}
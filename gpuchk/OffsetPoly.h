@@ -0,0 +1,81 @@
+#include "OffsetVal.h"
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/SmallVector.h"
+#include <map>
+#include <utility>
+
+#ifndef OFFSET_POLY_H
+#define OFFSET_POLY_H
+
+namespace gpucheck {
+
+  /**
+   * Canonical sparse polynomial over OffsetVals. Every term is a monomial, a
+   * sorted product of atoms (any OffsetVal which is not Add, Sub or Mul),
+   * with a 64-bit coefficient. Equal monomials always share a key, so
+   * addition and subtraction are a linear merge of the two term maps.
+   *
+   * Atoms which may differ between threads must not cancel against each
+   * other, since the same node can stand for a different value on either
+   * side of a thread-context difference. Monomials containing such an atom
+   * are kept "opaque": they only combine with terms from the same side of
+   * the difference. Their coefficients are kept positive, with the sign
+   * given by the side, so that a negated term cannot cancel a term from the
+   * other side either.
+   */
+  class OffsetPoly {
+    public:
+      typedef llvm::SmallVector<OffsetValPtr, 2> Monomial;
+      typedef std::map<Monomial, llvm::APInt> TermMap;
+      static const unsigned CoeffBits = 64;
+
+      OffsetPoly() {}
+      static OffsetPoly constant(const llvm::APInt& c);
+      static OffsetPoly atom(OffsetValPtr ov, bool opaque);
+
+      OffsetPoly operator+(const OffsetPoly& rhs) const;
+      OffsetPoly operator-(const OffsetPoly& rhs) const;
+      OffsetPoly operator*(const OffsetPoly& rhs) const;
+
+      /**
+       * Returns true if every term has cancelled, leaving only a constant
+       */
+      bool isConst() const;
+      llvm::APInt constVal() const;
+      unsigned numTerms() const { return terms.size() + added.size() + subtracted.size(); }
+
+      /**
+       * Rebuild an OffsetVal tree computing this polynomial
+       */
+      OffsetValPtr toOffsetVal() const;
+
+      /**
+       * The opaque terms alone, without any thread-invariant part
+       */
+      OffsetPoly threadDependent() const;
+
+      const TermMap& invariantTerms() const { return terms; }
+      const TermMap& addedTerms() const { return added; }
+      const TermMap& subtractedTerms() const { return subtracted; }
+
+    private:
+      // Thread-invariant terms, with signed coefficients
+      TermMap terms;
+      // Opaque terms, by the side of the difference they were found on
+      TermMap added;
+      TermMap subtracted;
+
+      // Move opaque terms with negative coefficients to the other side
+      void balance();
+      static void merge(TermMap& into, const TermMap& from, bool negate);
+      static void multiply(TermMap& into, const TermMap& lhs, const TermMap& rhs);
+  };
+
+  /**
+   * Widen a constant to the coefficient width. Single-bit values are
+   * conditions, so they are treated as unsigned.
+   */
+  llvm::APInt toCoefficient(const llvm::APInt& c);
+}
+
+#endif
@@ -1,13 +1,18 @@
 #include "OffsetPropagation.h"
 #include "OffsetOps.h"
+#include "Utilities.h"
+#include "CallGraphSCCs.h"
 #include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/LoopInfo.h"
-#include "llvm/Analysis/MemoryDependenceAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/User.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/SmallPtrSet.h"
 
 #define DEBUG_TYPE "acf"
 
@@ -22,28 +27,218 @@ STATISTIC(ACFGEPTranslations, "Number of GEP ACF Expressions Generated");
 STATISTIC(ACFArgTranslations, "Number of Arg ACF Expressions Generated");
 STATISTIC(ACFUnkInstTranslations, "Number of Unknown Instruction ACF Expressions Generated");
 STATISTIC(MaxIACFSize, "Maximum IACF Set Size");
+STATISTIC(ACFForwardedLoads, "Number of Loads Resolved Through MemorySSA");
 
 namespace gpucheck {
   using namespace std;
 
   void OffsetPropagation::getAnalysisUsage(AnalysisUsage& AU) const {
     AU.setPreservesAll();
-    AU.addRequired<MemoryDependenceWrapperPass>();
-    AU.addRequired<DominatorTreeWrapperPass>();
-    AU.addRequired<PostDominatorTreeWrapperPass>();
-    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<MemorySSAWrapperPass>();
   }
 
   bool OffsetPropagation::runOnModule(Module &M) {
+    return runOnModule(M, [this](Function &F) -> MemorySSA& {
+      return getAnalysis<MemorySSAWrapperPass>(F).getMSSA();
+    });
+  }
+
+  bool OffsetPropagation::runOnModule(Module &M, MemorySSAProvider memorySSA) {
     // Save my owned module
     this->M = &M;
+    this->memorySSA = memorySSA;
     // Empty any calculated results
     this->offsets.clear();
+    this->analyses.clear();
+    this->callers.clear();
+    this->callersIndexed = false;
+    this->contexts.clear();
+    this->contextsSolved = false;
+    // OffsetVals for this module are owned by a fresh arena
+    this->arena.reset(new OffsetValArena());
+    OffsetValArena::setCurrent(this->arena.get());
 
     // OffsetVals are evaluated lazily as required
     return false;
   }
 
+  void OffsetPropagation::releaseMemory() {
+    // Every OffsetVal is freed in bulk with the arena
+    this->offsets.clear();
+    this->analyses.clear();
+    this->callers.clear();
+    this->callersIndexed = false;
+    this->contexts.clear();
+    this->contextsSolved = false;
+    this->arena.reset();
+  }
+
+  OffsetPropagation::FunctionAnalyses& OffsetPropagation::getAnalyses(Function &F) {
+    std::shared_ptr<FunctionAnalyses>& fa = analyses[&F];
+    if(fa)
+      return *fa;
+    assert(memorySSA && "Shards only see functions prepared before they were created");
+
+    fa.reset(new FunctionAnalyses());
+    fa->DT.reset(new DominatorTree(F));
+    fa->PDT.reset(new PostDominatorTree());
+    fa->PDT->recalculate(F);
+    fa->LI.reset(new LoopInfo(*fa->DT));
+    // Dominance queries fill these in lazily otherwise, which shards can't
+    fa->DT->updateDFSNumbers();
+    fa->PDT->updateDFSNumbers();
+
+    // Legacy on-the-fly analyses are recomputed on every request, so ask once
+    MemorySSA& MSSA = memorySSA(F);
+    for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+      for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
+        if(auto l=dyn_cast<LoadInst>(&*i)) {
+          StoreInst *s;
+          if(findReachingStore(l, MSSA, s)) {
+            ++ACFForwardedLoads;
+            fa->loadDefs[l] = s;
+          }
+        }
+      }
+    }
+    return *fa;
+  }
+
+  void OffsetPropagation::prepareAnalyses() {
+    for(auto f=M->begin(),e=M->end(); f!=e; ++f) {
+      if(!f->isDeclaration())
+        getAnalyses(*f);
+    }
+    if(!contextsSolved)
+      solveContexts();
+  }
+
+  /**
+   * Rebuild ov in the current arena. Nodes are uniqued by handle within an
+   * arena, so values from another arena must be copied before they are
+   * combined with this one's.
+   */
+  static OffsetValPtr copyToCurrentArena(const OffsetValPtr& ov, DenseMap<OffsetValPtr, OffsetValPtr>& copied) {
+    auto found = copied.find(ov);
+    if(found != copied.end())
+      return found->second;
+
+    OffsetValPtr ret;
+    if(auto bo=dyn_cast<BinOpOffsetVal>(&*ov)) {
+      OffsetValPtr lhs = copyToCurrentArena(bo->lhs, copied);
+      OffsetValPtr rhs = copyToCurrentArena(bo->rhs, copied);
+      ret = BinOpOffsetVal::get(lhs, bo->op, rhs);
+    } else if(auto c=dyn_cast<ConstOffsetVal>(&*ov)) {
+      ret = ConstOffsetVal::get(c->constVal());
+    } else if(auto i=dyn_cast<InstOffsetVal>(&*ov)) {
+      ret = InstOffsetVal::get(const_cast<Instruction *>(i->inst));
+    } else if(auto a=dyn_cast<ArgOffsetVal>(&*ov)) {
+      ret = ArgOffsetVal::get(const_cast<Argument *>(a->arg));
+    } else {
+      ret = UnknownOffsetVal::get(const_cast<Value *>(cast<UnknownOffsetVal>(&*ov)->cause));
+    }
+    copied[ov] = ret;
+    return ret;
+  }
+
+  std::unique_ptr<OffsetPropagation> OffsetPropagation::createShard() {
+    std::unique_ptr<OffsetPropagation> shard(new OffsetPropagation());
+    shard->M = M;
+    shard->arena.reset(new OffsetValArena());
+    shard->analyses = analyses;
+    shard->callers = callers;
+    shard->callersIndexed = callersIndexed;
+
+    // The solved contexts are copied into the shard's arena, so it doesn't
+    // solve them again
+    if(contextsSolved) {
+      OffsetValArena& own = OffsetValArena::current();
+      shard->makeCurrent();
+      DenseMap<OffsetValPtr, OffsetValPtr> copied;
+      for(auto f=contexts.begin(),e=contexts.end(); f!=e; ++f) {
+        vector<Binding>& bindings = shard->contexts[f->first];
+        for(auto b=f->second.begin(),be=f->second.end(); b!=be; ++b) {
+          Binding binding;
+          for(auto v=b->begin(),ve=b->end(); v!=ve; ++v)
+            binding.push_back(copyToCurrentArena(*v, copied));
+          bindings.push_back(binding);
+        }
+      }
+      shard->contextsSolved = true;
+      OffsetValArena::setCurrent(&own);
+    }
+    return shard;
+  }
+
+  static bool storesTo(MemoryAccess *MA, LoadInst *l) {
+    auto def = dyn_cast<MemoryDef>(MA);
+    if(!def)
+      return false;
+    auto s = dyn_cast_or_null<StoreInst>(def->getMemoryInst());
+    return s && s->getPointerOperand()->stripPointerCasts() == l->getPointerOperand()->stripPointerCasts()
+      && s->getValueOperand()->getType() == l->getType();
+  }
+
+  // Whether a store can't write what l reads, because the two are based on
+  // different identified objects, such as noalias arguments, allocas and
+  // globals
+  static bool provablyDisjoint(MemoryAccess *MA, LoadInst *l, const DataLayout& DL) {
+    auto def = dyn_cast<MemoryDef>(MA);
+    if(!def)
+      return false;
+    auto s = dyn_cast_or_null<StoreInst>(def->getMemoryInst());
+    if(!s)
+      return false;
+    const Value *sBase = GetUnderlyingObject(s->getPointerOperand(), DL);
+    const Value *lBase = GetUnderlyingObject(l->getPointerOperand(), DL);
+    return sBase != lBase && isIdentifiedObject(sBase) && isIdentifiedObject(lBase);
+  }
+
+  /**
+   * Walk MemorySSA up from l to the store it reads from. Returns false if
+   * that can't be decided, such as when paths reach different stores or
+   * something other than a store to the same address clobbers it.
+   */
+  bool OffsetPropagation::findReachingStore(LoadInst *l, MemorySSA &MSSA, StoreInst *&store) {
+    const DataLayout& DL = M->getDataLayout();
+    MemorySSAWalker *walker = MSSA.getWalker();
+    MemoryLocation loc = MemoryLocation::get(l);
+
+    store = nullptr;
+    bool reachesEntry = false;
+    SmallVector<MemoryAccess*, 8> work;
+    SmallPtrSet<MemoryAccess*, 8> visited;
+    work.push_back(walker->getClobberingMemoryAccess(l));
+    while(!work.empty()) {
+      MemoryAccess *MA = work.pop_back_val();
+      // Step over stores into other objects the walker's aliasing missed
+      for(unsigned steps=0; steps<8 && provablyDisjoint(MA, l, DL); steps++)
+        MA = walker->getClobberingMemoryAccess(cast<MemoryDef>(MA)->getDefiningAccess(), loc);
+      if(!visited.insert(MA).second)
+        continue;
+
+      if(MSSA.isLiveOnEntryDef(MA)) {
+        reachesEntry = true; // Nothing stored on this path
+        continue;
+      }
+      if(auto phi=dyn_cast<MemoryPhi>(MA)) {
+        for(unsigned i=0, e=phi->getNumIncomingValues(); i!=e; i++)
+          work.push_back(walker->getClobberingMemoryAccess(phi->getIncomingValue(i), loc));
+        continue;
+      }
+      if(!storesTo(MA, l))
+        return false;
+
+      // Every path must store the same value
+      StoreInst *s = cast<StoreInst>(cast<MemoryDef>(MA)->getMemoryInst());
+      if(store && store->getValueOperand() != s->getValueOperand())
+        return false;
+      store = s;
+    }
+    // Stored on only some paths
+    return !(reachesEntry && store);
+  }
+
   /**
    * Generic method for any value, used to dispatch to the others
    */
@@ -68,15 +263,15 @@ namespace gpucheck {
     // Fallthrough, unknown instruction
     if(auto i=dyn_cast<Instruction>(v)) {
       ++ACFUnkInstTranslations;
-      offsets[v] = make_shared<InstOffsetVal>(i);
+      offsets[v] = InstOffsetVal::get(i);
       return offsets[v];
     } else if(auto a=dyn_cast<Argument>(v)) {
       ++ACFArgTranslations;
-      offsets[v] = make_shared<ArgOffsetVal>(a);
+      offsets[v] = ArgOffsetVal::get(a);
       return offsets[v];
     } else {
       ++ACFUnkInstTranslations;
-      offsets[v] = make_shared<UnknownOffsetVal>(v);
+      offsets[v] = UnknownOffsetVal::get(v);
       return offsets[v];
     }
   }
@@ -88,13 +283,13 @@ namespace gpucheck {
     OffsetOperator op = fromBinaryOpcode(bo->getOpcode());
     if(op == OffsetOperator::end) {
       // We don't handle this kind of operation
-      offsets[bo] = make_shared<InstOffsetVal>(bo);
+      offsets[bo] = InstOffsetVal::get(bo);
       return offsets[bo];
     }
 
     OffsetValPtr lhs = getOrCreateVal(bo->getOperand(0));
     OffsetValPtr rhs = getOrCreateVal(bo->getOperand(1));
-    offsets[bo] = make_shared<BinOpOffsetVal>(lhs, op, rhs);
+    offsets[bo] = BinOpOffsetVal::get(lhs, op, rhs);
     return offsets[bo];
   }
 
@@ -115,7 +310,7 @@ namespace gpucheck {
         // Calculate the offset to the struct element
         OffsetValPtr idx = getOrCreateVal(*i);
         if(!idx->isConst()) {
-          return make_shared<UnknownOffsetVal>(ptr);
+          return UnknownOffsetVal::get(ptr);
         }
         assert(idx->isConst()); // Struct references can't be dynamic
 
@@ -132,16 +327,16 @@ namespace gpucheck {
         }
 
         // Our element starts at the end of the previous ones
-        idx_off = make_shared<ConstOffsetVal>(elem_off);
+        idx_off = ConstOffsetVal::get(elem_off);
 
       } else if(auto seq_t=dyn_cast<SequentialType>(t)) {
         // Calculate the offset to the array element
         OffsetValPtr idx = getOrCreateVal(*i);
 
         // Calculate the size to step
-        OffsetValPtr size = make_shared<ConstOffsetVal>(DL.getTypeAllocSize(seq_t->getElementType()));
+        OffsetValPtr size = ConstOffsetVal::get(DL.getTypeAllocSize(seq_t->getElementType()));
 
-        idx_off = make_shared<BinOpOffsetVal>(idx, Mul, size);
+        idx_off = BinOpOffsetVal::get(idx, Mul, size);
 
         // Update the type for next iteration
         t = seq_t->getElementType();
@@ -151,9 +346,9 @@ namespace gpucheck {
         OffsetValPtr idx = getOrCreateVal(*i);
 
         // Calculate the size to step
-        OffsetValPtr size = make_shared<ConstOffsetVal>(DL.getTypeAllocSize(seq_t->getElementType()));
+        OffsetValPtr size = ConstOffsetVal::get(DL.getTypeAllocSize(seq_t->getElementType()));
 
-        idx_off = make_shared<BinOpOffsetVal>(idx, Mul, size);
+        idx_off = BinOpOffsetVal::get(idx, Mul, size);
 
         // Update the type for next iteration
         t = seq_t->getElementType();
@@ -162,7 +357,7 @@ namespace gpucheck {
         errs() << *t << "\n" << (isa<PointerType>(t) ? "T" : "F") << (isa<SequentialType>(t) ? "T" : "F") << "\n";
         assert(false && "GEP must index a struct or sequence");
       }
-      offset = make_shared<BinOpOffsetVal>(offset, Add, idx_off);
+      offset = BinOpOffsetVal::get(offset, Add, idx_off);
     }
     return offset;
 
@@ -188,7 +383,7 @@ namespace gpucheck {
   OffsetValPtr OffsetPropagation::getOrCreateVal(CallInst *ci) {
     //TODO
     ++ACFCallTranslations;
-    offsets[ci] = make_shared<InstOffsetVal>(ci);
+    offsets[ci] = InstOffsetVal::get(ci);
     return offsets[ci];
   }
 
@@ -204,9 +399,9 @@ namespace gpucheck {
     OffsetValPtr rhs = getOrCreateVal(ci->getOperand(1));
     OffsetOperator op = fromCmpPredicate(ci->getPredicate());
     if(op != OffsetOperator::end)
-      offsets[ci] = make_shared<BinOpOffsetVal>(lhs, op, rhs);
+      offsets[ci] = BinOpOffsetVal::get(lhs, op, rhs);
     else
-      offsets[ci] = make_shared<InstOffsetVal>(ci);
+      offsets[ci] = InstOffsetVal::get(ci);
     return offsets[ci];
   }
   bool OffsetPropagation::isUpdateStore(StoreInst *s) {
@@ -240,9 +435,9 @@ namespace gpucheck {
     //errs() << "Constant: " << *c << "\n";
     //errs() << "Constant Type: " << *c->getType() << "\n";
     if(c->getType()->isIntegerTy() || c->getType()->isPointerTy())
-      offsets[c] = make_shared<ConstOffsetVal>(c);
+      offsets[c] = ConstOffsetVal::get(c);
     else
-      offsets[c] = make_shared<UnknownOffsetVal>(c);
+      offsets[c] = UnknownOffsetVal::get(c);
     return offsets[c];
   }
 
@@ -250,20 +445,20 @@ namespace gpucheck {
     ++ACFLoadTranslations;
     Function &f = *l->getParent()->getParent();
 
-    MemoryDependenceResults& MD = getAnalysis<MemoryDependenceWrapperPass>(f).getMemDep();
-    MemDepResult res = MD.getDependency(l);
+    FunctionAnalyses& fa = getAnalyses(f);
 
-    // Store was found through dependence analysis
-    if(res.isDef()) {
-      if(auto s=dyn_cast<StoreInst>(res.getInst())) {
-        offsets[l]=getOrCreateVal(s->getValueOperand());
-        return offsets[l];
-      }
+    // Store was found through MemorySSA
+    auto def = fa.loadDefs.find(l);
+    if(def != fa.loadDefs.end()) {
+      if(def->second)
+        offsets[l]=getOrCreateVal(def->second->getValueOperand());
+      else
+        offsets[l] = InstOffsetVal::get(l);
+      return offsets[l];
     }
     // Attempt manual discovery
     Value *ptr = l->getPointerOperand();
-    const DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>(f).getDomTree();
-    const PostDominatorTree& PDT = getAnalysis<PostDominatorTreeWrapperPass>(f).getPostDomTree();
+    const PostDominatorTree& PDT = *fa.PDT;
     for(auto u=ptr->user_begin(),e=ptr->user_end(); u!=e; ++u) {
       //errs() << "Pointer used in: " << **u << "\n";
       if(auto s=dyn_cast<StoreInst>(*u)) {
@@ -278,7 +473,7 @@ namespace gpucheck {
     }
     // Default, unknown def
     // errs() << "No pair found for load: "<< *l->getPointerOperand() << "\n" << l << " - " << *l << "\n";
-    offsets[l] = make_shared<InstOffsetVal>(l);
+    offsets[l] = InstOffsetVal::get(l);
     return offsets[l];
   }
 
@@ -286,8 +481,9 @@ namespace gpucheck {
     ++ACFPhiTranslations;
     // Get the required analysis
     Function &f = *(p->getFunction());
-    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(f).getDomTree();
-    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(f).getLoopInfo();
+    FunctionAnalyses& fa = getAnalyses(f);
+    DominatorTree &DT = *fa.DT;
+    LoopInfo &LI = *fa.LI;
 
     // Get all incoming values
     std::vector<Value *> fwd_values, bk_values;
@@ -308,7 +504,7 @@ namespace gpucheck {
     }
 
     if(fwd_values.size() == 0) {
-      offsets[p] = make_shared<InstOffsetVal>(p);
+      offsets[p] = InstOffsetVal::get(p);
       return offsets[p];
     }
 
@@ -415,22 +611,22 @@ namespace gpucheck {
     OffsetValPtr off_untaken = applyDominatingCondition(v_untaken, b_untaken, mergePt, DT);
 
     //returning (c * off_taken) + (!c * off_untaken)
-    OffsetValPtr mult_taken = make_shared<BinOpOffsetVal>(cond, Mul, off_taken);
-    OffsetValPtr mult_untaken = make_shared<BinOpOffsetVal>(ncond, Mul, off_untaken);
-    return make_shared<BinOpOffsetVal>(mult_taken, Add, mult_untaken);
+    OffsetValPtr mult_taken = BinOpOffsetVal::get(cond, Mul, off_taken);
+    OffsetValPtr mult_untaken = BinOpOffsetVal::get(ncond, Mul, off_untaken);
+    return BinOpOffsetVal::get(mult_taken, Add, mult_untaken);
   }
 
   OffsetValPtr OffsetPropagation::inCallContext(const OffsetValPtr& orig, const CallInst *ci) {
     unordered_map<OffsetValPtr, OffsetValPtr> rep;
-    const Function *f = ci->getCalledFunction();
+    const Function *f = getCalleeThroughCasts(ci);
     if (f == nullptr)
       return orig; // Can't map into function
 
     // Build the map from formals to actuals
     auto f_arg = f->arg_begin();
     auto c_arg = ci->arg_begin();
-    while(c_arg != ci->arg_end()) {
-      rep[make_shared<ArgOffsetVal>(const_cast<Argument *>(&*f_arg))] = getOrCreateVal(*c_arg);
+    while(c_arg != ci->arg_end() && f_arg != f->arg_end()) {
+      rep[ArgOffsetVal::get(const_cast<Argument *>(&*f_arg))] = getOrCreateVal(*c_arg);
       ++f_arg;
       ++c_arg;
     }
@@ -446,17 +642,17 @@ namespace gpucheck {
         if(f != nullptr) {
           switch(f->getIntrinsicID()) {
             case Intrinsic::nvvm_read_ptx_sreg_ntid_x:
-              return make_shared<ConstOffsetVal>(thread_dimx);
+              return ConstOffsetVal::get(thread_dimx);
             case Intrinsic::nvvm_read_ptx_sreg_ntid_y:
-              return make_shared<ConstOffsetVal>(thread_dimy);
+              return ConstOffsetVal::get(thread_dimy);
             case Intrinsic::nvvm_read_ptx_sreg_ntid_z:
-              return make_shared<ConstOffsetVal>(thread_dimz);
+              return ConstOffsetVal::get(thread_dimz);
             case Intrinsic::nvvm_read_ptx_sreg_nctaid_x:
-              return make_shared<ConstOffsetVal>(block_dimx);
+              return ConstOffsetVal::get(block_dimx);
             case Intrinsic::nvvm_read_ptx_sreg_nctaid_y:
-              return make_shared<ConstOffsetVal>(block_dimy);
+              return ConstOffsetVal::get(block_dimy);
             case Intrinsic::nvvm_read_ptx_sreg_nctaid_z:
-              return make_shared<ConstOffsetVal>(block_dimz);
+              return ConstOffsetVal::get(block_dimz);
             default:
               break;
           }
@@ -477,7 +673,7 @@ namespace gpucheck {
     if(lhs == bo->lhs && rhs == bo->rhs)
       return orig; // No changes were made
     else
-      return make_shared<BinOpOffsetVal>(lhs, bo->op, rhs);
+      return BinOpOffsetVal::get(lhs, bo->op, rhs);
   }
 
   OffsetValPtr OffsetPropagation::inThreadContext(const OffsetValPtr& orig, int thread_idx, int thread_idy, int thread_idz, int block_idx, int block_idy, int block_idz) {
@@ -488,19 +684,19 @@ namespace gpucheck {
         if(f != nullptr) {
           switch(f->getIntrinsicID()) {
             case Intrinsic::nvvm_read_ptx_sreg_tid_x:
-              return make_shared<ConstOffsetVal>(thread_idx);
+              return ConstOffsetVal::get(thread_idx);
             case Intrinsic::nvvm_read_ptx_sreg_tid_y:
-              return make_shared<ConstOffsetVal>(thread_idy);
+              return ConstOffsetVal::get(thread_idy);
             case Intrinsic::nvvm_read_ptx_sreg_tid_z:
-              return make_shared<ConstOffsetVal>(thread_idz);
+              return ConstOffsetVal::get(thread_idz);
             case Intrinsic::nvvm_read_ptx_sreg_laneid:
-              return make_shared<ConstOffsetVal>(thread_idx % 32);
+              return ConstOffsetVal::get(thread_idx % 32);
             case Intrinsic::nvvm_read_ptx_sreg_ctaid_x:
-              return make_shared<ConstOffsetVal>(block_idx);
+              return ConstOffsetVal::get(block_idx);
             case Intrinsic::nvvm_read_ptx_sreg_ctaid_y:
-              return make_shared<ConstOffsetVal>(block_idy);
+              return ConstOffsetVal::get(block_idy);
             case Intrinsic::nvvm_read_ptx_sreg_ctaid_z:
-              return make_shared<ConstOffsetVal>(block_idz);
+              return ConstOffsetVal::get(block_idz);
             default:
               break;
           }
@@ -521,7 +717,7 @@ namespace gpucheck {
     if(lhs == bo->lhs && rhs == bo->rhs)
       return orig; // No changes were made
     else
-      return make_shared<BinOpOffsetVal>(lhs, bo->op, rhs);
+      return BinOpOffsetVal::get(lhs, bo->op, rhs);
   }
 
   OffsetOperator OffsetPropagation::fromBinaryOpcode(llvm::Instruction::BinaryOps op) {
@@ -556,73 +752,211 @@ namespace gpucheck {
     }
   }
 
-  std::vector<const Function*> OffsetPropagation::findRequiredContexts(const OffsetValPtr& ptr,
-      std::vector<const Function*> found) {
+  std::vector<const Function*> OffsetPropagation::findRequiredContexts(const OffsetValPtr& ptr) {
+    vector<const Function*> found;
+    DenseSet<OffsetValPtr> visited;
+    findRequiredContexts(ptr, found, visited);
+    return found;
+  }
+
+  void OffsetPropagation::findRequiredContexts(const OffsetValPtr& ptr, vector<const Function*>& found,
+      DenseSet<OffsetValPtr>& visited) {
+    // Shared subexpressions only need to be searched once
+    if(!visited.insert(ptr).second)
+      return;
     if(auto bo=dyn_cast<BinOpOffsetVal>(&*ptr)) {
-      findRequiredContexts(bo->lhs, found);
-      findRequiredContexts(bo->rhs, found);
+      findRequiredContexts(bo->lhs, found, visited);
+      findRequiredContexts(bo->rhs, found, visited);
     }
     if(auto arg=dyn_cast<ArgOffsetVal>(&*ptr)) {
       if(find(found.begin(), found.end(), arg->arg->getParent()) == found.end())
         found.push_back(arg->arg->getParent());
     }
-    return found;
-
   }
 
-  vector<const CallInst*> OffsetPropagation::getSameModuleFunctionCallers(const Function *f) {
-    vector<const CallInst*> ret;
-    for(auto g=f->getParent()->begin(),e=f->getParent()->end(); g != e; ++g) {
-      if(auto f=dyn_cast<Function>(g)) {
-        for(auto b=f->begin(),e=f->end(); b!=e; ++b) {
-          for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
-            if(auto* ci=dyn_cast<CallInst>(i)) {
-              if(ci->getCalledFunction() == f)
-                ret.push_back(ci);
-            }
+  void OffsetPropagation::buildCallerIndex() {
+    for(auto g=M->begin(),e=M->end(); g != e; ++g) {
+      for(auto b=g->begin(),e=g->end(); b!=e; ++b) {
+        for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
+          if(auto* ci=dyn_cast<CallInst>(i)) {
+            if(const Function *callee = getCalleeThroughCasts(ci))
+              callers[callee].push_back(ci);
           }
         }
       }
     }
-    return ret;
+    callersIndexed = true;
   }
-  vector<OffsetValPtr> OffsetPropagation::inContexts(OffsetValPtr& orig) {
-    vector<const Function*> empty;
-    vector<OffsetValPtr> iacf = inContexts(orig, empty);
 
-    if(MaxIACFSize.getValue() < iacf.size())
-        MaxIACFSize=iacf.size();
-    return iacf;
+  const vector<const CallInst*>& OffsetPropagation::getSameModuleFunctionCallers(const Function *f) {
+    static const vector<const CallInst*> none;
+    if(!callersIndexed)
+      buildCallerIndex();
+    auto found = callers.find(f);
+    return found == callers.end() ? none : found->second;
   }
 
-  vector<OffsetValPtr> OffsetPropagation::inContexts(OffsetValPtr& orig, std::vector<const Function *>& ignore) {
-    assert(orig != nullptr);
-    vector<const Function *> context = findRequiredContexts(orig);
-    vector<OffsetValPtr> ret;
+  void OffsetPropagation::solveContexts() {
+    if(!callersIndexed)
+      buildCallerIndex();
 
-    for(auto f=context.begin(),e=context.end(); f!=e; ++f) {
-      vector<const CallInst*> callers = getSameModuleFunctionCallers(*f);
-      if(callers.empty())
-        continue;
+    // Callers' contexts are needed first, so solve top-down
+    CallGraphSCCs graph(*M, callers);
+    for(auto scc=graph.sccs.rbegin(),e=graph.sccs.rend(); scc!=e; ++scc)
+      solveSCC(*scc);
+    contextsSolved = true;
+  }
+
+  OffsetPropagation::Binding OffsetPropagation::bindCall(const CallInst *ci, const Binding& callerCtx) {
+    const Function *caller = ci->getParent()->getParent();
+    const Function *callee = getCalleeThroughCasts(ci);
+
+    unordered_map<OffsetValPtr, OffsetValPtr> rep;
+    unsigned i = 0;
+    for(auto a=caller->arg_begin(),e=caller->arg_end(); a!=e; ++a, ++i) {
+      OffsetValPtr formal = ArgOffsetVal::get(const_cast<Argument *>(&*a));
+      if(callerCtx[i] != formal)
+        rep[formal] = callerCtx[i];
+    }
+
+    Binding ret;
+    i = 0;
+    for(auto a=callee->arg_begin(),e=callee->arg_end(); a!=e; ++a, ++i) {
+      if(i < ci->getNumArgOperands())
+        ret.push_back(replaceComponents(getOrCreateVal(ci->getArgOperand(i)), rep));
+      else
+        ret.push_back(ArgOffsetVal::get(const_cast<Argument *>(&*a)));
+    }
+    return ret;
+  }
 
-      for(auto ci=callers.begin(),e=callers.end(); ci!=e; ++ci) {
-        OffsetValPtr inContext = inCallContext(orig, *ci);
-        vector<const Function*> recIgnore = ignore;
-        recIgnore.push_back(*f); // Don't allow this function's context to be added again
-        vector<OffsetValPtr> recurse = inContexts(inContext, recIgnore);
+  // Contexts of a function in a recursive SCC kept before they are widened
+  static const unsigned MaxRecursiveContexts = 8;
+
+  void OffsetPropagation::solveSCC(const vector<const Function*>& scc) {
+    DenseSet<const Function*> members;
+    for(auto f=scc.begin(),e=scc.end(); f!=e; ++f)
+      members.insert(*f);
+    DenseSet<const Function*> widened;
+
+    auto identity = [](const Function *f) {
+      Binding b;
+      for(auto a=f->arg_begin(),e=f->arg_end(); a!=e; ++a)
+        b.push_back(ArgOffsetVal::get(const_cast<Argument *>(&*a)));
+      return b;
+    };
+
+    // Returns true if b was not already covered by the contexts of f
+    auto addContext = [&](const Function *f, const Binding& b, bool mayWiden) {
+      vector<Binding>& known = contexts[f];
+      Binding formals = identity(f);
+      if(widened.count(f)) {
+        // Formals which differ between contexts are left unbound
+        bool changed = false;
+        for(unsigned i=0; i<b.size(); i++) {
+          if(known[0][i] != b[i] && known[0][i] != formals[i]) {
+            known[0][i] = formals[i];
+            changed = true;
+          }
+        }
+        return changed;
+      }
+      if(find(known.begin(), known.end(), b) != known.end())
+        return false;
+      known.push_back(b);
+
+      if(mayWiden && known.size() > MaxRecursiveContexts) {
+        Binding merged = known[0];
+        for(auto k=known.begin()+1,e=known.end(); k!=e; ++k)
+          for(unsigned i=0; i<merged.size(); i++)
+            if(merged[i] != (*k)[i])
+              merged[i] = formals[i];
+        known.assign(1, merged);
+        widened.insert(f);
+      }
+      return true;
+    };
+
+    // Contexts entering the SCC, from callers which are already solved
+    vector<const CallInst*> internal;
+    bool entered = false;
+    for(auto f=scc.begin(),e=scc.end(); f!=e; ++f) {
+      const vector<const CallInst*>& callSites = getSameModuleFunctionCallers(*f);
+      for(auto ci=callSites.begin(),e=callSites.end(); ci!=e; ++ci) {
+        const Function *caller = (*ci)->getParent()->getParent();
+        if(members.count(caller)) {
+          internal.push_back(*ci);
+          continue;
+        }
+        entered = true;
+        vector<Binding>& callerContexts = contexts[caller];
+        for(auto c=callerContexts.begin(),e=callerContexts.end(); c!=e; ++c)
+          addContext(*f, bindCall(*ci, *c), false);
+      }
+    }
+
+    // Without outside callers, the formals are unknown. Otherwise members
+    // only called from inside the SCC get their contexts through recursion.
+    if(!entered) {
+      for(auto f=scc.begin(),e=scc.end(); f!=e; ++f)
+        addContext(*f, identity(*f), false);
+    }
 
-        // Append the recursed results into my results
-        for(auto b=recurse.begin(),e=recurse.end(); b!=e; ++b)
-          ret.push_back(*b);
+    // Follow recursive calls until no new contexts appear
+    bool changed = !internal.empty();
+    while(changed) {
+      changed = false;
+      for(auto ci=internal.begin(),e=internal.end(); ci!=e; ++ci) {
+        const Function *caller = (*ci)->getParent()->getParent();
+        vector<Binding> callerContexts = contexts[caller];
+        for(auto c=callerContexts.begin(),e=callerContexts.end(); c!=e; ++c)
+          changed |= addContext(getCalleeThroughCasts(*ci), bindCall(*ci, *c), true);
       }
+    }
+  }
 
-      // Done
-      return ret;
+  vector<OffsetValPtr> OffsetPropagation::inContexts(OffsetValPtr& orig) {
+    assert(orig != nullptr);
+    if(!contextsSolved)
+      solveContexts();
+
+    // Bind the formals of each function in turn, merging equal results
+    vector<OffsetValPtr> iacf(1, orig);
+    vector<const Function *> required = findRequiredContexts(orig);
+    for(auto f=required.begin(),e=required.end(); f!=e; ++f) {
+      vector<OffsetValPtr> bound;
+      DenseSet<OffsetValPtr> seen;
+      const vector<Binding>& fContexts = contexts[*f];
+      for(auto ctx=fContexts.begin(),e=fContexts.end(); ctx!=e; ++ctx) {
+        unordered_map<OffsetValPtr, OffsetValPtr> rep;
+        unsigned i = 0;
+        for(auto a=(*f)->arg_begin(),e=(*f)->arg_end(); a!=e; ++a, ++i)
+          rep[ArgOffsetVal::get(const_cast<Argument *>(&*a))] = (*ctx)[i];
+
+        for(auto v=iacf.begin(),e=iacf.end(); v!=e; ++v) {
+          OffsetValPtr inContext = replaceComponents(*v, rep);
+          if(seen.insert(inContext).second)
+            bound.push_back(inContext);
+        }
+      }
+      if(!bound.empty())
+        iacf.swap(bound);
     }
 
-    //Fall-through, no additional context can be added
-    ret.push_back(orig);
-    return ret;
+    if(MaxIACFSize.getValue() < iacf.size())
+        MaxIACFSize=iacf.size();
+    return iacf;
+  }
+
+  AnalysisKey OffsetPropagationAnalysis::Key;
+
+  OffsetPropagationAnalysis::Result OffsetPropagationAnalysis::run(Module &M, ModuleAnalysisManager &AM) {
+    FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    Result OP(new OffsetPropagation());
+    OP->runOnModule(M, [&FAM](Function &F) -> MemorySSA& {
+      return FAM.getResult<MemorySSAAnalysis>(F).getMSSA();
+    });
+    return OP;
   }
 }
 
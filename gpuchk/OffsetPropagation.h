@@ -5,7 +5,14 @@
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include <functional>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -19,6 +26,7 @@ namespace gpucheck {
   class OffsetPropagation : public ModulePass {
     private:
       Module *M;
+      std::unique_ptr<OffsetValArena> arena;
       std::unordered_map<Value *, OffsetValPtr> offsets;
 
       OffsetValPtr getOrCreateVal(BinaryOperator *);
@@ -40,20 +48,61 @@ namespace gpucheck {
                                                 Instruction *mergePt,
                                                 DominatorTree& DT);
 
-      std::vector<const Function*> findRequiredContexts(const OffsetValPtr& ptr,
-          std::vector<const Function*> found = std::vector<const Function*>());
-      std::vector<const CallInst*> getSameModuleFunctionCallers(const Function *f);
+      std::vector<const Function*> findRequiredContexts(const OffsetValPtr& ptr);
+      void findRequiredContexts(const OffsetValPtr& ptr, std::vector<const Function*>& found,
+          DenseSet<OffsetValPtr>& visited);
+      const std::vector<const CallInst*>& getSameModuleFunctionCallers(const Function *f);
+
+      // Direct call sites of each function, built on first use
+      DenseMap<const Function*, std::vector<const CallInst*>> callers;
+      bool callersIndexed;
+      void buildCallerIndex();
 
       void invalidateRange(Value *start, OffsetValPtr& to);
 
-      std::vector<OffsetValPtr> inContexts(OffsetValPtr& orig, std::vector<const Function*>& ignore);
+      /**
+       * Analyses of one function, built the first time any of its values
+       * are translated and shared by every later query. MemorySSA is only
+       * needed for loads, so the store reaching each load is recorded up
+       * front rather than keeping it alive. Once built they are only read,
+       * so shards share them.
+       */
+      struct FunctionAnalyses {
+        std::unique_ptr<DominatorTree> DT;
+        std::unique_ptr<PostDominatorTree> PDT;
+        std::unique_ptr<LoopInfo> LI;
+        // The store each load reads from, or null if none can reach it.
+        // Loads which MemorySSA can't resolve are left out.
+        DenseMap<const LoadInst*, StoreInst*> loadDefs;
+      };
+      DenseMap<const Function*, std::shared_ptr<FunctionAnalyses>> analyses;
+      FunctionAnalyses& getAnalyses(Function &F);
+      bool findReachingStore(LoadInst *l, MemorySSA &MSSA, StoreInst *&store);
+
+      /**
+       * The offsets bound to each formal of a function in one calling
+       * context, in terms of values which need no further context. Formals
+       * which cannot be bound, such as through recursion, map to themselves.
+       */
+      typedef std::vector<OffsetValPtr> Binding;
+      // Distinct calling contexts of each function, solved on first use
+      std::unordered_map<const Function*, std::vector<Binding>> contexts;
+      bool contextsSolved;
+      void solveContexts();
+      void solveSCC(const std::vector<const Function*>& scc);
+      Binding bindCall(const CallInst *ci, const Binding& callerCtx);
 
       bool isUpdateStore(StoreInst* s);
 
     public:
+      // Supplies MemorySSA for a function from either pass manager
+      typedef std::function<MemorySSA&(Function&)> MemorySSAProvider;
+
       static char ID;
-      OffsetPropagation() : ModulePass(ID) {}
+      OffsetPropagation() : ModulePass(ID), callersIndexed(false), contextsSolved(false) {}
       bool runOnModule(Module &F);
+      bool runOnModule(Module &F, MemorySSAProvider memorySSA);
+      void releaseMemory();
       void getAnalysisUsage(AnalysisUsage &AU) const;
 
       OffsetValPtr getOrCreateVal(Value *);
@@ -66,6 +115,42 @@ namespace gpucheck {
           int block_dimx, int block_dimy, int block_dimz);
 
       std::vector<OffsetValPtr> inContexts(OffsetValPtr& orig);
+
+      /**
+       * Build the analyses of every function in the module now, rather
+       * than on first use, and solve their calling contexts, so that
+       * shards can share them
+       */
+      void prepareAnalyses();
+
+      /**
+       * A copy which translates into its own arena and caches, so that it
+       * can be used from another thread alongside this one. It shares the
+       * prepared function analyses, and can't analyze other functions. The
+       * solved calling contexts are copied into its arena.
+       */
+      std::unique_ptr<OffsetPropagation> createShard();
+
+      /**
+       * Make this instance's arena current for the calling thread
+       */
+      void makeCurrent() { OffsetValArena::setCurrent(arena.get()); }
+
+    private:
+      MemorySSAProvider memorySSA;
+  };
+
+  /**
+   * OffsetPropagation for the new pass manager. MemorySSA comes from the
+   * function analysis manager, so it is shared with any other pass which
+   * requested it.
+   */
+  class OffsetPropagationAnalysis : public AnalysisInfoMixin<OffsetPropagationAnalysis> {
+    friend AnalysisInfoMixin<OffsetPropagationAnalysis>;
+    static AnalysisKey Key;
+    public:
+      typedef std::unique_ptr<OffsetPropagation> Result;
+      Result run(Module &M, ModuleAnalysisManager &AM);
   };
 }
 
@@ -1,6 +1,10 @@
 #include "OffsetPropagation.h"
 #include "OffsetOps.h"
 #include "raw_os_ostream.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <mutex>
 
 namespace gpucheck {
   const APInt& min(const APInt &lhs, const APInt &rhs) {
@@ -13,22 +17,189 @@ namespace gpucheck {
       return lhs;
     return rhs;
   }
+  /************************************************
+   * OffsetValArena
+   ************************************************/
+  OffsetValArena* OffsetValArena::registry[OffsetValArena::MaxArenas] = { nullptr };
+
+  namespace {
+    std::mutex registryLock;
+    thread_local OffsetValArena* currentArena = nullptr;
+  }
+
+  size_t OffsetValArena::APIntHash::operator()(const APInt& a) const {
+    return hash_value(a);
+  }
+
+  OffsetValArena::OffsetValArena() : id(0), numNodes(0),
+      chunks(new std::unique_ptr<OffsetVal*[]>[1u << (IndexBits - ChunkBits)]) {
+    std::lock_guard<std::mutex> guard(registryLock);
+    // Arena 0 is reserved so that no valid handle is null
+    for(uint32_t i=1; i<MaxArenas; ++i) {
+      if(registry[i] == nullptr) {
+        id = i;
+        registry[i] = this;
+        break;
+      }
+    }
+    if(id == 0)
+      report_fatal_error("Too many live OffsetValArenas");
+  }
+
+  OffsetValArena::~OffsetValArena() {
+    // Constants are the only nodes owning memory outside of the arena
+    for(auto c=uniqueConsts.begin(),e=uniqueConsts.end(); c!=e; ++c)
+      const_cast<ConstOffsetVal*>(cast<ConstOffsetVal>(c->second.get()))->~ConstOffsetVal();
+
+    if(currentArena == this)
+      currentArena = nullptr;
+    std::lock_guard<std::mutex> guard(registryLock);
+    registry[id] = nullptr;
+  }
+
+  OffsetValArena& OffsetValArena::current() {
+    assert(currentArena != nullptr && "No OffsetValArena is active");
+    return *currentArena;
+  }
+
+  void OffsetValArena::setCurrent(OffsetValArena* arena) {
+    currentArena = arena;
+  }
+
+  OffsetValPtr OffsetValArena::insert(OffsetVal* ov) {
+    uint32_t index = numNodes++;
+    // Keep handles clear of the keys DenseMap reserves
+    if(numNodes >= (1u << IndexBits) - 2)
+      report_fatal_error("OffsetValArena exhausted");
+
+    std::unique_ptr<OffsetVal*[]>& chunk = chunks[index >> ChunkBits];
+    if(!chunk)
+      chunk.reset(new OffsetVal*[1u << ChunkBits]);
+    chunk[index & ((1u << ChunkBits) - 1)] = ov;
+    return OffsetValPtr((id << IndexBits) | index);
+  }
+
+  OffsetValPtr OffsetValArena::getConst(const APInt& a) {
+    OffsetValPtr& ov = uniqueConsts[a];
+    if(!ov)
+      ov = insert(new (alloc.Allocate<ConstOffsetVal>()) ConstOffsetVal(a));
+    return ov;
+  }
+
+  OffsetValPtr OffsetValArena::getInst(Instruction* i) {
+    OffsetValPtr& ov = uniqueInsts[i];
+    if(!ov)
+      ov = insert(new (alloc.Allocate<InstOffsetVal>()) InstOffsetVal(i));
+    return ov;
+  }
+
+  OffsetValPtr OffsetValArena::getArg(Argument* a) {
+    OffsetValPtr& ov = uniqueArgs[a];
+    if(!ov)
+      ov = insert(new (alloc.Allocate<ArgOffsetVal>()) ArgOffsetVal(a));
+    return ov;
+  }
+
+  OffsetValPtr OffsetValArena::getUnknown(Value* v) {
+    OffsetValPtr& ov = uniqueUnknowns[v];
+    if(!ov)
+      ov = insert(new (alloc.Allocate<UnknownOffsetVal>()) UnknownOffsetVal(v));
+    return ov;
+  }
+
+  OffsetValPtr OffsetValArena::getBinOp(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs) {
+    // Never build a node that could be folded away
+    if(lhs->isConst() && rhs->isConst()) {
+      APInt folded;
+      if(foldConstantOp(lhs->constVal(), op, rhs->constVal(), folded))
+        return getConst(folded);
+    }
+
+    // Keyed on both handles separately, since DenseMap hashes a packed 64-bit
+    // key by its low word alone and every node sharing an rhs would collide
+    auto operands = std::make_pair(lhs.getHandle(), rhs.getHandle());
+    OffsetValPtr& ov = uniqueBinOps[std::make_pair(operands, (unsigned)op)];
+    if(!ov)
+      ov = insert(new (alloc.Allocate<BinOpOffsetVal>()) BinOpOffsetVal(lhs, op, rhs));
+    return ov;
+  }
+
+  bool foldConstantOp(const APInt& lhs, OffsetOperator op, const APInt& rhs, APInt& out) {
+    APInt lhsi = lhs;
+    APInt rhsi = rhs;
+
+    // Always just work in the larger bitwidth
+    if(lhsi.getBitWidth() > rhsi.getBitWidth())
+      rhsi = rhsi.zext(lhsi.getBitWidth());
+
+    if(rhsi.getBitWidth() > lhsi.getBitWidth())
+      lhsi = lhsi.zext(rhsi.getBitWidth());
+
+    switch(op) {
+      case OffsetOperator::SDiv:
+      case OffsetOperator::UDiv:
+      case OffsetOperator::SRem:
+      case OffsetOperator::URem:
+        // Leave division by zero for the runtime to define
+        if(rhsi == 0)
+          return false;
+        break;
+      default:
+        break;
+    }
+
+    switch(op) {
+      case OffsetOperator::Add: out = lhsi + rhsi; break;
+      case OffsetOperator::Sub: out = lhsi - rhsi; break;
+      case OffsetOperator::Mul: out = lhsi * rhsi; break;
+      case OffsetOperator::SDiv: out = lhsi.sdiv(rhsi); break;
+      case OffsetOperator::UDiv: out = lhsi.udiv(rhsi); break;
+      case OffsetOperator::SRem: out = lhsi.srem(rhsi); break;
+      case OffsetOperator::URem: out = lhsi.urem(rhsi); break;
+      case OffsetOperator::And: out = lhsi & rhsi; break;
+      case OffsetOperator::Or: out = lhsi | rhsi; break;
+      case OffsetOperator::Xor: out = lhsi ^ rhsi; break;
+      case OffsetOperator::Eq: out = APInt(1, lhsi.eq(rhsi)); break;
+      case OffsetOperator::Neq: out = APInt(1, lhsi.ne(rhsi)); break;
+      case OffsetOperator::SLT: out = APInt(1, lhsi.slt(rhsi)); break;
+      case OffsetOperator::SLE: out = APInt(1, lhsi.sle(rhsi)); break;
+      case OffsetOperator::ULT: out = APInt(1, lhsi.ult(rhsi)); break;
+      case OffsetOperator::ULE: out = APInt(1, lhsi.ule(rhsi)); break;
+      case OffsetOperator::SGT: out = APInt(1, lhsi.sgt(rhsi)); break;
+      case OffsetOperator::SGE: out = APInt(1, lhsi.sge(rhsi)); break;
+      case OffsetOperator::UGT: out = APInt(1, lhsi.ugt(rhsi)); break;
+      case OffsetOperator::UGE: out = APInt(1, lhsi.uge(rhsi)); break;
+      case OffsetOperator::end: assert(false); return false;
+    }
+    return true;
+  }
+
   /************************************************
    * OffsetVal
    ************************************************/
   void OffsetVal::print(std::ostream& os) const {
-    os << "<ERROR BaseClass print>>";
+    switch(kind) {
+      case OV_Const: return cast<ConstOffsetVal>(this)->print(os);
+      case OV_Inst: return cast<InstOffsetVal>(this)->print(os);
+      case OV_Arg: return cast<ArgOffsetVal>(this)->print(os);
+      case OV_BinOp: return cast<BinOpOffsetVal>(this)->print(os);
+      case OV_Unk: return cast<UnknownOffsetVal>(this)->print(os);
+    }
   }
+
   const llvm::APInt& OffsetVal::constVal() const {
-    assert(false);
+    return cast<ConstOffsetVal>(this)->constVal();
   }
 
   const std::pair<llvm::APInt, llvm::APInt> OffsetVal::constRange() const {
-    assert(false);
-  }
-
-  bool OffsetVal::isConst() const {
-    assert(false);
+    switch(kind) {
+      case OV_Const: return cast<ConstOffsetVal>(this)->constRange();
+      case OV_Inst: return cast<InstOffsetVal>(this)->constRange();
+      case OV_Arg: return cast<ArgOffsetVal>(this)->constRange();
+      case OV_BinOp: return cast<BinOpOffsetVal>(this)->constRange();
+      case OV_Unk: return cast<UnknownOffsetVal>(this)->constRange();
+    }
+    llvm_unreachable("Unknown OffsetVal kind");
   }
 
   /************************************************
@@ -129,9 +300,6 @@ namespace gpucheck {
   void BinOpOffsetVal::print(std::ostream& os) const {
     os << '(' << *lhs << ' ' << getPrintOp() << ' ' << *rhs << ')';
   }
-  bool BinOpOffsetVal::isConst() const {
-    return false;
-  }
   bool BinOpOffsetVal::isCompare() const {
     switch(op) {
       case OffsetOperator::Eq:
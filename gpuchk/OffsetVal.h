@@ -1,7 +1,14 @@
 #include <iostream>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+#include <vector>
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Casting.h"
 
 #ifndef OFFSET_VAL_H
@@ -18,13 +25,164 @@ namespace gpucheck {
     return os;
   }
 
+  class OffsetVal;
+
+  /**
+   * Compact 32-bit handle to an OffsetVal. The upper bits select the owning
+   * OffsetValArena, the lower bits the node within it. Handles are trivially
+   * copyable, and the zero handle is null.
+   */
+  class OffsetValPtr {
+    private:
+      uint32_t handle;
+    public:
+      OffsetValPtr() : handle(0) {}
+      OffsetValPtr(std::nullptr_t) : handle(0) {}
+      explicit OffsetValPtr(uint32_t h) : handle(h) {}
+
+      inline const OffsetVal* get() const;
+      const OffsetVal& operator*() const { return *get(); }
+      const OffsetVal* operator->() const { return get(); }
+      explicit operator bool() const { return handle != 0; }
+
+      uint32_t getHandle() const { return handle; }
+      bool operator==(const OffsetValPtr& o) const { return handle == o.handle; }
+      bool operator!=(const OffsetValPtr& o) const { return handle != o.handle; }
+      bool operator<(const OffsetValPtr& o) const { return handle < o.handle; }
+  };
+
+}
+
+namespace llvm {
+  template<> struct DenseMapInfo<gpucheck::OffsetValPtr> {
+    static gpucheck::OffsetValPtr getEmptyKey() { return gpucheck::OffsetValPtr(~0u); }
+    static gpucheck::OffsetValPtr getTombstoneKey() { return gpucheck::OffsetValPtr(~0u - 1); }
+    static unsigned getHashValue(const gpucheck::OffsetValPtr& ov) { return ov.getHandle() * 37u; }
+    static bool isEqual(const gpucheck::OffsetValPtr& l, const gpucheck::OffsetValPtr& r) { return l == r; }
+  };
+}
+
+namespace gpucheck {
+  /**
+   * Operators which may combine two OffsetVals
+   */
+  enum OffsetOperator : uint8_t {
+    Add,
+    Sub,
+    Mul,
+    SDiv,
+    UDiv,
+    SRem,
+    URem,
+    And,
+    Or,
+    Xor,
+    Eq,
+    Neq,
+    SLT,
+    SLE,
+    SGT,
+    SGE,
+    ULT,
+    ULE,
+    UGT,
+    UGE,
+    end
+  };
+
+  /**
+   * Owns every OffsetVal built while it is the current arena. Nodes are
+   * bump-allocated, uniqued so that structurally identical expressions share
+   * a handle, and freed in bulk when the arena is destroyed.
+   */
+  class OffsetValArena {
+    public:
+      static const unsigned ArenaBits = 8;
+      static const unsigned IndexBits = 32 - ArenaBits;
+      static const unsigned ChunkBits = 14;
+      static const unsigned MaxArenas = 1u << ArenaBits;
+
+      OffsetValArena();
+      ~OffsetValArena();
+      OffsetValArena(const OffsetValArena&) = delete;
+      OffsetValArena& operator=(const OffsetValArena&) = delete;
+
+      OffsetValPtr getConst(const llvm::APInt& a);
+      OffsetValPtr getInst(llvm::Instruction* i);
+      OffsetValPtr getArg(llvm::Argument* a);
+      OffsetValPtr getUnknown(llvm::Value* v);
+      OffsetValPtr getBinOp(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs);
+
+      /**
+       * Number of nodes allocated in this arena
+       */
+      unsigned size() const { return numNodes; }
+
+      /**
+       * Memoized results of the OffsetOps rewrites, keyed by the input node.
+       * They share the lifetime of the nodes they refer to.
+       */
+      enum MemoKind {
+        MemoSumOfProducts,
+        MemoSumOfProductsPass,
+        MemoSimplify,
+        MemoCancelDiffs,
+        NumMemoKinds
+      };
+      llvm::DenseMap<OffsetValPtr, OffsetValPtr>& getMemo(MemoKind kind) { return memos[kind]; }
+
+      /**
+       * The arena new nodes are created in by the calling thread
+       */
+      static OffsetValArena& current();
+      static void setCurrent(OffsetValArena* arena);
+
+      static const OffsetVal* lookup(uint32_t handle) {
+        const OffsetValArena* arena = registry[handle >> IndexBits];
+        uint32_t index = handle & ((1u << IndexBits) - 1);
+        return arena->chunks[index >> ChunkBits][index & ((1u << ChunkBits) - 1)];
+      }
+
+    private:
+      struct APIntHash {
+        size_t operator()(const llvm::APInt& a) const;
+      };
+      struct APIntEq {
+        bool operator()(const llvm::APInt& l, const llvm::APInt& r) const {
+          return l.getBitWidth() == r.getBitWidth() && l == r;
+        }
+      };
+
+      OffsetValPtr insert(OffsetVal* ov);
+
+      static OffsetValArena* registry[MaxArenas];
+
+      uint32_t id;
+      unsigned numNodes;
+      std::unique_ptr<std::unique_ptr<OffsetVal*[]>[]> chunks;
+      llvm::BumpPtrAllocator alloc;
+
+      std::unordered_map<llvm::APInt, OffsetValPtr, APIntHash, APIntEq> uniqueConsts;
+      llvm::DenseMap<const llvm::Value*, OffsetValPtr> uniqueInsts;
+      llvm::DenseMap<const llvm::Value*, OffsetValPtr> uniqueArgs;
+      llvm::DenseMap<const llvm::Value*, OffsetValPtr> uniqueUnknowns;
+      llvm::DenseMap<std::pair<std::pair<uint32_t, uint32_t>, unsigned>, OffsetValPtr> uniqueBinOps;
+
+      llvm::DenseMap<OffsetValPtr, OffsetValPtr> memos[NumMemoKinds];
+  };
+
+  const OffsetVal* OffsetValPtr::get() const {
+    return handle == 0 ? nullptr : OffsetValArena::lookup(handle);
+  }
+
   /**
-   * Generic superclass for offsets
+   * Generic superclass for offsets. OffsetVals live in an OffsetValArena and
+   * dispatch on their kind rather than through a vtable.
    */
   class OffsetVal {
     // dyn_cast support
     public:
-      enum OVKind {
+      enum OVKind : uint8_t {
         OV_Const,
         OV_Inst,
         OV_Arg,
@@ -33,42 +191,40 @@ namespace gpucheck {
       };
     private:
       const OVKind kind;
-    public:
+    protected:
       OffsetVal(OVKind kind) : kind(kind) {}
+    public:
       /**
        * Returns true if this OffsetVal contains only a constant part
        */
-      virtual bool isConst() const;
+      bool isConst() const { return kind == OV_Const; }
       /**
        * Returns an APInt representing this OffsetVal, if it's constant
        */
-      virtual const llvm::APInt& constVal() const;
+      const llvm::APInt& constVal() const;
       /**
        * Returns a pair of values from lower to upper, inclusive
        */
-      virtual const std::pair<llvm::APInt, llvm::APInt> constRange() const;
+      const std::pair<llvm::APInt, llvm::APInt> constRange() const;
       /**
        * Print a human-readable representation of this value
        */
-      virtual void print(std::ostream& stream) const;
+      void print(std::ostream& stream) const;
       OVKind getKind() const { return kind; }
   };
 
-  /**
-   * Declare a shorthand pointer type
-   */
-  typedef std::shared_ptr<OffsetVal> OffsetValPtr;
-
   /**
    * OffsetVal specialization for constant values
    */
   class ConstOffsetVal : public OffsetVal {
     private:
       const llvm::APInt intVal;
+      ConstOffsetVal(const llvm::APInt& a) : OffsetVal(OV_Const), intVal(a) { }
+      friend class OffsetValArena;
     public:
-      ConstOffsetVal(llvm::Constant* c) : OffsetVal(OV_Const), intVal(c->getUniqueInteger()) { }
-      ConstOffsetVal(llvm::APInt a) : OffsetVal(OV_Const), intVal(a) { }
-      ConstOffsetVal(int i) : OffsetVal(OV_Const), intVal(llvm::APInt(32, i, true)) { }
+      static OffsetValPtr get(llvm::Constant* c) { return OffsetValArena::current().getConst(c->getUniqueInteger()); }
+      static OffsetValPtr get(const llvm::APInt& a) { return OffsetValArena::current().getConst(a); }
+      static OffsetValPtr get(int i) { return OffsetValArena::current().getConst(llvm::APInt(32, i, true)); }
       bool isConst() const {return true;}
       const llvm::APInt& constVal() const;
       const std::pair<llvm::APInt, llvm::APInt> constRange() const;
@@ -81,11 +237,14 @@ namespace gpucheck {
    * OffsetVal specialization for runtime-known values
    */
   class InstOffsetVal : public OffsetVal {
-    public:
-      const llvm::Instruction* inst;
+    private:
       InstOffsetVal(llvm::Instruction* i) : OffsetVal(OV_Inst), inst(i) {
         assert(i != nullptr);
       }
+      friend class OffsetValArena;
+    public:
+      const llvm::Instruction* inst;
+      static OffsetValPtr get(llvm::Instruction* i) { return OffsetValArena::current().getInst(i); }
       bool isConst() const {return false;}
       const llvm::APInt& constVal() const;
       const std::pair<llvm::APInt, llvm::APInt> constRange() const;
@@ -98,11 +257,14 @@ namespace gpucheck {
    * OffsetVal specialization for function parameters
    */
   class ArgOffsetVal : public OffsetVal {
-    public:
-      const llvm::Argument* arg;
+    private:
       ArgOffsetVal(llvm::Argument* a) : OffsetVal(OV_Arg), arg(a) {
         assert(a != nullptr);
       }
+      friend class OffsetValArena;
+    public:
+      const llvm::Argument* arg;
+      static OffsetValPtr get(llvm::Argument* a) { return OffsetValArena::current().getArg(a); }
       bool isConst() const {return false;}
       const llvm::APInt& constVal() const;
       const std::pair<llvm::APInt, llvm::APInt> constRange() const;
@@ -117,11 +279,13 @@ namespace gpucheck {
    */
   class UnknownOffsetVal : public OffsetVal {
     private:
-    public:
-      const llvm::Value* cause;
       UnknownOffsetVal(llvm::Value* v) : OffsetVal(OV_Unk), cause(v) {
         assert(v != nullptr);
       }
+      friend class OffsetValArena;
+    public:
+      const llvm::Value* cause;
+      static OffsetValPtr get(llvm::Value* v) { return OffsetValArena::current().getUnknown(v); }
       bool isConst() const {return false;}
       const llvm::APInt& constVal() const;
       const std::pair<llvm::APInt, llvm::APInt> constRange() const;
@@ -133,45 +297,28 @@ namespace gpucheck {
   /**
    * OffsetVal specialization for binary compound values
    */
-  enum OffsetOperator {
-    Add,
-    Sub,
-    Mul,
-    SDiv,
-    UDiv,
-    SRem,
-    URem,
-    And,
-    Or,
-    Xor,
-    Eq,
-    Neq,
-    SLT,
-    SLE,
-    SGT,
-    SGE,
-    ULT,
-    ULE,
-    UGT,
-    UGE,
-    end
-  };
-
   class BinOpOffsetVal : public OffsetVal {
     private:
       const std::string getPrintOp() const;
-
-    public:
-      const OffsetValPtr lhs;
-      const OffsetValPtr rhs;
-      const OffsetOperator op;
       BinOpOffsetVal(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs) :
-        OffsetVal(OV_BinOp), lhs(lhs), rhs(rhs), op(op) {
+        OffsetVal(OV_BinOp), op(op), lhs(lhs), rhs(rhs) {
           assert(lhs != nullptr);
           assert(rhs != nullptr);
           assert(op != OffsetOperator::end);
         }
-      bool isConst() const;
+      friend class OffsetValArena;
+
+    public:
+      const OffsetOperator op;
+      const OffsetValPtr lhs;
+      const OffsetValPtr rhs;
+      /**
+       * Returns the uniqued (lhs op rhs), folded to a constant when possible
+       */
+      static OffsetValPtr get(OffsetValPtr lhs, OffsetOperator op, OffsetValPtr rhs) {
+        return OffsetValArena::current().getBinOp(lhs, op, rhs);
+      }
+      bool isConst() const {return false;}
       bool isCompare() const;
       const llvm::APInt& constVal() const;
       const std::pair<llvm::APInt, llvm::APInt> constRange() const;
@@ -179,5 +326,19 @@ namespace gpucheck {
 
       static bool classof(const OffsetVal *ov) { return ov->getKind() == OV_BinOp; }
   };
+
+  /**
+   * Fold (lhs op rhs) for constant operands. Returns false if the
+   * operation cannot be evaluated, such as division by zero.
+   */
+  bool foldConstantOp(const llvm::APInt& lhs, OffsetOperator op, const llvm::APInt& rhs, llvm::APInt& out);
+}
+
+namespace std {
+  template<> struct hash<gpucheck::OffsetValPtr> {
+    size_t operator()(const gpucheck::OffsetValPtr& ov) const {
+      return std::hash<uint32_t>()(ov.getHandle());
+    }
+  };
 }
 #endif
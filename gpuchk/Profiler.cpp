@@ -0,0 +1,375 @@
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Profiler.h"
+#include "BugEmitter.h"
+#include "Utilities.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+using namespace gpucheck;
+
+static cl::opt<string> TraceFilename("profile-trace", cl::init(""),
+    cl::desc("Write a Chrome trace of every analysis query to this file"),
+    cl::value_desc("filename"));
+
+static cl::opt<bool> PrintSummary("profile-summary", cl::init(false),
+    cl::desc("Print where each kernel's analysis time went"));
+
+static const char *const PhaseNames[NumProfilePhases] = {
+  "construct",
+  "contexts",
+  "simplify",
+  "lanes"
+};
+
+// Node counts are bucketed by the next power of two, up to 2^31
+static const unsigned NumBuckets = 32;
+// Phase spans kept per query for the trace; time is still charged past it
+static const unsigned MaxSpans = 1024;
+
+namespace {
+  typedef chrono::steady_clock Clock;
+
+  struct PhaseSpan {
+    ProfilePhase phase;
+    uint64_t start;
+    uint64_t end;
+  };
+
+  struct TraceEvent {
+    string name;
+    const char *category;
+    uint64_t start;
+    uint64_t duration;
+    unsigned thread;
+    string function;
+    string instruction;
+    string location;
+    // Which tier answered a query, NumAnalysisTiers if none said
+    AnalysisTier tier;
+    bool conservative;
+  };
+
+  /**
+   * Everything recorded for the kernels of one pass
+   */
+  struct KernelProfile {
+    uint64_t queries = 0;
+    uint64_t total = 0;
+    uint64_t phases[NumProfilePhases] = {};
+    uint64_t buckets[NumProfilePhases][NumBuckets] = {};
+    uint64_t tiers[NumAnalysisTiers] = {};
+    uint64_t conservative = 0;
+    uint64_t slowest = 0;
+    string slowestInstruction;
+  };
+
+  struct ProfileData {
+    mutex lock;
+    vector<TraceEvent> events;
+    map<pair<const Function *, string>, KernelProfile> kernels;
+  };
+}
+
+/**
+ * The query being timed on one thread
+ */
+struct QueryProfile::Record {
+  const char *pass;
+  Instruction *inst;
+  uint64_t start;
+  uint64_t phases[NumProfilePhases];
+  uint64_t buckets[NumProfilePhases][NumBuckets];
+  vector<PhaseSpan> spans;
+  AnalysisTier tier;
+  bool conservative;
+};
+
+static ProfileData& getProfileData() {
+  static ProfileData data;
+  return data;
+}
+
+// Nanoseconds since the first time was taken
+static uint64_t now() {
+  static const Clock::time_point epoch = Clock::now();
+  return chrono::duration_cast<chrono::nanoseconds>(Clock::now() - epoch).count();
+}
+
+static atomic<unsigned> nextThread(1);
+static thread_local unsigned threadNumber = 0;
+static thread_local QueryProfile::Record *currentQuery = nullptr;
+static thread_local PhaseTimer *currentPhase = nullptr;
+
+bool gpucheck::isProfiling() {
+  return PrintSummary || !TraceFilename.empty();
+}
+
+QueryProfile::QueryProfile(const char *pass, Instruction *I) {
+  // Nested queries are charged to the outermost
+  if(!isProfiling() || currentQuery)
+    return;
+  if(!threadNumber)
+    threadNumber = nextThread++;
+  record.reset(new Record());
+  record->pass = pass;
+  record->inst = I;
+  record->tier = NumAnalysisTiers;
+  record->conservative = false;
+  for(unsigned p=0; p<NumProfilePhases; p++) {
+    record->phases[p] = 0;
+    for(unsigned b=0; b<NumBuckets; b++)
+      record->buckets[p][b] = 0;
+  }
+  currentQuery = record.get();
+  record->start = now();
+}
+
+static string describe(Instruction *I) {
+  string text;
+  raw_string_ostream out(text);
+  out << *I;
+  out.flush();
+  size_t first = text.find_first_not_of(' ');
+  text = text.substr(first == string::npos ? 0 : first);
+  if(text.size() > 160)
+    text = text.substr(0, 157) + "...";
+  return text;
+}
+
+static string locate(Instruction *I) {
+  DILocation *Loc = I->getDebugLoc();
+  if(!Loc)
+    return "";
+  return (Loc->getFilename() + ":" + Twine(Loc->getLine())).str();
+}
+
+QueryProfile::~QueryProfile() {
+  if(!record)
+    return;
+  uint64_t end = now();
+  currentQuery = nullptr;
+
+  Function *F = record->inst->getParent()->getParent();
+  string function = F->getName().str();
+  string instruction = describe(record->inst);
+  string location = locate(record->inst);
+
+  ProfileData& data = getProfileData();
+  lock_guard<mutex> guard(data.lock);
+  if(!TraceFilename.empty()) {
+    data.events.push_back(TraceEvent{string(record->pass) + " " + record->inst->getOpcodeName(),
+        "query", record->start, end - record->start, threadNumber, function, instruction, location,
+        record->tier, record->conservative});
+    for(auto s=record->spans.begin(),e=record->spans.end(); s!=e; ++s)
+      data.events.push_back(TraceEvent{PhaseNames[s->phase], "phase", s->start,
+          s->end - s->start, threadNumber, "", "", "", NumAnalysisTiers, false});
+  }
+
+  if(!PrintSummary)
+    return;
+  KernelProfile& kernel = data.kernels[make_pair(F, string(record->pass))];
+  kernel.queries++;
+  kernel.total += end - record->start;
+  for(unsigned p=0; p<NumProfilePhases; p++) {
+    kernel.phases[p] += record->phases[p];
+    for(unsigned b=0; b<NumBuckets; b++)
+      kernel.buckets[p][b] += record->buckets[p][b];
+  }
+  if(record->tier != NumAnalysisTiers)
+    kernel.tiers[record->tier]++;
+  if(record->conservative)
+    kernel.conservative++;
+  if(end - record->start > kernel.slowest) {
+    kernel.slowest = end - record->start;
+    kernel.slowestInstruction = instruction;
+    if(!location.empty())
+      kernel.slowestInstruction += " (" + location + ")";
+  }
+}
+
+PhaseTimer::PhaseTimer(ProfilePhase phase) : phase(phase), start(0), outer(nullptr) {
+  active = currentQuery != nullptr;
+  if(!active)
+    return;
+  start = now();
+  outer = currentPhase;
+  if(outer)
+    outer->charge(start);
+  currentPhase = this;
+}
+
+PhaseTimer::~PhaseTimer() {
+  if(!active)
+    return;
+  uint64_t end = now();
+  charge(end);
+  currentPhase = outer;
+  if(outer)
+    outer->start = end;
+}
+
+void PhaseTimer::charge(uint64_t end) {
+  // The query may have ended first if the timer outlives it
+  if(!currentQuery || end <= start)
+    return;
+  currentQuery->phases[phase] += end - start;
+  if(currentQuery->spans.size() < MaxSpans)
+    currentQuery->spans.push_back(PhaseSpan{phase, start, end});
+  start = end;
+}
+
+void gpucheck::profileExpression(ProfilePhase phase, const OffsetValPtr& expr) {
+  if(!currentQuery || !expr)
+    return;
+
+  // Nodes are shared, so count each once
+  DenseSet<OffsetValPtr> seen;
+  vector<OffsetValPtr> stack(1, expr);
+  while(!stack.empty()) {
+    OffsetValPtr node = stack.back();
+    stack.pop_back();
+    if(!seen.insert(node).second)
+      continue;
+    if(auto binop=dyn_cast<BinOpOffsetVal>(&*node)) {
+      stack.push_back(binop->lhs);
+      stack.push_back(binop->rhs);
+    }
+  }
+  unsigned bucket = Log2_32_Ceil(seen.size());
+  if(bucket >= NumBuckets)
+    bucket = NumBuckets - 1;
+  currentQuery->buckets[phase][bucket]++;
+}
+
+void gpucheck::profileResult(const QueryResult& result) {
+  if(!currentQuery)
+    return;
+  currentQuery->tier = result.tier;
+  currentQuery->conservative = result.conservative;
+}
+
+static void printMillis(raw_ostream& out, uint64_t nanos) {
+  out << format("%10.3f", nanos / 1e6);
+}
+
+static void printSummary(raw_ostream& out, Module &M, const char *pass,
+    map<pair<const Function *, string>, KernelProfile>& kernels) {
+  KernelProfile all;
+  out << "Profile of " << pass << " (ms):\n";
+  out << "  " << left_justify("kernel", 24) << right_justify("queries", 8)
+      << right_justify("total", 10);
+  for(unsigned p=0; p<NumProfilePhases; p++)
+    out << right_justify(PhaseNames[p], 10);
+  out << "\n";
+
+  for(auto f=M.begin(),e=M.end(); f!=e; ++f) {
+    auto found = kernels.find(make_pair((const Function *)&*f, string(pass)));
+    if(found == kernels.end())
+      continue;
+    KernelProfile& kernel = found->second;
+    out << format("  %-24s%8llu", f->getName().str().c_str(), (unsigned long long)kernel.queries);
+    printMillis(out, kernel.total);
+    for(unsigned p=0; p<NumProfilePhases; p++)
+      printMillis(out, kernel.phases[p]);
+    out << "\n";
+    out << format("    slowest, %.3f: ", kernel.slowest / 1e6) << kernel.slowestInstruction << "\n";
+    out << "    answered by";
+    for(unsigned t=0; t<NumAnalysisTiers; t++)
+      out << (t ? ", " : " ") << getTierName((AnalysisTier)t) << " " << kernel.tiers[t];
+    out << "; " << kernel.conservative << " conservative\n";
+
+    for(unsigned p=0; p<NumProfilePhases; p++) {
+      for(unsigned b=0; b<NumBuckets; b++)
+        all.buckets[p][b] += kernel.buckets[p][b];
+    }
+    kernels.erase(found);
+  }
+
+  // Histogram of expression sizes, up to the largest bucket used
+  unsigned used = 0;
+  for(unsigned p=0; p<NumProfilePhases; p++) {
+    for(unsigned b=0; b<NumBuckets; b++) {
+      if(all.buckets[p][b])
+        used = max(used, b + 1);
+    }
+  }
+  if(!used)
+    return;
+  out << "  expression nodes, up to\n";
+  out << "  " << left_justify("", 12);
+  for(unsigned b=0; b<used; b++)
+    out << format("%8llu", 1ull << b);
+  out << "\n";
+  for(unsigned p=0; p<NumProfilePhases; p++) {
+    // Not every phase produces an expression
+    bool any = false;
+    for(unsigned b=0; b<used; b++)
+      any |= all.buckets[p][b] != 0;
+    if(!any)
+      continue;
+    out << "  " << left_justify(PhaseNames[p], 12);
+    for(unsigned b=0; b<used; b++)
+      out << format("%8llu", (unsigned long long)all.buckets[p][b]);
+    out << "\n";
+  }
+}
+
+static void writeTrace(const vector<TraceEvent>& events) {
+  error_code EC;
+  raw_fd_ostream out(TraceFilename, EC, sys::fs::F_Text);
+  if(EC) {
+    errs() << "gpucheck: " << TraceFilename << ": " << EC.message() << "\n";
+    return;
+  }
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  for(auto e=events.begin(),ee=events.end(); e!=ee; ++e) {
+    out << "{\"name\": ";
+    printJSONString(out, e->name);
+    out << ", \"cat\": \"" << e->category << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e->thread
+        << ", \"ts\": " << format("%.3f", e->start / 1e3)
+        << ", \"dur\": " << format("%.3f", e->duration / 1e3);
+    if(!e->function.empty()) {
+      out << ", \"args\": {\"function\": ";
+      printJSONString(out, e->function);
+      out << ", \"instruction\": ";
+      printJSONString(out, e->instruction);
+      out << ", \"location\": ";
+      printJSONString(out, e->location);
+      if(e->tier != NumAnalysisTiers)
+        out << ", \"tier\": \"" << getTierName(e->tier) << "\", \"conservative\": "
+            << (e->conservative ? "true" : "false");
+      out << "}";
+    }
+    out << (e + 1 != ee ? "},\n" : "}\n");
+  }
+  out << "]}\n";
+}
+
+void gpucheck::reportProfile(Module &M, const char *pass) {
+  if(!isProfiling())
+    return;
+  ProfileData& data = getProfileData();
+  lock_guard<mutex> guard(data.lock);
+  // Structured warnings are for other tools to read, so keep it out of them
+  if(PrintSummary)
+    printSummary(isStructuredOutput() ? errs() : getWarningStream(), M, pass, data.kernels);
+  if(!TraceFilename.empty())
+    writeTrace(data.events);
+}
@@ -0,0 +1,86 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Instruction.h"
+#include "OffsetVal.h"
+#include "QueryBudget.h"
+
+#include <cstdint>
+#include <memory>
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+namespace gpucheck {
+
+  /**
+   * The phases one query, such as one access or branch, spends its time in
+   */
+  enum ProfilePhase {
+    PhaseConstruct,  // Building the offset expression from the IR
+    PhaseContexts,   // Expanding it into its calling and grid contexts
+    PhaseSimplify,   // Rewriting it into a simpler form
+    PhaseLanes,      // Evaluating it for each lane of each warp
+    NumProfilePhases
+  };
+
+  /**
+   * Whether -profile-trace or -profile-summary asked for profiling. Without
+   * either, the timers below do nothing.
+   */
+  extern bool isProfiling();
+
+  /**
+   * Times one query from construction to destruction, on one thread. The
+   * phases timed on that thread meanwhile are charged to it.
+   */
+  class QueryProfile {
+    public:
+      QueryProfile(const char *pass, llvm::Instruction *I);
+      ~QueryProfile();
+      QueryProfile(const QueryProfile&) = delete;
+      QueryProfile& operator=(const QueryProfile&) = delete;
+
+      // The query's timings, defined alongside the profiler
+      struct Record;
+
+    private:
+      std::unique_ptr<Record> record;
+  };
+
+  /**
+   * Times one phase of the current query. A phase timed within another
+   * pauses the outer one, so each moment is charged to a single phase.
+   */
+  class PhaseTimer {
+    public:
+      PhaseTimer(ProfilePhase phase);
+      ~PhaseTimer();
+      PhaseTimer(const PhaseTimer&) = delete;
+      PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    private:
+      ProfilePhase phase;
+      uint64_t start;
+      PhaseTimer *outer;
+      bool active;
+
+      void charge(uint64_t now);
+  };
+
+  /**
+   * Count the nodes of an expression produced by phase, for the histograms
+   */
+  extern void profileExpression(ProfilePhase phase, const OffsetValPtr& expr);
+
+  /**
+   * Record which tier answered the current query, and whether conservatively
+   */
+  extern void profileResult(const QueryResult& result);
+
+  /**
+   * Print a summary table of the kernels of M profiled under pass to the
+   * warning stream, and rewrite the trace file with every query so far
+   */
+  extern void reportProfile(llvm::Module &M, const char *pass);
+}
+
+#endif
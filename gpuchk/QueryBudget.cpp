@@ -0,0 +1,106 @@
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "QueryBudget.h"
+
+#include <string>
+
+using namespace std;
+using namespace llvm;
+using namespace gpucheck;
+
+#define DEBUG_TYPE "query-budget"
+
+STATISTIC(BudgetsExhausted, "Number of queries which ran out of budget");
+
+static cl::opt<unsigned> NodeBudget("query-node-budget", cl::init(1 << 22),
+    cl::desc("Expression nodes one query may rewrite before it falls back to "
+             "a conservative answer (0 for no limit)"));
+
+static cl::opt<unsigned> TimeBudget("query-time-budget", cl::init(0),
+    cl::desc("Milliseconds one query may take before it falls back to a "
+             "conservative answer (0 for no limit)"));
+
+static cl::opt<AnalysisTier> MaxTier("max-analysis-tier", cl::init(TierEnumerate),
+    cl::desc("Most expensive analysis a query may escalate to"),
+    cl::values(clEnumValN(TierLattice, "lattice", "Thread dependence only"),
+               clEnumValN(TierSymbolic, "symbolic", "Closed forms and per-lane evaluation"),
+               clEnumValN(TierEnumerate, "enumerate", "Cancel the difference of every lane")));
+
+// The clock is read once per this many nodes
+static const unsigned ClockInterval = 64;
+
+static thread_local QueryBudget *currentBudget = nullptr;
+static thread_local unsigned timeouts = 0;
+
+const char *gpucheck::getTierName(AnalysisTier tier) {
+  switch(tier) {
+    case TierLattice: return "lattice";
+    case TierSymbolic: return "symbolic";
+    case TierEnumerate: return "enumerate";
+    default: return "unknown";
+  }
+}
+
+AnalysisTier gpucheck::getMaxAnalysisTier() {
+  return MaxTier;
+}
+
+string gpucheck::getBudgetOptions() {
+  return "nodes=" + to_string(NodeBudget) + " ms=" + to_string(TimeBudget) +
+    " tier=" + getTierName(MaxTier);
+}
+
+string QueryResult::caveat() const {
+  if(tier != TierLattice)
+    return "";
+  return " (conservative, analysis limited to the lattice tier)";
+}
+
+QueryBudget::QueryBudget() : spent(false), nodes(0), nodeLimit(NodeBudget), timed(TimeBudget != 0),
+    outOfTime(false) {
+  active = currentBudget == nullptr;
+  if(!active)
+    return;
+  if(timed)
+    deadline = Clock::now() + chrono::milliseconds(TimeBudget);
+  currentBudget = this;
+}
+
+QueryBudget::~QueryBudget() {
+  if(!active)
+    return;
+  if(spent)
+    ++BudgetsExhausted;
+  if(outOfTime)
+    timeouts++;
+  currentBudget = nullptr;
+}
+
+bool QueryBudget::exhausted() const {
+  return active ? spent : currentExhausted();
+}
+
+bool QueryBudget::chargeNodes(uint64_t count) {
+  if(spent)
+    return false;
+  uint64_t before = nodes;
+  nodes += count;
+  if(nodeLimit && nodes > nodeLimit)
+    spent = true;
+  else if(timed && nodes / ClockInterval != before / ClockInterval && Clock::now() > deadline)
+    spent = outOfTime = true;
+  return !spent;
+}
+
+bool QueryBudget::charge(uint64_t count) {
+  return currentBudget ? currentBudget->chargeNodes(count) : true;
+}
+
+bool QueryBudget::currentExhausted() {
+  return currentBudget ? currentBudget->spent : false;
+}
+
+unsigned QueryBudget::getTimeouts() {
+  return timeouts;
+}
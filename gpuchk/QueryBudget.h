@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#ifndef QUERY_BUDGET_H
+#define QUERY_BUDGET_H
+
+namespace gpucheck {
+
+  /**
+   * The tiers a query escalates through, cheapest first. Each is tried only
+   * if the ones before it could not answer, and only up to the tier allowed
+   * by -max-analysis-tier.
+   */
+  enum AnalysisTier {
+    TierLattice,    // The thread dependence lattice alone, always conservative
+    TierSymbolic,   // Offset expressions solved in closed form or per lane
+    TierEnumerate,  // Differences between lanes cancelled one at a time
+    NumAnalysisTiers
+  };
+
+  extern const char *getTierName(AnalysisTier tier);
+
+  /**
+   * The highest tier queries may escalate to, from -max-analysis-tier
+   */
+  extern AnalysisTier getMaxAnalysisTier();
+
+  /**
+   * The budget and tier settings, for keying cached warnings
+   */
+  extern std::string getBudgetOptions();
+
+  /**
+   * The answer to one query, with the tier which produced it. A conservative
+   * answer is an upper bound on the cost, not the cost itself.
+   */
+  struct QueryResult {
+    float value;
+    AnalysisTier tier;
+    bool conservative;
+
+    QueryResult(float value, AnalysisTier tier, bool conservative)
+      : value(value), tier(tier), conservative(conservative) {}
+
+    /**
+     * Text to append to a warning drawn from this result, empty unless the
+     * query never got past the lattice
+     */
+    std::string caveat() const;
+  };
+
+  /**
+   * Bounds the work of the current query on this thread, from construction
+   * to destruction. The OffsetOps rewrites charge each node they visit and
+   * each term a polynomial expands into, and once -query-node-budget nodes
+   * or -query-time-budget milliseconds are spent, return their input
+   * unchanged without memoizing anything. The query should then check
+   * exhausted() and fall back to a lower tier, since whatever it computed
+   * since is incomplete.
+   *
+   * Nested budgets share the outermost one.
+   */
+  class QueryBudget {
+    public:
+      QueryBudget();
+      ~QueryBudget();
+      QueryBudget(const QueryBudget&) = delete;
+      QueryBudget& operator=(const QueryBudget&) = delete;
+
+      bool exhausted() const;
+
+      // Charge nodes to the current thread's budget, if it has one
+      static bool charge(uint64_t count = 1);
+      static bool currentExhausted();
+
+      /**
+       * Number of queries on this thread which ran out of time. Their
+       * answers depend on how fast the machine was, so shouldn't be kept.
+       */
+      static unsigned getTimeouts();
+
+    private:
+      typedef std::chrono::steady_clock Clock;
+
+      bool active;
+      bool spent;
+      uint64_t nodes;
+      uint64_t nodeLimit;
+      bool timed;
+      bool outOfTime;
+      Clock::time_point deadline;
+
+      bool chargeNodes(uint64_t count);
+  };
+}
+
+#endif
@@ -0,0 +1,71 @@
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "SourceCache.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+namespace {
+  /**
+   * One source file, and the offset each of its lines starts at
+   */
+  struct SourceFile {
+    unique_ptr<MemoryBuffer> buffer;
+    vector<size_t> lineStarts;
+
+    SourceFile(unique_ptr<MemoryBuffer> buf) : buffer(move(buf)) {
+      StringRef contents = buffer->getBuffer();
+      if(contents.empty())
+        return;
+      lineStarts.push_back(0);
+      for(size_t nl = contents.find('\n'); nl != StringRef::npos; nl = contents.find('\n', nl + 1)) {
+        // A final newline ends the last line rather than starting another
+        if(nl + 1 < contents.size())
+          lineStarts.push_back(nl + 1);
+      }
+    }
+
+    bool getLine(unsigned lineNumber, StringRef& text) const {
+      if(lineNumber == 0 || lineNumber > lineStarts.size())
+        return false;
+      StringRef contents = buffer->getBuffer();
+      size_t start = lineStarts[lineNumber - 1];
+      size_t end;
+      if(lineNumber < lineStarts.size())
+        end = lineStarts[lineNumber] - 1;
+      else
+        end = contents.back() == '\n' ? contents.size() - 1 : contents.size();
+      text = contents.slice(start, end);
+      return true;
+    }
+  };
+}
+
+bool gpucheck::getSourceLine(StringRef filename, unsigned lineNumber, StringRef& text) {
+  static mutex lock;
+  // Files which could not be read are kept as null, so they are tried once
+  static StringMap<unique_ptr<SourceFile>> files;
+
+  const SourceFile *file;
+  {
+    lock_guard<mutex> guard(lock);
+    auto found = files.find(filename);
+    if(found == files.end()) {
+      // Large files are mapped rather than read
+      ErrorOr<unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(filename, -1, false);
+      unique_ptr<SourceFile> loaded;
+      if(buf)
+        loaded.reset(new SourceFile(move(*buf)));
+      found = files.insert(make_pair(filename, move(loaded))).first;
+    }
+    file = found->second.get();
+  }
+  // Files are never changed once indexed, so may be read unlocked
+  return file && file->getLine(lineNumber, text);
+}
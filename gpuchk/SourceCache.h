@@ -0,0 +1,19 @@
+#include "llvm/ADT/StringRef.h"
+
+#ifndef SOURCE_CACHE_H
+#define SOURCE_CACHE_H
+
+namespace gpucheck {
+
+  /**
+   * Set text to line lineNumber, counted from 1, of filename, without its
+   * newline. Returns false if the file cannot be read or is shorter.
+   *
+   * Each file is mapped into memory and indexed by line the first time it
+   * is asked for, and kept for the rest of the run, so text stays valid and
+   * later lines are found directly. Safe to call from several threads.
+   */
+  extern bool getSourceLine(llvm::StringRef filename, unsigned lineNumber, llvm::StringRef& text);
+}
+
+#endif
@@ -11,10 +11,10 @@
 #include "llvm/IR/Intrinsics.h"
 
 #include "Utilities.h"
+#include "DominatorLCA.h"
+#include "CallGraphSCCs.h"
 #include "ThreadDepAnalysis.h"
 
-#include <unordered_map>
-#include <queue>
 #include <utility>
 
 using namespace std;
@@ -25,15 +25,140 @@ using namespace gpucheck;
 
 void ThreadDependence::getAnalysisUsage(AnalysisUsage& AU) const {
   AU.setPreservesAll();
-  AU.addRequired<DominatorTreeWrapperPass>();
 }
 
-bool ThreadDependence::isDependent(Value *v) {
-  return taint[v];
+ThreadDependence::FunctionInfo& ThreadDependence::getInfo(Function &F) {
+  unique_ptr<FunctionInfo>& info = infos[&F];
+  if(!info) {
+    info.reset(new FunctionInfo());
+    unsigned id = 0;
+    for(auto arg=F.arg_begin(),e=F.arg_end(); arg!=e; ++arg)
+      info->ids[&*arg] = id++;
+    for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+      for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
+        info->ids[&*i] = id++;
+      }
+    }
+
+    // Built here rather than requested from the pass manager, which only
+    // keeps one function's analyses alive while callees are summarized
+    DominatorTree DT(F);
+    DominatorLCA LCA(DT);
+
+    SmallVector<Value *, 8> conds;
+    vector<BasicBlock *> rets;
+    for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+      if(auto PHI=dyn_cast<PHINode>(&b->front())) {
+        SmallVector<BasicBlock *, 8> incoming(PHI->block_begin(), PHI->block_end());
+        conds.clear();
+        LCA.getControllingConditions(incoming, conds);
+        info->joinConditions[&*b].assign(conds.begin(), conds.end());
+      }
+      if(isa<ReturnInst>(b->getTerminator()))
+        rets.push_back(&*b);
+    }
+    conds.clear();
+    LCA.getControllingConditions(rets, conds);
+    info->returnConditions.assign(conds.begin(), conds.end());
+  }
+  return *info;
+}
+
+ThreadDependence::TaintSet ThreadDependence::emptyTaint(Function &F) {
+  TaintSet taintSet;
+  taintSet.info = &getInfo(F);
+  taintSet.local.resize(taintSet.info->ids.size());
+  return taintSet;
+}
+
+bool ThreadDependence::TaintSet::test(const Value *v) const {
+  auto id = info->ids.find(v);
+  if(id != info->ids.end())
+    return local[id->second];
+  // Locals of other functions are never tainted from here
+  if(isa<Instruction>(v) || isa<Argument>(v))
+    return false;
+  return nonLocal.count(v);
+}
+
+void ThreadDependence::TaintSet::set(const Value *v, bool tainted) {
+  auto id = info->ids.find(v);
+  if(id != info->ids.end()) {
+    local[id->second] = tainted;
+  } else if(!isa<Instruction>(v) && !isa<Argument>(v)) {
+    if(tainted)
+      nonLocal.insert(v);
+    else
+      nonLocal.erase(v);
+  }
+}
+
+void ThreadDependence::TaintSet::merge(const TaintSet& other) {
+  assert(info == other.info && "Merging taint of different functions");
+  local |= other.local;
+  for(auto v=other.nonLocal.begin(),e=other.nonLocal.end(); v!=e; ++v)
+    nonLocal.insert(*v);
+}
+
+void ThreadDependence::Worklist::push(Value *v) {
+  // Already waiting, or belongs to another function
+  if(queued.test(v) || (!queued.info->ids.count(v) && (isa<Instruction>(v) || isa<Argument>(v))))
+    return;
+  queued.set(v, true);
+  pending.push_back(v);
+}
+
+Value *ThreadDependence::Worklist::pop() {
+  Value *v = pending.front();
+  pending.pop_front();
+  queued.set(v, false);
+  return v;
+}
+
+bool ThreadDependence::isDependent(const Value *v) const {
+  const Function *F = nullptr;
+  if(auto I=dyn_cast<Instruction>(v))
+    F = I->getParent()->getParent();
+  else if(auto A=dyn_cast<Argument>(v))
+    F = A->getParent();
+  else
+    return nonLocalTaint.count(v);
+
+  auto found = taint.find(F);
+  return found != taint.end() && found->second.test(v);
 }
 
 bool ThreadDependence::runOnModule(Module &M) {
   taint.clear();
+  nonLocalTaint.clear();
+  infos.clear();
+  returns.clear();
+  contexts.clear();
+
+  DenseMap<const Function *, vector<const CallInst *>> callers;
+  for(auto F=M.begin(),e=M.end(); F!=e; ++F) {
+    for(auto b=F->begin(),e=F->end(); b!=e; ++b) {
+      for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
+        if(auto CI=dyn_cast<CallInst>(&*i)) {
+          if(const Function *callee = getCalleeThroughCasts(CI))
+            callers[callee].push_back(CI);
+        }
+      }
+    }
+  }
+
+  // Callees first, so every call is answered by a finished summary
+  CallGraphSCCs graph(M, callers);
+  for(auto scc=graph.sccs.begin(),e=graph.sccs.end(); scc!=e; ++scc) {
+    bool recursive = scc->size() > 1;
+    auto sites = callers.find(scc->front());
+    if(!recursive && sites != callers.end()) {
+      for(auto ci=sites->second.begin(),e=sites->second.end(); ci!=e; ++ci)
+        recursive |= (*ci)->getParent()->getParent() == scc->front();
+    }
+    summarizeReturns(*scc, recursive);
+  }
+
   for(auto F=M.begin(),e=M.end(); F!=e; ++F) {
     if(isKernelFunction(*F)) {
       // Run directly over all kernels
@@ -41,27 +166,32 @@ bool ThreadDependence::runOnModule(Module &M) {
     }
   }
 
-  // Merge all callsite taint
-  for(auto ctaint=callTaint.begin(),e=callTaint.end(); ctaint!=e; ++ctaint) {
-    for(auto t=ctaint->second.begin(),e=ctaint->second.end(); t!=e; ++t) {
-      taint[t->first] |= t->second;
-    }
+  // Merge the taint of every context each function was reached in
+  for(auto c=contexts.begin(),e=contexts.end(); c!=e; ++c) {
+    const TaintSet& fTaint = c->second;
+    auto merged = taint.find(c->first.first);
+    if(merged == taint.end())
+      taint.insert(make_pair(c->first.first, fTaint));
+    else
+      merged->second.merge(fTaint);
+    for(auto v=fTaint.nonLocal.begin(),e=fTaint.nonLocal.end(); v!=e; ++v)
+      nonLocalTaint.insert(*v);
   }
+  contexts.clear();
+  returns.clear();
   return false;
 }
 
 bool ThreadDependence::runOnFunction(Function &F) {
 
-  // Initialize ourselves
-  for(auto v=F.arg_begin(),e=F.arg_end(); v!=e; ++v)
-    taint[&*v]=false; // Kernel parameters aren't tainted
-
-  functionTainted(F,taint);
+  // Kernel parameters aren't tainted
+  analyzeContexts(F);
 
   DEBUG(
+    const TaintSet& fTaint = contexts.find(ContextKey(&F, ArgMask(F.arg_size(), false)))->second;
     for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
       for(auto i=b->begin(),e=b->end(); i!=e; ++i) {
-        errs() << (taint[&*i] ? "Thread-Dependent" : "Thread-Constant ") << " - ";
+        errs() << (fTaint.test(&*i) ? "Thread-Dependent" : "Thread-Constant ") << " - ";
         i->dump();
         errs() << "\n";
       }
@@ -71,9 +201,124 @@ bool ThreadDependence::runOnFunction(Function &F) {
   return false;
 }
 
-bool ThreadDependence::functionTainted(Function &F, unordered_map<Value *, bool>& taint) {
-  queue<Value *> worklist;
-  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+/**
+ * Finds when each function of an SCC returns a tainted value. Calls within
+ * the SCC start out assuming untainted returns, and are refined until none
+ * of those assumptions change, which only a recursive SCC needs.
+ */
+void ThreadDependence::summarizeReturns(const vector<const Function *>& scc, bool recursive) {
+  for(auto f=scc.begin(),e=scc.end(); f!=e; ++f) {
+    ReturnSummary& summary = returns[*f];
+    summary.always = false;
+    summary.args.assign((*f)->arg_size(), false);
+  }
+
+  bool changed;
+  do {
+    changed = false;
+    for(auto f=scc.begin(),e=scc.end(); f!=e; ++f) {
+      Function &F = const_cast<Function &>(**f);
+      if(F.empty())
+        continue;
+
+      ReturnSummary summary;
+      summary.always = taintedWith(F, ArgMask(F.arg_size(), false));
+      summary.args.assign(F.arg_size(), false);
+      // Each argument on its own only matters if some argument does
+      if(!summary.always && F.arg_size() && taintedWith(F, ArgMask(F.arg_size(), true))) {
+        for(unsigned i=0; i<F.arg_size(); i++) {
+          ArgMask mask(F.arg_size(), false);
+          mask[i] = true;
+          summary.args[i] = taintedWith(F, mask);
+        }
+      }
+
+      ReturnSummary& known = returns[&F];
+      if(known != summary) {
+        known = summary;
+        changed = true;
+      }
+    }
+  } while(changed && recursive);
+}
+
+/**
+ * Returns whether F's return value is tainted when called with the
+ * arguments in mask tainted, given the summaries found so far
+ */
+bool ThreadDependence::taintedWith(Function &F, const ArgMask& mask) {
+  TaintSet fTaint = emptyTaint(F);
+  unsigned i = 0;
+  for(auto param=F.arg_begin(),e=F.arg_end(); param!=e; ++param, ++i)
+    fTaint.set(&*param, mask[i]);
+  return functionTainted(F, fTaint);
+}
+
+bool ThreadDependence::returnTainted(const Function &F, const ArgMask& mask) const {
+  auto found = returns.find(&F);
+  if(found == returns.end())
+    return false;
+  if(found->second.always)
+    return true;
+  for(unsigned i=0; i<mask.size() && i<found->second.args.size(); i++) {
+    if(mask[i] && found->second.args[i])
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Finds the taint of every context reachable from the kernel, each
+ * computed once. Calls are answered from the return summaries, so the
+ * contexts are only queued here rather than entered.
+ */
+void ThreadDependence::analyzeContexts(Function &kernel) {
+  deque<ContextKey> pending;
+  ContextKey root(&kernel, ArgMask(kernel.arg_size(), false));
+  if(!contexts.count(root)) {
+    contexts.insert(make_pair(root, emptyTaint(kernel)));
+    pending.push_back(root);
+  }
+
+  while(!pending.empty()) {
+    ContextKey key = pending.front();
+    pending.pop_front();
+    Function &F = const_cast<Function &>(*key.first);
+
+    TaintSet fTaint = emptyTaint(F);
+    unsigned i = 0;
+    for(auto param=F.arg_begin(),e=F.arg_end(); param!=e; ++param, ++i)
+      fTaint.set(&*param, key.second[i]);
+    functionTainted(F, fTaint);
+
+    // Every call enters its callee with the arguments tainted here
+    for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+      for(auto inst=b->begin(),e=b->end(); inst!=e; ++inst) {
+        auto CI = dyn_cast<CallInst>(&*inst);
+        if(!CI)
+          continue;
+        Function *callee = const_cast<Function *>(getCalleeThroughCasts(CI));
+        if(!callee || callee->empty())
+          continue;
+        ArgMask mask(callee->arg_size(), false);
+        for(unsigned i=0; i<mask.size() && i<CI->getNumArgOperands(); i++)
+          mask[i] = fTaint.test(CI->getArgOperand(i));
+        ContextKey calleeKey(callee, mask);
+        if(!contexts.count(calleeKey)) {
+          contexts.insert(make_pair(calleeKey, emptyTaint(*callee)));
+          pending.push_back(calleeKey);
+        }
+      }
+    }
+
+    contexts.find(key)->second = std::move(fTaint);
+  }
+}
+
+bool ThreadDependence::functionTainted(Function &F, TaintSet& taintSet) {
+  Worklist worklist;
+  worklist.queued = emptyTaint(F);
+  const FunctionInfo& info = getInfo(F);
 
   // Everyone gets one look
   for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
@@ -83,44 +328,31 @@ bool ThreadDependence::functionTainted(Function &F, unordered_map<Value *, bool>
   }
 
   while(!worklist.empty()) {
-    Value *v = worklist.front();
-    worklist.pop();
-    update(v, isDependent(v, taint, DT), taint, worklist);
-  }
-
-  // Collect all the return nodes
-  vector<ReturnInst *> rets;
-  for(auto b=F.begin(),e=F.end();b!=e;++b) {
-    for(auto i=b->begin(),e=b->end();i!=e;++i) {
-      if(auto ret=dyn_cast<ReturnInst>(&*i)) {
-        rets.push_back(ret);
-      }
-    }
+    Value *v = worklist.pop();
+    update(v, isDependent(v, taintSet, info), taintSet, worklist);
   }
 
   // If any returns are directly tainted, return that
-  for(auto ret=rets.begin(),e=rets.end(); ret!=e; ++ret) {
-    if(taint[*ret]) return true;
+  for(auto b=F.begin(),e=F.end(); b!=e; ++b) {
+    if(auto ret=dyn_cast<ReturnInst>(b->getTerminator())) {
+      if(taintSet.test(ret)) return true;
+    }
   }
 
-  // If the any return is on a tainted control-flow path, return that
-  for(auto l=rets.begin(),e=rets.end(); l!=e; ++l) {
-    for(auto r=rets.begin(),e=rets.end(); r!=e; ++r) {
-      if(auto cond=getDominatingCondition(*l,*r,DT)) {
-        if(taint[cond])
-          return true;
-      }
-    }
+  // If the choice between returns is made on a tainted condition, return that
+  for(auto cond=info.returnConditions.begin(),e=info.returnConditions.end(); cond!=e; ++cond) {
+    if(taintSet.test(*cond))
+      return true;
   }
 
   return false;
 }
 
-void ThreadDependence::update(Value *v, bool newVal, unordered_map<Value *, bool>& taint, queue<Value *>& worklist) {
-  bool oldVal = taint[v];
-  taint[v] = newVal;
+void ThreadDependence::update(Value *v, bool newVal, TaintSet& taintSet, Worklist& worklist) {
+  bool oldVal = taintSet.test(v);
 
   if(newVal != oldVal) {
+    taintSet.set(v, newVal);
     DEBUG(
       errs() << "Update " << oldVal << "=>" << newVal << " for ";
       v->dump();
@@ -138,11 +370,26 @@ void ThreadDependence::update(Value *v, bool newVal, unordered_map<Value *, bool
   }
 }
 
-bool ThreadDependence::isDependent(Value *v, unordered_map<Value *, bool>& taint, DominatorTree *DT) {
+bool ThreadDependence::isDependent(Value *v, TaintSet& taintSet, const FunctionInfo& info) {
+  if(auto CI=dyn_cast<CallInst>(v)) {
+    const Function *F = getCalleeThroughCasts(CI);
+    if(F && !F->empty()) {
+      // Propagate args to formals
+      ArgMask mask(F->arg_size(), false);
+      for(unsigned i=0; i<mask.size() && i<CI->getNumArgOperands(); i++) {
+        mask[i] = taintSet.test(CI->getArgOperand(i));
+      }
+
+      // Apply the called function's summary
+      if(returnTainted(*F, mask))
+        return true;
+    }
+  }
+
   // If this value uses any tainted values, it's tainted
   if(auto user=dyn_cast<User>(v)) {
     for(auto op=user->op_begin(),e=user->op_end(); op!=e; ++op) {
-      if(taint[op->get()])
+      if(taintSet.test(op->get()))
         return true;
     }
   }
@@ -150,7 +397,7 @@ bool ThreadDependence::isDependent(Value *v, unordered_map<Value *, bool>& taint
   // If this value is the address of a tainted store, it's tainted
   for(auto u=v->use_begin(),e=v->use_end(); u!=e; ++u) {
     if(auto S=dyn_cast<StoreInst>(u->getUser())) {
-      if(taint[S]) {
+      if(taintSet.test(S)) {
         return true;
       }
     }
@@ -159,12 +406,11 @@ bool ThreadDependence::isDependent(Value *v, unordered_map<Value *, bool>& taint
   // Special-case PHI Nodes
   if(auto PHI=dyn_cast<PHINode>(v)) {
     // If the incoming path was selected on a control-flow dependent condition, then we're dependent
-    for(auto l=PHI->block_begin(),e=PHI->block_end(); l!=e; ++l) {
-      for(auto r=PHI->block_begin(),e=PHI->block_end(); r!=e; ++r) {
-        if(auto C=getDominatingCondition(*l,*r,DT)) {
-          if(taint[C]) {
-            return true;
-          }
+    auto conds = info.joinConditions.find(PHI->getParent());
+    if(conds != info.joinConditions.end()) {
+      for(auto C=conds->second.begin(),e=conds->second.end(); C!=e; ++C) {
+        if(taintSet.test(*C)) {
+          return true;
         }
       }
     }
@@ -182,29 +428,19 @@ bool ThreadDependence::isDependent(Value *v, unordered_map<Value *, bool>& taint
         default:
           break;
       }
-      // Not an intrinsic, but a real function call
-      if(!F->empty()) {
-        // Get the taint-map corresponding to this callsite
-        unordered_map<Value *, bool> ctaint = callTaint[CI];
-        auto arg=CI->arg_begin();
-
-        // Propagate args to formals
-        for(auto param=F->arg_begin(),e=F->arg_end(); param!=e; ++param) {
-          ctaint[&*param] = taint[arg->getUser()];
-          ++arg;
-        }
-
-        // Solve for the called function
-        return functionTainted(*F, ctaint);
-      }
     }
-
-    // Indirect call, abandon all hope here
   }
 
   return false;
 }
 
+AnalysisKey ThreadDependenceAnalysis::Key;
+
+ThreadDependenceAnalysis::Result ThreadDependenceAnalysis::run(Module &M, ModuleAnalysisManager &AM) {
+  Result TD(new ThreadDependence());
+  TD->runOnModule(M);
+  return TD;
+}
 
 char ThreadDependence::ID = 0;
 static RegisterPass<ThreadDependence> X("threaddep", "Flags thread-dependent values",
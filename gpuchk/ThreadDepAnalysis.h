@@ -1,11 +1,17 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
-#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 
-#include <queue>
-#include <unordered_map>
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #ifndef THREAD_DEP_H
 #define THREAD_DEP_H
@@ -21,17 +27,99 @@ namespace gpucheck {
     ThreadDependence() : ModulePass(ID) {}
     bool runOnModule(Module &M);
     bool runOnFunction(Function &F);
-    bool isDependent(Value *v);
+    bool isDependent(const Value *v) const;
 
     void getAnalysisUsage(AnalysisUsage &AU) const;
 
   private:
-    bool functionTainted(Function &F, unordered_map<Value *, bool>& taintMap);
-    void update(Value *v, bool newVal, unordered_map<Value *, bool>& taintMap, queue<Value *>& worklist);
-    bool isDependent(Value *v, unordered_map<Value *, bool>& taintMap, DominatorTree *DT);
+    /**
+     * Per-function state shared by every context it is analyzed in. The
+     * arguments and instructions are numbered densely, arguments first.
+     */
+    struct FunctionInfo {
+      DenseMap<const Value *, unsigned> ids;
+      // Conditions deciding which incoming block reaches each block's PHIs
+      DenseMap<const BasicBlock *, vector<Value *>> joinConditions;
+      // Conditions deciding which return is reached
+      vector<Value *> returnConditions;
+    };
 
-    unordered_map<Value *,bool> taint;
-    unordered_map<CallInst *,unordered_map<Value *, bool>> callTaint;
+    /**
+     * Taint of one function's values. Values without a number in the
+     * function, such as a global which is the address of a tainted store,
+     * are kept to the side.
+     */
+    struct TaintSet {
+      const FunctionInfo *info;
+      BitVector local;
+      DenseSet<const Value *> nonLocal;
+
+      bool test(const Value *v) const;
+      void set(const Value *v, bool tainted);
+      void merge(const TaintSet& other);
+    };
+
+    /**
+     * Values waiting to be revisited, each queued at most once at a time
+     */
+    struct Worklist {
+      deque<Value *> pending;
+      TaintSet queued;
+
+      void push(Value *v);
+      Value *pop();
+      bool empty() const { return pending.empty(); }
+    };
+
+    // Which of a function's arguments are tainted
+    typedef vector<bool> ArgMask;
+    typedef pair<const Function *, ArgMask> ContextKey;
+
+    /**
+     * When a function's return value is tainted. Taint only ever flows
+     * from a tainted operand, so this is whenever any of args is tainted,
+     * or always.
+     */
+    struct ReturnSummary {
+      bool always;
+      ArgMask args;
+
+      bool operator!=(const ReturnSummary& other) const {
+        return always != other.always || args != other.args;
+      }
+    };
+
+    FunctionInfo& getInfo(Function &F);
+    TaintSet emptyTaint(Function &F);
+
+    void summarizeReturns(const vector<const Function *>& scc, bool recursive);
+    bool taintedWith(Function &F, const ArgMask& mask);
+    bool returnTainted(const Function &F, const ArgMask& mask) const;
+    void analyzeContexts(Function &kernel);
+
+    bool functionTainted(Function &F, TaintSet& taintSet);
+    void update(Value *v, bool newVal, TaintSet& taintSet, Worklist& worklist);
+    bool isDependent(Value *v, TaintSet& taintSet, const FunctionInfo& info);
+
+    DenseMap<const Function *, unique_ptr<FunctionInfo>> infos;
+    // Taint merged over every context, per function, and for other values
+    DenseMap<const Function *, TaintSet> taint;
+    DenseSet<const Value *> nonLocalTaint;
+
+    DenseMap<const Function *, ReturnSummary> returns;
+    // The taint of each function's values in every context it is reached in
+    map<ContextKey, TaintSet> contexts;
+  };
+
+  /**
+   * ThreadDependence for the new pass manager
+   */
+  class ThreadDependenceAnalysis : public AnalysisInfoMixin<ThreadDependenceAnalysis> {
+    friend AnalysisInfoMixin<ThreadDependenceAnalysis>;
+    static AnalysisKey Key;
+  public:
+    typedef unique_ptr<ThreadDependence> Result;
+    Result run(Module &M, ModuleAnalysisManager &AM);
   };
 } // End gpucheck
 
@@ -8,8 +8,12 @@
 #include "llvm/IR/DebugLoc.h"
 
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "Utilities.h"
+#include "ThreadDepAnalysis.h"
+#include "OffsetPropagation.h"
+#include "AddrSpaceAnalysis.h"
 
 #define DEBUG_TYPE "gpuutil"
 
@@ -47,7 +51,69 @@ Value *gpucheck::getDominatingCondition(BasicBlock *left, BasicBlock *right, Dom
   return nullptr;
 }
 
+void gpucheck::printJSONString(raw_ostream& out, StringRef str) {
+  out << '"';
+  for(auto c=str.begin(),e=str.end(); c!=e; ++c) {
+    switch(*c) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      case '\t':
+        out << "\\t";
+        break;
+      default:
+        if((unsigned char)*c < 0x20)
+          out << format("\\u%04x", (unsigned)(unsigned char)*c);
+        else
+          out << *c;
+    }
+  }
+  out << '"';
+}
+
+StringRef gpucheck::DebugVariableIndex::lookup(const Function *F, const Value *v) {
+  NameMap *names;
+  {
+    lock_guard<mutex> guard(lock);
+    auto found = functions.find(F);
+    names = found == functions.end() ? nullptr : found->second.get();
+  }
+  if(!names) {
+    // Index outside the lock, so threads naming values of different
+    // functions don't wait on each other
+    unique_ptr<NameMap> indexed(new NameMap());
+    for(auto i=inst_begin(F),e=inst_end(F); i!=e; ++i) {
+      // The first call naming a value wins, as in a scan of the function
+      if(auto decl = dyn_cast<DbgDeclareInst>(&*i)) {
+        if(decl->getAddress())
+          indexed->insert(make_pair(decl->getAddress(), decl->getVariable()->getName()));
+      } else if(auto val = dyn_cast<DbgValueInst>(&*i)) {
+        if(val->getValue())
+          indexed->insert(make_pair(val->getValue(), val->getVariable()->getName()));
+      }
+    }
+    lock_guard<mutex> guard(lock);
+    // Another thread may have indexed it meanwhile; either copy will do
+    auto inserted = functions.insert(make_pair(F, move(indexed)));
+    names = inserted.first->second.get();
+  }
+  // A function's names never change once indexed, so are read unlocked
+  auto name = names->find(v);
+  return name == names->end() ? StringRef() : name->second;
+}
+
 string gpucheck::getValueName(Value *v) {
+  DebugVariableIndex index;
+  return getValueName(v, index);
+}
+
+string gpucheck::getValueName(Value *v, DebugVariableIndex& index) {
   // Constants can always generate themselves
   if(auto C=dyn_cast<ConstantInt>(v)) {
     SmallString<16> cint;
@@ -65,29 +131,25 @@ string gpucheck::getValueName(Value *v) {
   if(F == nullptr)
     return "tmp";
 
-  for(auto i=inst_begin(F),e=inst_end(F); i!=e; ++i) {
-    if(auto decl = dyn_cast<DbgDeclareInst>(&*i)) {
-      if(decl->getAddress() == v) return decl->getVariable()->getName();
-    } else if(auto val = dyn_cast<DbgValueInst>(&*i)) {
-      if(val->getValue() == v) return val->getVariable()->getName();
-    }
-  }
+  StringRef variable = index.lookup(F, v);
+  if(!variable.empty())
+    return variable.str();
 
   if(auto GEP=dyn_cast<GetElementPtrInst>(v)) {
-    string base = getValueName(GEP->getPointerOperand());
+    string base = getValueName(GEP->getPointerOperand(), index);
     if(GEP->getNumIndices() > 0) {
-      string offset = getValueName(*GEP->idx_begin());
+      string offset = getValueName(*GEP->idx_begin(), index);
       return base + "[" + offset + "]";
     } else {
       return "*" + base;
     }
   }
   if(auto L=dyn_cast<LoadInst>(v)) {
-    return getValueName(L->getPointerOperand());
+    return getValueName(L->getPointerOperand(), index);
   }
   if(auto BO=dyn_cast<BinaryOperator>(v)) {
-    string left = getValueName(BO->getOperand(0));
-    string right = getValueName(BO->getOperand(1));
+    string left = getValueName(BO->getOperand(0), index);
+    string right = getValueName(BO->getOperand(1), index);
     switch(BO->getOpcode()) {
     case BinaryOperator::Add:
       return left + "+" + right;
@@ -114,7 +176,7 @@ string gpucheck::getValueName(Value *v) {
     }
   }
   if(auto C=dyn_cast<CastInst>(v)) {
-    return getValueName(C->getOperand(0));
+    return getValueName(C->getOperand(0), index);
   }
   if(auto CI=dyn_cast<CallInst>(v)) {
     if(auto F=CI->getCalledFunction()) {
@@ -155,3 +217,13 @@ string gpucheck::getValueName(Value *v) {
   return "tmp";
 }
 #undef DEBUG_TYPE
+
+const Function *gpucheck::getCalleeThroughCasts(const CallInst *ci) {
+  return dyn_cast<Function>(ci->getCalledValue()->stripPointerCasts());
+}
+
+void gpucheck::registerGpuCheckAnalyses(ModuleAnalysisManager &MAM) {
+  MAM.registerPass([] { return ThreadDependenceAnalysis(); });
+  MAM.registerPass([] { return OffsetPropagationAnalysis(); });
+  MAM.registerPass([] { return AddrSpaceAnalysisNPM(); });
+}
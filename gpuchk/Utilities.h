@@ -1,7 +1,14 @@
 
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 
@@ -15,7 +22,45 @@ namespace gpucheck {
   extern bool isKernelFunction(const Function& F);
   extern Value *getDominatingCondition(Instruction *l, Instruction *r, DominatorTree *DT);
   extern Value *getDominatingCondition(BasicBlock *l, BasicBlock *r, DominatorTree *DT);
+  /**
+   * The source variables naming each function's values, from its
+   * llvm.dbg.declare and llvm.dbg.value calls. A function is indexed the
+   * first time one of its values is looked up, and kept for the life of
+   * the index, so the index should not outlive the module. Safe to share
+   * between kernel threads.
+   */
+  class DebugVariableIndex {
+    public:
+      /**
+       * The variable naming v, which belongs to F, or an empty string
+       */
+      StringRef lookup(const Function *F, const Value *v);
+
+    private:
+      typedef DenseMap<const Value *, StringRef> NameMap;
+      std::mutex lock;
+      DenseMap<const Function *, std::unique_ptr<NameMap>> functions;
+  };
+
+  /**
+   * A source-like expression for v, built from the names of variables in
+   * index, or if none is given, of a function indexed for this call alone
+   */
   extern string getValueName(Value *v);
+  extern string getValueName(Value *v, DebugVariableIndex& index);
+  /**
+   * Write str as a quoted, escaped JSON string
+   */
+  extern void printJSONString(raw_ostream& out, StringRef str);
+  /**
+   * The function called by ci, looking through constant casts of the callee
+   */
+  extern const Function *getCalleeThroughCasts(const CallInst *ci);
+  /**
+   * Register the gpucheck module analyses with a new pass manager. The
+   * function analysis manager proxy must already be registered.
+   */
+  extern void registerGpuCheckAnalyses(ModuleAnalysisManager &MAM);
 }
 
 #endif